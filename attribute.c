@@ -671,8 +671,21 @@ parse_attribute(ParseContext * ctx, TokenIndex * tidx, IntroType * type, int mem
 
         uint8_t * bytecode = build_expression_procedure2(ctx->expr_ctx, tree, &base_cont);
 
-        size_t value_buf_offset = arraddnindex(ctx->value_buffer, arrlen(bytecode));
-        memcpy(ctx->value_buffer + value_buf_offset, bytecode, arrlen(bytecode));
+        size_t value_buf_offset = arrlen(ctx->value_buffer);
+        int64_t constant;
+        if (ctx->gen_expr_funcs && !intro_expr_constant(bytecode, &constant)) {
+            uint32_t func_index = arrlen(ctx->p_info->expr_offsets);
+            if (func_index > UINT16_MAX) {
+                parse_error(ctx, tk, "Too many expressions for --gen-expr-funcs.");
+                return -1;
+            }
+            arrput(ctx->p_info->expr_offsets, value_buf_offset);
+            arrput(ctx->value_buffer, I_NATIVE);
+            arrput(ctx->value_buffer, func_index & 0xff);
+            arrput(ctx->value_buffer, func_index >> 8);
+        }
+        size_t code_offset = arraddnindex(ctx->value_buffer, arrlen(bytecode));
+        memcpy(ctx->value_buffer + code_offset, bytecode, arrlen(bytecode));
 
         arrfree(bytecode);
         reset_arena(ctx->expr_ctx->arena);
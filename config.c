@@ -313,6 +313,8 @@ parse_program_arguments(Config * cfg, int argc, char * argv []) {
                     cfg->gen_vim_syntax = true;
                 } else if (0==strcmp(arg, "gen-typedefs")) {
                     cfg->gen_typedefs = true;
+                } else if (0==strcmp(arg, "gen-expr-funcs")) {
+                    cfg->gen_expr_funcs = true;
                 } else if (0==strcmp(arg, "pragma")) {
                     char * text = argv[++i];
                     char * text_cpy = arena_alloc(cfg->arena, strlen(text) + 2);
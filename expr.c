@@ -77,6 +77,7 @@ struct ExprNode {
     intmax_t value;
     const IntroType * type;
     Token tk;
+    bool traps; // an integer division in the subtree would trap, so it isn't folded
 };
 
 static void UNUSED
@@ -401,9 +402,87 @@ put_imm_int(uint8_t ** pproc, uint64_t val) {
     memcpy(dest, &val, size);
 }
 
+static int
+instr_operand_size(uint8_t inst) {
+    switch((InstrCode)inst) {
+    case I_IMM8:  return 1;
+    case I_IMM16: return 2;
+    case I_IMM32: return 4;
+    case I_IMM64: return 8;
+    case I_LDK8: case I_LDK16: case I_LDK32: case I_LDK64: return 2;
+    case I_EQ_K8: case I_NE_K8: return 1;
+    case I_NATIVE: return 2;
+    default: return 0;
+    }
+}
+
+// returns true if proc is exactly one immediate, and its value
+static bool
+proc_is_imm(const uint8_t * proc, uint64_t * o_value) {
+    if (arrlen(proc) < 1) return false;
+    int size = instr_operand_size(proc[0]);
+    if (proc[0] < I_IMM8 || proc[0] > I_IMM64 || arrlen(proc) != 1 + size) return false;
+    *o_value = 0;
+    memcpy(o_value, proc + 1, size);
+    return true;
+}
+
+// true if proc doesn't read any data, so it can be run now
+static bool
+proc_is_constant(const uint8_t * proc) {
+    for (int i=0; i < arrlen(proc); i += 1 + instr_operand_size(proc[i])) {
+        if ((proc[i] >= I_LD8 && proc[i] <= I_LD64) || (proc[i] >= I_LDK8 && proc[i] <= I_LDK64)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// runs the first 'size' bytes of a constant proc
+static int64_t
+run_constant_code(const uint8_t * proc, ptrdiff_t size) {
+    uint8_t * code = NULL;
+    memcpy(arraddnptr(code, size), proc, size);
+    arrput(code, I_RETURN);
+    union IntroRegisterData result = intro_run_bytecode(code, NULL);
+    arrfree(code);
+    return result.si;
+}
+
+// x * 2^n becomes x << n
+static bool
+reduce_mul_imm(uint8_t ** pproc, const uint8_t * right_clip) {
+    uint64_t k;
+    if (!proc_is_imm(right_clip, &k) || k == 0 || (k & (k - 1)) != 0) {
+        return false;
+    }
+    uint8_t shift = 0;
+    while ((k >>= 1) != 0) shift++;
+    arrsetlen(*pproc, arrlen(*pproc) - arrlen(right_clip));
+    arrput(*pproc, I_IMM8);
+    arrput(*pproc, shift);
+    arrput(*pproc, I_L_SHIFT);
+    return true;
+}
+
+// an integer compare against a small constant is common enough in 'when' attributes to get its own instruction
+static bool
+fuse_compare_imm8(uint8_t ** pproc, const uint8_t * right_clip, uint8_t inst) {
+    if (arrlen(right_clip) == 2 && right_clip[0] == I_IMM8) {
+        uint8_t k = right_clip[1];
+        arrsetlen(*pproc, arrlen(*pproc) - 2);
+        arrput(*pproc, inst);
+        arrput(*pproc, k);
+        return true;
+    }
+    return false;
+}
+
 uint8_t *
 build_expression_procedure_internal(ExprContext * ectx, ExprNode * node, const IntroContainer * cont) {
     uint8_t * proc = NULL;
+    uint8_t * right_clip = NULL;
+    uint64_t imm;
     bool use_float_expr = false;
 
     if (node->op == OP_MACCESS || node->op == OP_OTHER || node->op == OP_CONTAINER) {
@@ -498,8 +577,14 @@ build_expression_procedure_internal(ExprContext * ectx, ExprNode * node, const I
         default: _assume(0), inst = 0;
         }
 
-        put_imm_int(&proc, offset);
-        arrput(proc, inst);
+        if (offset <= UINT16_MAX) {
+            arrput(proc, I_LDK8 + (inst - I_LD8));
+            arrput(proc, offset & 0xff);
+            arrput(proc, offset >> 8);
+        } else {
+            put_imm_int(&proc, offset);
+            arrput(proc, inst);
+        }
 
         base_node->type = node->type;
 
@@ -536,7 +621,7 @@ build_expression_procedure_internal(ExprContext * ectx, ExprNode * node, const I
             if (clip) {
                 void * dest = arraddnptr(proc, arrlen(clip));
                 memcpy(dest, clip, arrlen(clip));
-                arrfree(clip);
+                right_clip = clip;
             }
 
             if (ectx->ctx && use_float_expr) {
@@ -657,7 +742,7 @@ build_expression_procedure_internal(ExprContext * ectx, ExprNode * node, const I
     case OP_MUL:
         if (use_float_expr) {
             arrput(proc, I_MULF);
-        } else {
+        } else if (!reduce_mul_imm(&proc, right_clip)) {
             arrput(proc, I_MULI);
         }
         break;
@@ -697,30 +782,32 @@ build_expression_procedure_internal(ExprContext * ectx, ExprNode * node, const I
         break;
 
     case OP_LESS:
-        arrput(proc, (use_float_expr)? I_CMP : I_CMP_F);
+        arrput(proc, (use_float_expr)? I_CMP_F : I_CMP);
         arrput(proc, I_SETL);
         break;
     case OP_LESS_OR_EQUAL:
-        arrput(proc, (use_float_expr)? I_CMP : I_CMP_F);
+        arrput(proc, (use_float_expr)? I_CMP_F : I_CMP);
         arrput(proc, I_SETLE);
         break;
     case OP_GREATER:
-        arrput(proc, (use_float_expr)? I_CMP : I_CMP_F);
+        arrput(proc, (use_float_expr)? I_CMP_F : I_CMP);
         arrput(proc, I_SETLE);
         arrput(proc, I_BOOL_NOT);
         break;
     case OP_GREATER_OR_EQUAL:
-        arrput(proc, (use_float_expr)? I_CMP : I_CMP_F);
+        arrput(proc, (use_float_expr)? I_CMP_F : I_CMP);
         arrput(proc, I_SETL);
         arrput(proc, I_BOOL_NOT);
         break;
 
     case OP_EQUAL:
-        arrput(proc, (use_float_expr)? I_CMP : I_CMP_F);
+        if (!use_float_expr && fuse_compare_imm8(&proc, right_clip, I_EQ_K8)) break;
+        arrput(proc, (use_float_expr)? I_CMP_F : I_CMP);
         arrput(proc, I_SETE);
         break;
     case OP_NOT_EQUAL:
-        arrput(proc, (use_float_expr)? I_CMP : I_CMP_F);
+        if (!use_float_expr && fuse_compare_imm8(&proc, right_clip, I_NE_K8)) break;
+        arrput(proc, (use_float_expr)? I_CMP_F : I_CMP);
         arrput(proc, I_SETE);
         arrput(proc, I_BOOL_NOT);
         break;
@@ -750,13 +837,78 @@ build_expression_procedure_internal(ExprContext * ectx, ExprNode * node, const I
         break;
     }
 
+    // fold constant subtrees into one immediate, unless the immediate would be longer (small negative numbers)
+    // the first half of a ternary leaves 2 values, so it waits for the second half
+    // integer x / 0 and INT64_MIN / -1 trap, they are left to the VM
+    node->traps = (node->left && node->left->traps) || (node->right && node->right->traps);
+    if ((node->op == OP_DIV || node->op == OP_MOD) && !use_float_expr && !node->traps
+        && right_clip && proc_is_constant(proc))
+    {
+        ptrdiff_t left_size = arrlen(proc) - arrlen(right_clip) - 1;
+        int64_t dividend = run_constant_code(proc, left_size);
+        int64_t divisor = run_constant_code(right_clip, arrlen(right_clip));
+        node->traps = divisor == 0 || (divisor == -1 && dividend == INT64_MIN);
+    }
+    if (node->op != OP_TERNARY_1 && proc && !node->traps
+        && !proc_is_imm(proc, &imm) && proc_is_constant(proc))
+    {
+        arrput(proc, I_RETURN);
+        union IntroRegisterData result = intro_run_bytecode(proc, NULL);
+        arrsetlen(proc, arrlen(proc) - 1);
+        uint8_t * folded = NULL;
+        put_imm_int(&folded, result.ui);
+        if (arrlen(folded) <= arrlen(proc)) {
+            arrfree(proc);
+            proc = folded;
+        } else {
+            arrfree(folded);
+        }
+    }
+
+    arrfree(right_clip);
     return proc;
 }
 
+// the deepest the VM stack gets while running code
+static int
+expr_stack_depth(const uint8_t * code) {
+    int depth = 0, max_depth = 0;
+    for (int i=0; code[i] != I_RETURN; i += 1 + instr_operand_size(code[i])) {
+        switch((InstrCode)code[i]) {
+        case I_IMM8: case I_IMM16: case I_IMM32: case I_IMM64:
+        case I_ZERO:
+        case I_LDK8: case I_LDK16: case I_LDK32: case I_LDK64:
+            depth++; break;
+
+        case I_CND_LD_TOP: depth -= 2; break;
+
+        case I_ADDI: case I_MULI: case I_DIVI: case I_MODI:
+        case I_L_SHIFT: case I_R_SHIFT:
+        case I_BIT_AND: case I_BIT_OR: case I_BIT_XOR:
+        case I_CMP: case I_CMP_F:
+        case I_ADDF: case I_MULF: case I_DIVF:
+            depth--; break;
+
+        default: break;
+        }
+        if (depth > max_depth) max_depth = depth;
+    }
+    return max_depth;
+}
+
 uint8_t *
 build_expression_procedure2(ExprContext * ectx, ExprNode * tree, const IntroContainer * cont) {
     uint8_t * result = build_expression_procedure_internal(ectx, tree, cont);
     arrput(result, I_RETURN);
+    if (expr_stack_depth(result) > INTRO_EXPR_STACK_SIZE) {
+        char * msg = "Expression is too complex.";
+        if (ectx->mode == MODE_PARSE) {
+            parse_error(ectx->ctx, tree->tk, msg);
+        } else {
+            preprocess_message_internal(ectx->ploc, &tree->tk, msg, 0);
+        }
+        exit(1);
+    }
     return result;
 }
 
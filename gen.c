@@ -22,6 +22,199 @@ make_identifier_safe_name(const char * name) {
     return result;
 }
 
+typedef struct {
+    uint64_t hash;
+    struct {
+        void * key;
+        int value;
+    } * visited;
+    IntroContext attr_ctx;
+} SchemaHasher;
+
+static void
+schema_hash_bytes(SchemaHasher * h, const void * data, size_t size) {
+    // FNV-1a
+    for (size_t i=0; i < size; i++) {
+        h->hash ^= ((const uint8_t *)data)[i];
+        h->hash *= 0x100000001b3;
+    }
+}
+
+static void
+schema_hash_u32(SchemaHasher * h, uint32_t value) {
+    schema_hash_bytes(h, &value, sizeof(value));
+}
+
+// Hashes everything that a city file stores about a type, plus its layout.
+// Types are numbered in the order they are visited so the result doesn't depend on the type table.
+static void
+schema_hash_type(SchemaHasher * h, const IntroType * type) {
+    int visit_index = hmget(h->visited, (void *)type);
+    if (visit_index >= 0) {
+        schema_hash_u32(h, 0xffffffff);
+        schema_hash_u32(h, visit_index);
+        return;
+    }
+    hmput(h->visited, (void *)type, (int)hmlen(h->visited));
+
+    schema_hash_u32(h, type->category);
+    schema_hash_u32(h, type->size);
+    schema_hash_u32(h, type->count);
+
+    switch(type->category) {
+    case INTRO_ARRAY:
+    case INTRO_POINTER: {
+        schema_hash_type(h, type->of);
+    }break;
+
+    case INTRO_STRUCT:
+    case INTRO_UNION: {
+        for (int m_i=0; m_i < type->count; m_i++) {
+            const IntroMember * m = &type->members[m_i];
+            schema_hash_u32(h, m->offset);
+            int32_t id;
+            if (intro_attribute_int_x(&h->attr_ctx, m->attr, h->attr_ctx.attr.builtin.id, &id)) {
+                schema_hash_u32(h, 1);
+                schema_hash_u32(h, id);
+            } else if (m->name) {
+                schema_hash_u32(h, 2);
+                schema_hash_bytes(h, m->name, strlen(m->name) + 1);
+            } else {
+                schema_hash_u32(h, 0);
+            }
+            schema_hash_type(h, m->type);
+        }
+    }break;
+
+    default: break;
+    }
+}
+
+static uint64_t
+schema_hash(const ParseInfo * info, const IntroType * type) {
+    SchemaHasher h;
+    memset(&h, 0, sizeof(h));
+    h.hash = 0xcbf29ce484222325;
+    hmdefault(h.visited, -1);
+    h.attr_ctx.attr = info->attr;
+    h.attr_ctx.values = info->value_buffer;
+
+    schema_hash_type(&h, type);
+
+    hmfree(h.visited);
+    return h.hash;
+}
+
+// translates expression bytecode to C, one statement per instruction
+// stack slot 0 only ever holds the initial r, which is never read, so it is not stored
+static void
+generate_expr_func(char ** s, const uint8_t * code, int func_index) {
+    int max_depth = expr_stack_depth(code);
+    // only the flags that are read are declared and set
+    bool reads_fl = false, reads_fe = false;
+    for (int i=0; code[i] != I_RETURN; i += 1 + instr_operand_size(code[i])) {
+        if (code[i] == I_SETL || code[i] == I_SETLE) reads_fl = true;
+        if (code[i] == I_SETE || code[i] == I_SETLE) reads_fe = true;
+    }
+
+    strputf(s, "static int64_t\n__intro_expr_%i(const void * base) {\n", func_index);
+    strputf(s, "    const uint8_t * data = (const uint8_t *)base; (void)data;\n");
+    strputf(s, "    union IntroRegisterData r = {0};\n");
+    for (int slot=1; slot < max_depth; slot++) {
+        strputf(s, "    union IntroRegisterData s%i;\n", slot);
+    }
+    if (reads_fl) strputf(s, "    bool fl = 0;\n");
+    if (reads_fe) strputf(s, "    bool fe = 0;\n");
+
+    static const char * const load_types [] = {"uint8_t", "uint16_t", "uint32_t", "uint64_t"};
+    int depth = 0;
+    for (int i=0; ; i += 1 + instr_operand_size(code[i])) {
+        InstrCode inst = (InstrCode)code[i];
+        const uint8_t * operand = code + i + 1;
+        const char * op = NULL;
+        bool fp = false;
+
+        if ((inst >= I_IMM8 && inst <= I_ZERO) || (inst >= I_LDK8 && inst <= I_LDK64)) {
+            if (depth > 0) strputf(s, "    s%i = r;\n", depth);
+            depth++;
+        }
+
+        switch(inst) {
+        case I_RETURN: strputf(s, "    return r.si;\n}\n\n"); return;
+
+        case I_LD8: case I_LD16: case I_LD32: case I_LD64:
+            strputf(s, "    r.ui = *(%s *)(data + r.ui);\n", load_types[inst - I_LD8]);
+            break;
+
+        case I_LDK8: case I_LDK16: case I_LDK32: case I_LDK64:
+            strputf(s, "    r.ui = *(%s *)(data + %u);\n", load_types[inst - I_LDK8], operand[0] | operand[1] << 8);
+            break;
+
+        case I_IMM8: case I_IMM16: case I_IMM32: case I_IMM64: {
+            uint64_t value = 0;
+            memcpy(&value, operand, instr_operand_size(inst));
+            strputf(s, "    r.ui = 0x%llxULL;\n", (unsigned long long)value);
+        }break;
+        case I_ZERO: strputf(s, "    r.ui = 0;\n"); break;
+
+        case I_CND_LD_TOP:
+            depth -= 2;
+            strputf(s, "    if (s%i.ui) r = s%i;\n", depth, depth + 1);
+            break;
+
+        case I_NEGATE_I:   strputf(s, "    r.si = -r.si;\n"); break;
+        case I_NEGATE_F:   strputf(s, "    r.df = -r.df;\n"); break;
+        case I_BIT_NOT:    strputf(s, "    r.ui = ~r.ui;\n"); break;
+        case I_BOOL:       strputf(s, "    r.ui = !!r.ui;\n"); break;
+        case I_BOOL_NOT:   strputf(s, "    r.ui = !r.ui;\n"); break;
+        case I_SETL:       strputf(s, "    r.ui = fl;\n"); break;
+        case I_SETE:       strputf(s, "    r.ui = fe;\n"); break;
+        case I_SETLE:      strputf(s, "    r.ui = fe || fl;\n"); break;
+        case I_CVT_D_TO_I: strputf(s, "    r.si = (int64_t)r.df;\n"); break;
+        case I_CVT_F_TO_I: strputf(s, "    r.si = (int64_t)r.sf;\n"); break;
+        case I_CVT_I_TO_D: strputf(s, "    r.df = (double)r.si;\n"); break;
+        case I_CVT_F_TO_D: strputf(s, "    r.df = (double)r.sf;\n"); break;
+
+        case I_ADDI: op = "+"; break;
+        case I_MULI: op = "*"; break;
+        case I_DIVI: op = "/"; break;
+        case I_MODI: op = "%"; break;
+        case I_ADDF: op = "+"; fp = true; break;
+        case I_MULF: op = "*"; fp = true; break;
+        case I_DIVF: op = "/"; fp = true; break;
+
+        case I_L_SHIFT: depth--; strputf(s, "    r.ui = s%i.ui << r.ui;\n", depth); break;
+        case I_R_SHIFT: depth--; strputf(s, "    r.ui = s%i.ui >> r.ui;\n", depth); break;
+        case I_BIT_AND: depth--; strputf(s, "    r.ui = s%i.ui & r.ui;\n", depth); break;
+        case I_BIT_OR:  depth--; strputf(s, "    r.ui = s%i.ui | r.ui;\n", depth); break;
+        case I_BIT_XOR: depth--; strputf(s, "    r.ui = s%i.ui ^ r.ui;\n", depth); break;
+
+        case I_CMP: case I_CMP_F: {
+            const char * field = (inst == I_CMP_F)? "df" : "si";
+            depth--;
+            if (reads_fl) strputf(s, "    fl = s%i.%s < r.%s;\n", depth, field, field);
+            if (reads_fe) strputf(s, "    fe = s%i.%s == r.%s;\n", depth, field, field);
+        }break;
+
+        case I_EQ_K8: strputf(s, "    r.ui = r.si == %u;\n", operand[0]); break;
+        case I_NE_K8: strputf(s, "    r.ui = r.si != %u;\n", operand[0]); break;
+
+        case I_NATIVE: break;
+
+        case I_INVALID: case I_COUNT: assert(0); break;
+        }
+
+        if (op) {
+            depth--;
+            if (fp) {
+                strputf(s, "    r.df = s%i.df %s r.df;\n", depth, op);
+            } else {
+                strputf(s, "    r.si = s%i.si %s r.si;\n", depth, op);
+            }
+        }
+    }
+}
+
 int
 generate_c_header(const Config * cfg, PreInfo * pre_info, ParseInfo * info) {
     char * s = NULL;
@@ -77,8 +270,8 @@ generate_c_header(const Config * cfg, PreInfo * pre_info, ParseInfo * info) {
                     } else {
                         strputf(&mbr, "{0, ");
                     }
-                    strputf(&mbr, "&__intro_t[%i], %u, {%u}},\n",
-                                  member_type_index, m.offset, m.attr.offset);
+                    strputf(&mbr, "&__intro_t[%i], %u, {%u}, 0x%08x},\n",
+                                  member_type_index, m.offset, m.attr.offset, (m.name)? intro_name_hash(m.name) : 0);
                 }
                 struct_member_index += t->count;
             }break;
@@ -251,6 +444,20 @@ generate_c_header(const Config * cfg, PreInfo * pre_info, ParseInfo * info) {
     }
     strputf(&s, "\n};\n\n");
 
+    // running popcount of each bitset, so looking up a value doesn't loop over the words before it
+    const int count_words = LENGTH(info->attr.data[0].bitset);
+    strputf(&s, "const uint8_t __intro_attr_prefix [%i][%i] = {\n", (int)arrlen(info->attr.data), count_words);
+    for (int data_i=0; data_i < arrlen(info->attr.data); data_i++) {
+        int count = 0;
+        strputf(&s, "{");
+        for (int word_i=0; word_i < count_words; word_i++) {
+            strputf(&s, "%i,", count);
+            count += INTRO_POPCNT32(info->attr.data[data_i].bitset[word_i]);
+        }
+        strputf(&s, "},\n");
+    }
+    strputf(&s, "};\n\n");
+
     // values
     strputf(&s, "unsigned char __intro_values [%i] = {", (int)arrlen(info->value_buffer));
     for (int i=0; i < arrlen(info->value_buffer); i++) {
@@ -262,6 +469,29 @@ generate_c_header(const Config * cfg, PreInfo * pre_info, ParseInfo * info) {
     }
     strputf(&s, "\n};\n\n");
 
+    // expressions as C functions, see I_NATIVE
+    for (int i=0; i < arrlen(info->expr_offsets); i++) {
+        generate_expr_func(&s, &info->value_buffer[info->expr_offsets[i] + 3], i);
+    }
+    if (arrlen(info->expr_offsets) > 0) {
+        strputf(&s, "const IntroExprFunc __intro_expr_funcs [%i] = {\n", (int)arrlen(info->expr_offsets));
+        for (int i=0; i < arrlen(info->expr_offsets); i++) {
+            strputf(&s, "__intro_expr_%i,\n", i);
+        }
+        strputf(&s, "};\n\n");
+    }
+
+    // schema hashes
+    strputf(&s, "const uint64_t __intro_schema_hashes [%u] = {", info->count_types);
+    for (int type_index = 0; type_index < info->count_types; type_index++) {
+        if (type_index % 4 == 0) {
+            strputf(&s, "\n");
+        }
+        unsigned long long hash = schema_hash(info, info->types[type_index]);
+        strputf(&s, "0x%016llxULL,", hash);
+    }
+    strputf(&s, "\n};\n\n");
+
     // type enum
     strputf(&s, "enum {\n");
     for (int type_index = 0; type_index < info->count_types; type_index++) {
@@ -327,9 +557,11 @@ generate_c_header(const Config * cfg, PreInfo * pre_info, ParseInfo * info) {
     for (int i=0; i < LENGTH(g_builtin_attributes); i++) {
         strputf(&s, "IATTR_%s,", g_builtin_attributes[i].key);
     }
-    strputf(&s, "}},\n");
+    strputf(&s, "}, __intro_attr_prefix},\n");
 
     strputf(&s, "\"%s\",", VERSION);
+    strputf(&s, "__intro_schema_hashes,");
+    strputf(&s, "%s,", (arrlen(info->expr_offsets) > 0)? "__intro_expr_funcs" : "0");
 
     strputf(&s, "};\n");
 
@@ -169,6 +169,7 @@ typedef struct {
     bool gen_city : 1;
     bool gen_vim_syntax : 1;
     bool gen_typedefs : 1;
+    bool gen_expr_funcs : 1;
     bool show_metrics : 1;
     bool pre_only : 1;
 } Config;
@@ -280,6 +281,7 @@ typedef struct ParseInfo {
     uint8_t * value_buffer;
     IntroFunction ** functions;
     struct IntroAttributeContext attr;
+    uint32_t * expr_offsets; // value offsets of expressions that get a C function
     uint32_t count_types;
     uint32_t count_functions;
 } ParseInfo;
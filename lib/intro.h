@@ -132,6 +132,7 @@ typedef struct IntroMember {
     IntroType * type;
     uint32_t offset;
     IntroAttributeDataId attr;
+    uint32_t name_hash; // intro_name_hash(name), or 0 if it wasn't computed
 } IntroMember;
 
 typedef struct IntroEnumValue {
@@ -237,6 +238,9 @@ typedef struct IntroAttributeContext {
         uint8_t gui_edit_color;
         uint8_t gui_edit_text;
     } builtin;
+
+    // for each entry in data, the number of attributes set in the bitset words before each word
+    const uint8_t (*prefix_counts) [(INTRO_MAX_ATTRIBUTES+31) / 32];
 } IntroAttributeContext;
 
 typedef struct IntroMacro {
@@ -247,6 +251,8 @@ typedef struct IntroMacro {
     uint32_t count_parameters;
 } IntroMacro;
 
+typedef int64_t (*IntroExprFunc)(const void * base);
+
 typedef struct IntroContext {
     IntroType * types         I(length count_types);
     uint8_t * values          I(length size_values);
@@ -261,6 +267,8 @@ typedef struct IntroContext {
     IntroAttributeContext attr; 
 
     const char * version;
+    const uint64_t * schema_hashes I(length count_types); // structural hash of each type, see CITY_FORMAT.md
+    const IntroExprFunc * expr_funcs; // generated with --gen-expr-funcs, indexed by I_NATIVE
 } IntroContext;
 
 typedef struct IntroVariant {
@@ -390,6 +398,22 @@ intro_get_attr(IntroContainer cntr) {
     }
 }
 
+// FNV-1a, never 0 so that 0 can mean "not computed"
+INTRO_API_INLINE uint32_t
+intro_name_hash(const char * name) {
+    uint32_t hash = 0x811c9dc5;
+    for (const char * c = name; *c; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 0x01000193;
+    }
+    return (hash)? hash : 1;
+}
+
+INTRO_API_INLINE uint32_t
+intro_member_name_hash(const IntroMember * member) {
+    return (member->name_hash)? member->name_hash : intro_name_hash(member->name);
+}
+
 INTRO_API_INLINE const IntroMember *
 intro_get_member(IntroContainer cntr) {
     if (intro_has_members(cntr.parent->type)) {
@@ -417,6 +441,8 @@ bool intro_attribute_float_x(IntroContext * ctx, IntroAttributeDataId data_id, I
 bool intro_attribute_length_x(IntroContext * ctx, IntroContainer cont, int64_t * o_length);
 #define intro_attribute_run_expr(C, A, OUT) intro_attribute_expr_x(INTRO_CTX, C, IATTR_##A, OUT)
 bool intro_attribute_expr_x(IntroContext * ctx, IntroContainer cntr, IntroAttribute attr_id, int64_t * o_result);
+#define intro_attribute_run_expr_batch(C, STRIDE, COUNT, A, OUT) intro_attribute_expr_batch_x(INTRO_CTX, C, STRIDE, COUNT, IATTR_##A, OUT)
+bool intro_attribute_expr_batch_x(IntroContext * ctx, IntroContainer first, size_t stride, size_t count, IntroAttribute attr_id, int64_t * o_results);
 #define intro_attribute_type(M, A) intro_attribute_type_x(INTRO_CTX, M->attr, IATTR_##A)
 const IntroType * intro_attribute_type_x(IntroContext * ctx, IntroAttributeDataId data_id, IntroAttribute attr_id);
 
@@ -433,6 +459,11 @@ void intro_print_x(IntroContext * ctx, IntroContainer container, const IntroPrin
 
 void intro_sprint_json_x(IntroContext * ctx, char * buf, const void * data, const IntroType * type, const IntroPrintOptions * opt);
 
+// ARENA
+typedef struct IntroArena IntroArena;
+IntroArena * intro_create_arena(void);
+void intro_free_arena(IntroArena * arena);
+
 // CITY IMPLEMENTATION
 char * intro_read_file(const char * filename, size_t * o_size);
 int intro_dump_file(const char * filename, void * data, size_t data_size);
@@ -442,8 +473,71 @@ bool intro_load_city_file_x(IntroContext * ctx, void * dest, const IntroType * d
 bool intro_create_city_file_x(IntroContext * ctx, const char * filename, void * src, const IntroType * src_type);
 #define intro_create_city(src, s_type, o_size) intro_create_city_x(INTRO_CTX, src, s_type, o_size)
 void * intro_create_city_x(IntroContext * ctx, const void * src, const IntroType * s_type, size_t *o_size);
+#define intro_create_city_compressed(src, s_type, o_size) intro_create_city_compressed_x(INTRO_CTX, src, s_type, o_size)
+void * intro_create_city_compressed_x(IntroContext * ctx, const void * src, const IntroType * s_type, size_t *o_size);
+#define intro_create_city_parallel(src, s_type, o_size, count_threads) intro_create_city_parallel_x(INTRO_CTX, src, s_type, o_size, count_threads)
+void * intro_create_city_parallel_x(IntroContext * ctx, const void * src, const IntroType * s_type, size_t *o_size, int count_threads);
+bool intro_city_set_checksum(void * data, size_t data_size);
 #define intro_load_city(dest, dest_type, data, data_size) intro_load_city_x(INTRO_CTX, dest, dest_type, data, data_size)
 int intro_load_city_x(IntroContext * ctx, void * dest, const IntroType * d_type, void * data, size_t data_size);
+typedef void * (*IntroAllocProc)(void * user, size_t size);
+typedef struct {
+    IntroArena * arena;   // if set, everything the load allocates comes from here. free it all with intro_free_arena
+    IntroAllocProc alloc; // otherwise if set, used instead of malloc
+    void * alloc_user;
+    bool lazy;            // leave pointers as handles until intro_city_resolve is called. needs intro_city_open
+    int count_threads;    // if above 1, large arrays are loaded by this many threads
+    bool validate;        // bounds check everything read from the file and verify its checksum
+} IntroLoadOptions;
+#define intro_load_city_opt(dest, dest_type, data, data_size, opt) intro_load_city_opt_x(INTRO_CTX, dest, dest_type, data, data_size, opt)
+int intro_load_city_opt_x(IntroContext * ctx, void * dest, const IntroType * d_type, void * data, size_t data_size, const IntroLoadOptions * opt);
+typedef bool (*IntroWriteProc)(void * user, const void * data, size_t size); // returns false on failure
+#define intro_write_city_stream(write_proc, user, src, src_type) intro_write_city_stream_x(INTRO_CTX, write_proc, user, src, src_type)
+bool intro_write_city_stream_x(IntroContext * ctx, IntroWriteProc write_proc, void * user, const void * src, const IntroType * src_type);
+#define intro_create_city_native_file(filename, src, src_type) intro_create_city_native_file_x(INTRO_CTX, filename, src, src_type)
+bool intro_create_city_native_file_x(IntroContext * ctx, const char * filename, const void * src, const IntroType * src_type);
+#define intro_load_city_in_place(data, data_size, dest_type) intro_load_city_in_place_x(INTRO_CTX, data, data_size, dest_type)
+void * intro_load_city_in_place_x(IntroContext * ctx, void * data, size_t data_size, const IntroType * d_type);
+typedef struct {
+    void * base;
+    size_t size;
+    bool is_mapped;
+} IntroCityMap;
+#define intro_map_city_file(filename, dest_type, o_map) intro_map_city_file_x(INTRO_CTX, filename, dest_type, o_map)
+void * intro_map_city_file_x(IntroContext * ctx, const char * filename, const IntroType * d_type, IntroCityMap * o_map);
+void intro_unmap_city_file(IntroCityMap * map);
+typedef struct IntroCity IntroCity;
+#define intro_city_open(data, data_size, opt) intro_city_open_x(INTRO_CTX, data, data_size, opt)
+IntroCity * intro_city_open_x(IntroContext * ctx, void * data, size_t data_size, const IntroLoadOptions * opt);
+#define intro_city_open_file(filename, opt) intro_city_open_file_x(INTRO_CTX, filename, opt)
+IntroCity * intro_city_open_file_x(IntroContext * ctx, const char * filename, const IntroLoadOptions * opt);
+int intro_city_load(IntroCity * city, void * dest, const IntroType * dest_type);
+void * intro_city_resolve(IntroCity * city, void * p_ptr);
+void intro_city_close(IntroCity * city);
+int intro_city_load_at(IntroCity * city, const char * path, void * dest, const IntroType * dest_type);
+typedef struct IntroCityLog IntroCityLog;
+#define intro_city_log_create(type, write_proc, user) intro_city_log_create_x(INTRO_CTX, type, write_proc, user)
+IntroCityLog * intro_city_log_create_x(IntroContext * ctx, const IntroType * type, IntroWriteProc write_proc, void * user);
+bool intro_city_log_append(IntroCityLog * log, const void * record);
+bool intro_city_log_close(IntroCityLog * log);
+int intro_city_log_next(IntroCity * city, void * dest, const IntroType * dest_type);
+int64_t intro_city_count(IntroCity * city);
+int intro_city_load_index(IntroCity * city, uint64_t index, void * dest, const IntroType * dest_type);
+#define intro_create_city_schema(type, o_size) intro_create_city_schema_x(INTRO_CTX, type, o_size)
+void * intro_create_city_schema_x(IntroContext * ctx, const IntroType * type, size_t * o_size);
+#define intro_create_city_shared(src, src_type, o_size) intro_create_city_shared_x(INTRO_CTX, src, src_type, o_size)
+void * intro_create_city_shared_x(IntroContext * ctx, const void * src, const IntroType * src_type, size_t * o_size);
+#define intro_city_register_schema(data, data_size) intro_city_register_schema_x(INTRO_CTX, data, data_size)
+bool intro_city_register_schema_x(IntroContext * ctx, void * data, size_t data_size);
+void intro_city_clear_schema_cache(void);
+#define intro_city_diff(base, new_data, type, o_size) intro_city_diff_x(INTRO_CTX, base, new_data, type, o_size)
+void * intro_city_diff_x(IntroContext * ctx, const void * base, const void * new_data, const IntroType * type, size_t * o_size);
+#define intro_city_apply_delta(dest, base, type, delta, delta_size) intro_city_apply_delta_x(INTRO_CTX, dest, base, type, delta, delta_size)
+int intro_city_apply_delta_x(IntroContext * ctx, void * dest, const void * base, const IntroType * type, const void * delta, size_t delta_size);
+#define intro_city_load_path(data, data_size, path, dest, dest_type) intro_city_load_path_x(INTRO_CTX, data, data_size, path, dest, dest_type)
+int intro_city_load_path_x(IntroContext * ctx, void * data, size_t data_size, const char * path, void * dest, const IntroType * d_type);
+typedef void (*IntroErrorProc)(void * user, const char * msg);
+void intro_city_set_error_proc(IntroErrorProc proc, void * user);
 
 // DEAR IMGUI (must link with intro_imgui.cpp to use)
 #define intro_imgui_edit(data, data_type) intro_imgui_edit_x(INTRO_CTX, intro_cntr(data, data_type), #data)
@@ -456,6 +550,7 @@ const char * intro_enum_name(const IntroType * type, int value);
 int64_t intro_int_value(const void * data, const IntroType * type);
 #define intro_member_by_name(t, name) intro_member_by_name_x(t, #name)
 const IntroMember * intro_member_by_name_x(const IntroType * type, const char * name);
+#define INTRO_EXPR_STACK_SIZE 32 // the parser refuses expressions that would need more
 union IntroRegisterData intro_run_bytecode(const uint8_t * code, const void * data);
 
 #define INTRO_LIB_VERSION 402
@@ -468,12 +563,40 @@ union IntroRegisterData intro_run_bytecode(const uint8_t * code, const void * da
 #include <stdio.h>
 #include <string.h>
 
+#if !defined(_WIN32) && !defined(INTRO_NO_MMAP)
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #define INTRO_HAVE_MMAP 1
+#else
+  #define INTRO_HAVE_MMAP 0
+#endif
+
+#if !defined(_WIN32) && !defined(INTRO_NO_THREADS)
+  #include <pthread.h>
+  #include <unistd.h>
+  #define INTRO_HAVE_THREADS 1
+#else
+  #define INTRO_HAVE_THREADS 0
+#endif
+
 #if defined(__GNUC__)
   #define INTRO_UNUSED __attribute__((unused))
 #else
   #define INTRO_UNUSED
 #endif
 
+#if defined(__INTRO__)
+  #define INTRO_THREAD_LOCAL
+#elif defined(__cplusplus)
+  #define INTRO_THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+  #define INTRO_THREAD_LOCAL __declspec(thread)
+#else
+  #define INTRO_THREAD_LOCAL _Thread_local
+#endif
+
 #ifndef LENGTH
 #define LENGTH(a) (sizeof(a)/sizeof(*(a)))
 #endif
@@ -521,28 +644,59 @@ static const char * tab = "    ";
 typedef uint8_t u8;
 
 typedef struct {
+    void * data;
+    size_t size;
+} MemArenaBucket;
+
+typedef struct IntroArena {
     int current;
-    int current_used;
-    int capacity;
-    struct {
-        void * data;
-    } buckets [256]; // should be enough for anyone
+    int count_buckets;
+    size_t current_used;
+    size_t capacity;
+    MemArenaBucket * buckets; // each new bucket is larger than the last, up to 16MiB
+    void ** large; // requests larger than a bucket get their own block
+    int count_large;
 } MemArena;
 
+// Lists start with 8 slots and double when full. Returns false if it can't grow.
+static bool
+arena_grow_list(void ** p_list, int count, size_t elem_size) {
+    if (count > 0 && (count < 8 || (count & (count - 1)) != 0)) return true;
+    size_t new_count = (count == 0)? 8 : (size_t)count * 2;
+    void * list = realloc(*p_list, new_count * elem_size);
+    if (!list) return false;
+    memset((u8 *)list + count * elem_size, 0, (new_count - count) * elem_size);
+    *p_list = list;
+    return true;
+}
+
+// Returns zeroed memory, or NULL if it can't be allocated.
 static void *
-arena_alloc(MemArena * arena, int amount) {
-    if (arena->current_used + amount > arena->capacity) {
-        if (amount <= arena->capacity) {
-            arena->current++;
-            assert(arena->current < (int)LENGTH(arena->buckets));
-            if (arena->buckets[arena->current].data == NULL) {
-                arena->buckets[arena->current].data = calloc(1, arena->capacity);
+arena_alloc(MemArena * arena, size_t amount) {
+    if (amount > arena->capacity) {
+        if (!arena_grow_list((void **)&arena->large, arena->count_large, sizeof(arena->large[0]))) return NULL;
+        void * block = calloc(1, amount);
+        if (block) arena->large[arena->count_large++] = block;
+        return block;
+    }
+    if (arena->current_used + amount > arena->buckets[arena->current].size) {
+        int next = arena->current + 1;
+        if (next == arena->count_buckets) {
+            if (!arena_grow_list((void **)&arena->buckets, arena->count_buckets, sizeof(arena->buckets[0]))) return NULL;
+            arena->count_buckets *= 2;
+        }
+        MemArenaBucket * bucket = &arena->buckets[next];
+        if (bucket->size < amount) {
+            if (bucket->data == NULL && arena->capacity < (1 << 24)) {
+                arena->capacity <<= 1;
             }
-        } else {
-            arena->current++;
-            arena->buckets[arena->current].data = realloc(arena->buckets[arena->current].data, amount);
-            memset(arena->buckets[arena->current].data, 0, amount);
+            void * data = calloc(1, arena->capacity);
+            if (!data) return NULL;
+            free(bucket->data);
+            bucket->data = data;
+            bucket->size = arena->capacity;
         }
+        arena->current = next;
         arena->current_used = 0;
     }
     void * result = (u8 *)arena->buckets[arena->current].data + arena->current_used;
@@ -552,30 +706,72 @@ arena_alloc(MemArena * arena, int amount) {
 }
 
 static MemArena *
-new_arena(int capacity) {
+new_arena(size_t capacity) {
     MemArena * arena = (MemArena *)calloc(1, sizeof(MemArena));
     arena->capacity = capacity;
+    arena_grow_list((void **)&arena->buckets, 0, sizeof(arena->buckets[0]));
+    arena->count_buckets = 8;
     arena->buckets[0].data = calloc(1, arena->capacity);
+    arena->buckets[0].size = arena->capacity;
     return arena;
 }
 
 static void INTRO_UNUSED
 reset_arena(MemArena * arena) {
     for (int i=0; i <= arena->current; i++) {
-        memset(arena->buckets[i].data, 0, arena->capacity);
+        memset(arena->buckets[i].data, 0, arena->buckets[i].size);
+    }
+    for (int i=0; i < arena->count_large; i++) {
+        free(arena->large[i]);
     }
+    arena->count_large = 0;
     arena->current = 0;
     arena->current_used = 0;
 }
 
 static void
 free_arena(MemArena * arena) {
-    for (uint32_t i=0; i < LENGTH(arena->buckets); i++) {
-        if (arena->buckets[i].data) free(arena->buckets[i].data);
+    for (int i=0; i < arena->count_buckets; i++) {
+        free(arena->buckets[i].data);
     }
+    for (int i=0; i < arena->count_large; i++) {
+        free(arena->large[i]);
+    }
+    free(arena->buckets);
+    free(arena->large);
     free(arena);
 }
 
+// Moves the memory of 'other' into 'arena', to be freed with it, and frees 'other'.
+// Returns false if 'arena' can't hold more blocks, the memory of 'other' is then leaked.
+static bool INTRO_UNUSED
+arena_adopt(MemArena * arena, MemArena * other) {
+    bool ok = true;
+    for (int i=0; i < other->count_buckets + other->count_large; i++) {
+        void * block = (i < other->count_buckets)? other->buckets[i].data : other->large[i - other->count_buckets];
+        if (!block) continue;
+        if (!arena_grow_list((void **)&arena->large, arena->count_large, sizeof(arena->large[0]))) {
+            ok = false;
+            break;
+        }
+        arena->large[arena->count_large++] = block;
+    }
+    free(other->buckets);
+    free(other->large);
+    free(other);
+    return ok;
+}
+
+IntroArena *
+intro_create_arena(void) {
+    return new_arena(4096);
+}
+
+void
+intro_free_arena(IntroArena * arena) {
+    free_arena(arena);
+}
+
 typedef struct {
     size_t cap;
     size_t len;
@@ -730,6 +926,14 @@ free_table_(HashTable * tbl) {
     free(tbl);
 }
 
+// removes every entry but keeps the allocations
+static void INTRO_UNUSED
+table_clear(HashTable * tbl) {
+    table_clear_lookups_(tbl, 0, arr_len(tbl->hashes));
+    arr_len(tbl->entries) = 0;
+    reset_arena(tbl->arena);
+}
+
 static void
 table_insert_lookup_(HashTable * tbl, HashLookup * p_lookup) {
     uint32_t index = p_lookup->hash & (arr_len(tbl->hashes) - 1);
@@ -889,8 +1093,12 @@ get_attribute_value_offset(IntroContext * ctx, IntroAttributeDataId data_id, uin
     }
 
     int pop = 0;
-    for (uint32_t i=0; i < bitset_index; i++) {
-        pop += INTRO_POPCNT32(data->bitset[i]);
+    if (ctx->attr.prefix_counts) {
+        pop = ctx->attr.prefix_counts[data_id.offset][bitset_index];
+    } else {
+        for (uint32_t i=0; i < bitset_index; i++) {
+            pop += INTRO_POPCNT32(data->bitset[i]);
+        }
     }
     pop += INTRO_POPCNT32(data->bitset[bitset_index] & pop_count_mask);
     uint32_t * value_offsets = (uint32_t *)(data + 1);
@@ -977,43 +1185,6 @@ intro_attribute_length_x(IntroContext * ctx, IntroContainer cntr, int64_t * o_le
     return intro_attribute_expr_x(ctx, cntr, ctx->attr.builtin.length, o_length);
 }
 
-static const void *
-intro_expr_data(IntroContext * ctx, const IntroContainer * pcntr) {
-    const IntroType * header = intro_attribute_type_x(ctx, intro_get_attr(*pcntr), ctx->attr.builtin.header);
-    if (header) {
-        u8 * ptr = *(u8 **)pcntr->data;
-        if (ptr) {
-            return ptr - header->size;
-        } else {
-            return NULL;
-        }
-    } else {
-        if (pcntr->parent) {
-            pcntr = pcntr->parent;
-        }
-        while (pcntr->parent && (pcntr->type->flags & INTRO_EMBEDDED_DEFINITION)) {
-            pcntr = pcntr->parent;
-        }
-        return pcntr->data;
-    }
-}
-
-bool
-intro_attribute_expr_x(IntroContext * ctx, IntroContainer cntr, IntroAttribute attr_id, int64_t * o_result) {
-    ASSERT_ATTR_CATEGORY(INTRO_AT_EXPR);
-    uint32_t code_offset;
-    const void * data = intro_expr_data(ctx, &cntr);
-    bool has = get_attribute_value_offset(ctx, intro_get_attr(cntr), attr_id, &code_offset);
-    if (has) {
-        uint8_t * code = &ctx->values[code_offset];
-        union IntroRegisterData reg = intro_run_bytecode(code, data);
-        *o_result = reg.si;
-        return true;
-    } else {
-        return false;
-    }
-}
-
 typedef enum {
     I_INVALID = 0,
     I_RETURN = 1,
@@ -1038,7 +1209,7 @@ typedef enum {
     I_CVT_D_TO_I,
     I_CVT_F_TO_I,
     I_CVT_I_TO_D,
-    I_CVT_F_TO_D,    I_GREATER_POP = I_CVT_F_TO_D,
+    I_CVT_F_TO_D,
     I_ADDI,
     I_MULI,
     I_DIVI,
@@ -1054,106 +1225,367 @@ typedef enum {
     I_MULF,
     I_DIVF,
 
+    // superinstructions
+    I_LDK8,  // IMM + LD with a u16 offset
+    I_LDK16,
+    I_LDK32,
+    I_LDK64,
+    I_EQ_K8, // IMM8 + CMP + SETE
+    I_NE_K8, // IMM8 + CMP + SETE + BOOL_NOT
+
+    I_NATIVE, // u16 index into IntroContext.expr_funcs, the VM skips it
+
     I_COUNT
 } InstrCode;
 
+// the parser folds constant expressions into a single immediate, which is read without running the VM
+static bool
+intro_expr_constant(const uint8_t * code, int64_t * o_result) {
+    int size;
+    switch(code[0]) {
+    case I_IMM8:  size = 1; break;
+    case I_IMM16: size = 2; break;
+    case I_IMM32: size = 4; break;
+    case I_IMM64: size = 8; break;
+    default: return false;
+    }
+    if (code[1 + size] != I_RETURN) return false;
+    uint64_t value = 0;
+    memcpy(&value, code + 1, size);
+    memcpy(o_result, &value, sizeof(*o_result));
+    return true;
+}
+
+static const void *
+intro_expr_data(IntroContext * ctx, const IntroContainer * pcntr) {
+    const IntroType * header = intro_attribute_type_x(ctx, intro_get_attr(*pcntr), ctx->attr.builtin.header);
+    if (header) {
+        u8 * ptr = *(u8 **)pcntr->data;
+        if (ptr) {
+            return ptr - header->size;
+        } else {
+            return NULL;
+        }
+    } else {
+        if (pcntr->parent) {
+            pcntr = pcntr->parent;
+        }
+        while (pcntr->parent && (pcntr->type->flags & INTRO_EMBEDDED_DEFINITION)) {
+            pcntr = pcntr->parent;
+        }
+        return pcntr->data;
+    }
+}
+
+bool
+intro_attribute_expr_x(IntroContext * ctx, IntroContainer cntr, IntroAttribute attr_id, int64_t * o_result) {
+    ASSERT_ATTR_CATEGORY(INTRO_AT_EXPR);
+    uint32_t code_offset;
+    bool has = get_attribute_value_offset(ctx, intro_get_attr(cntr), attr_id, &code_offset);
+    if (has) {
+        uint8_t * code = &ctx->values[code_offset];
+        if (intro_expr_constant(code, o_result)) {
+            return true;
+        }
+        const void * data = intro_expr_data(ctx, &cntr);
+        if (code[0] == I_NATIVE && ctx->expr_funcs) {
+            *o_result = ctx->expr_funcs[code[1] | code[2] << 8](data);
+            return true;
+        }
+        union IntroRegisterData reg = intro_run_bytecode(code, data);
+        *o_result = reg.si;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+// a load at a constant offset, optionally compared to a byte constant
+#define INTRO_BATCH_LOOP(T) \
+    for (size_t i=0; i < count; i++) { \
+        int64_t v = (int64_t)*(const T *)(data + i * stride + offset); \
+        o_results[i] = (compare)? (v == k) != negate : v; \
+    }
+
+bool
+intro_attribute_expr_batch_x(IntroContext * ctx, IntroContainer first, size_t stride, size_t count, IntroAttribute attr_id, int64_t * o_results) {
+    ASSERT_ATTR_CATEGORY(INTRO_AT_EXPR);
+    uint32_t code_offset;
+    bool has = get_attribute_value_offset(ctx, intro_get_attr(first), attr_id, &code_offset);
+    if (!has) return false;
+    const uint8_t * code = &ctx->values[code_offset];
+
+    int64_t constant;
+    if (intro_expr_constant(code, &constant)) {
+        for (size_t i=0; i < count; i++) o_results[i] = constant;
+        return true;
+    }
+
+    // with a header the data of each element is found through its own pointer, which may be NULL
+    if (intro_attribute_type_x(ctx, intro_get_attr(first), ctx->attr.builtin.header)) {
+        for (size_t i=0; i < count; i++) {
+            IntroContainer elem = first;
+            elem.data += i * stride;
+            const void * data = intro_expr_data(ctx, &elem);
+            o_results[i] = (data)? intro_run_bytecode(code, data).si : 0;
+        }
+        return true;
+    }
+
+    const uint8_t * data = (const uint8_t *)intro_expr_data(ctx, &first);
+    if (code[0] == I_NATIVE) {
+        if (ctx->expr_funcs) {
+            IntroExprFunc func = ctx->expr_funcs[code[1] | code[2] << 8];
+            for (size_t i=0; i < count; i++) o_results[i] = func(data + i * stride);
+            return true;
+        }
+        code += 3;
+    }
+
+    if (code[0] >= I_LDK8 && code[0] <= I_LDK64) {
+        size_t offset = code[1] | code[2] << 8;
+        bool compare = (code[3] == I_EQ_K8 || code[3] == I_NE_K8) && code[5] == I_RETURN;
+        bool negate = code[3] == I_NE_K8;
+        int64_t k = (compare)? code[4] : 0;
+        if (compare || code[3] == I_RETURN) {
+            switch(code[0]) {
+            case I_LDK8:  INTRO_BATCH_LOOP(uint8_t);  break;
+            case I_LDK16: INTRO_BATCH_LOOP(uint16_t); break;
+            case I_LDK32: INTRO_BATCH_LOOP(uint32_t); break;
+            case I_LDK64: INTRO_BATCH_LOOP(uint64_t); break;
+            }
+            return true;
+        }
+    }
+
+    for (size_t i=0; i < count; i++) {
+        o_results[i] = intro_run_bytecode(code, data + i * stride).si;
+    }
+    return true;
+}
+#undef INTRO_BATCH_LOOP
+
+#define INTRO_EXPR_BATCH 64
+#define INTRO_EXPR_BATCH_MEMBERS 8
+
+// Union selections and pointer lengths of the direct members of up to INTRO_EXPR_BATCH struct elements.
+typedef struct {
+    uint32_t count_members;
+    uint32_t member_index [INTRO_EXPR_BATCH_MEMBERS];
+    int64_t values [INTRO_EXPR_BATCH_MEMBERS][INTRO_EXPR_BATCH]; // selected member or -1 for unions, length for pointers
+} IntroExprBatch;
+
+// 'elems' is an array or pointer container, 'first' the index of the first of 'count' elements, which must be structs
+static void
+intro__expr_batch(IntroContext * ctx, IntroExprBatch * batch, IntroContainer elems, size_t first, size_t count) {
+    IntroContainer elem = intro_push(&elems, first);
+    const IntroType * type = elem.type;
+    size_t stride = type->size;
+    assert(count <= INTRO_EXPR_BATCH);
+
+    batch->count_members = 0;
+    for (uint32_t m_index=0; m_index < type->count && batch->count_members < INTRO_EXPR_BATCH_MEMBERS; m_index++) {
+        IntroContainer m_cntr = intro_push(&elem, m_index);
+        int64_t * values = batch->values[batch->count_members];
+        if (m_cntr.type->category == INTRO_UNION) {
+            int64_t when [INTRO_EXPR_BATCH];
+            for (size_t i=0; i < count; i++) values[i] = -1;
+            for (uint32_t u_index=0; u_index < m_cntr.type->count; u_index++) {
+                if (!intro_attribute_expr_batch_x(ctx, intro_push(&m_cntr, u_index), stride, count, ctx->attr.builtin.when, when)) {
+                    continue;
+                }
+                for (size_t i=0; i < count; i++) {
+                    if (values[i] < 0 && when[i]) values[i] = u_index;
+                }
+            }
+        } else if (m_cntr.type->category == INTRO_POINTER) {
+            if (!intro_attribute_expr_batch_x(ctx, m_cntr, stride, count, ctx->attr.builtin.length, values)) {
+                continue;
+            }
+        } else {
+            continue;
+        }
+        batch->member_index[batch->count_members++] = m_index;
+    }
+}
+
+// whether elements of 'type' have any members for intro__expr_batch to evaluate
+static bool
+intro__expr_batch_wanted(const IntroType * type) {
+    if (type->category != INTRO_STRUCT) return false;
+    for (uint32_t m_index=0; m_index < type->count && m_index < INTRO_EXPR_BATCH_MEMBERS; m_index++) {
+        const IntroType * m_type = type->u.members[m_index].type;
+        if (m_type->category == INTRO_UNION || m_type->category == INTRO_POINTER) return true;
+    }
+    return false;
+}
+
+// the batched values of member 'm_index', or NULL
+static const int64_t *
+intro__expr_batch_get(const IntroExprBatch * batch, uint32_t m_index) {
+    if (!batch) return NULL;
+    for (uint32_t i=0; i < batch->count_members; i++) {
+        if (batch->member_index[i] == m_index) return batch->values[i];
+    }
+    return NULL;
+}
+
+// Threaded dispatch jumps straight from one handler to the next, so every instruction
+// gets its own indirect branch instead of sharing the one in the switch.
+#if defined(__GNUC__) && !defined(INTRO_NO_COMPUTED_GOTO)
+  #define INTRO_VM_THREADED 1
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wpedantic"
+#else
+  #define INTRO_VM_THREADED 0
+#endif
+
+#if INTRO_VM_THREADED
+  #define VM_CASE(INST) op_##INST:
+  #define VM_NEXT goto *dispatch[code[code_idx++]]
+#else
+  #define VM_CASE(INST) case INST:
+  #define VM_NEXT continue
+#endif
+#define VM_PUSH() (assert(stack_idx < INTRO_EXPR_STACK_SIZE), stack[stack_idx++] = r0)
+#define VM_POP2() (r1 = r0, r0 = stack[--stack_idx])
+
 union IntroRegisterData
 intro_run_bytecode(const uint8_t * code, const void * v_data) {
     const uint8_t * data = (uint8_t *)v_data;
-    union IntroRegisterData stack [1024];
+    union IntroRegisterData stack [INTRO_EXPR_STACK_SIZE];
     union IntroRegisterData r0, r1, r2;
     size_t stack_idx = 0;
     size_t code_idx = 0;
     bool flag_l = 0, flag_e = 0;
 
+    memset(&r0, 0, sizeof(r0));
     memset(&r1, 0, sizeof(r1)); // silence dumb warning
 
-    while (1) {
-        uint8_t byte = code[code_idx++];
-        uint8_t inst = byte;
-
-        if (inst > I_GREATER_POP) {
-            r1 = r0;
-            r0 = stack[--stack_idx];
-        }
-
-        switch ((InstrCode)inst) {
-        case I_RETURN: return r0;
-
-        case I_LD8 : r0.ui = *(uint8_t  *)(data + r0.ui); break;
-        case I_LD16: r0.ui = *(uint16_t *)(data + r0.ui); break;
-        case I_LD32: r0.ui = *(uint32_t *)(data + r0.ui); break;
-        case I_LD64: r0.ui = *(uint64_t *)(data + r0.ui); break;
-
-        case I_IMM8:  stack[stack_idx++] = r0;
-                      r0.ui = 0;
-                      r0.ui = code[code_idx];
-                      code_idx += 1;
-                      break;
-        case I_IMM16: stack[stack_idx++] = r0;
-                      r0.ui = 0;
-                      memcpy(&r0, code + code_idx, 2);
-                      code_idx += 2;
-                      break;
-        case I_IMM32: stack[stack_idx++] = r0;
-                      r0.ui = 0;
-                      memcpy(&r0, code + code_idx, 4);
-                      code_idx += 4;
-                      break;
-        case I_IMM64: stack[stack_idx++] = r0;
-                      memcpy(&r0, code + code_idx, 8);
-                      code_idx += 8;
-                      break;
-        case I_ZERO:  stack[stack_idx++] = r0;
-                      r0.ui = 0;
-                      break;
-
-        case I_CND_LD_TOP: r1 = stack[--stack_idx]; // alternate value
-                           r2 = stack[--stack_idx]; // condition
-                           if (r2.ui) r0 = r1;
-                           break;
-
-        case I_NEGATE_I:   r0.si = -r0.si; break;
-        case I_NEGATE_F:   r0.df = -r0.df; break;
-        case I_BIT_NOT:    r0.ui = ~r0.ui; break;
-        case I_BOOL:       r0.ui = !!r0.ui; break;
-        case I_BOOL_NOT:   r0.ui = ! r0.ui; break;
-        case I_SETE:       r0.ui = flag_e; break;
-        case I_SETL:       r0.ui = flag_l; break;
-        case I_SETLE:      r0.ui = flag_e || flag_l; break;
-        case I_CVT_D_TO_I: r0.si = (int64_t)r0.df; break;
-        case I_CVT_F_TO_I: r0.si = (int64_t)r0.sf; break;
-        case I_CVT_I_TO_D: r0.df = (double) r0.si; break;
-        case I_CVT_F_TO_D: r0.df = (double) r0.sf; break;
-
-        case I_ADDI: r0.si += r1.si; break;
-        case I_MULI: r0.si *= r1.si; break;
-        case I_DIVI: r0.si /= r1.si; break;
-        case I_MODI: r0.si %= r1.si; break;
-
-        case I_L_SHIFT: r0.ui <<= r1.ui; break;
-        case I_R_SHIFT: r0.ui >>= r1.ui; break;
-
-        case I_BIT_AND: r0.ui &= r1.ui; break;
-        case I_BIT_OR:  r0.ui |= r1.ui; break;
-        case I_BIT_XOR: r0.ui ^= r1.ui; break;
-
-        case I_CMP:   flag_l = r0.si < r1.si;
-                      flag_e = r0.si == r1.si;
-                      break;
-        case I_CMP_F: flag_l = r0.df < r1.df;
-                      flag_e = r0.df == r1.df;
-                      break;
-
-        case I_ADDF: r0.df += r1.df; break;
-        case I_MULF: r0.df *= r1.df; break;
-        case I_DIVF: r0.df /= r1.df; break;
-
-        case I_COUNT: case I_INVALID: assert(0);
-        }
+#if INTRO_VM_THREADED
+    static const void * const dispatch [I_COUNT] = {
+        &&op_I_INVALID, &&op_I_RETURN,
+        &&op_I_LD8, &&op_I_LD16, &&op_I_LD32, &&op_I_LD64,
+        &&op_I_IMM8, &&op_I_IMM16, &&op_I_IMM32, &&op_I_IMM64, &&op_I_ZERO,
+        &&op_I_CND_LD_TOP,
+        &&op_I_NEGATE_I, &&op_I_NEGATE_F, &&op_I_BIT_NOT, &&op_I_BOOL, &&op_I_BOOL_NOT,
+        &&op_I_SETL, &&op_I_SETE, &&op_I_SETLE,
+        &&op_I_CVT_D_TO_I, &&op_I_CVT_F_TO_I, &&op_I_CVT_I_TO_D, &&op_I_CVT_F_TO_D,
+        &&op_I_ADDI, &&op_I_MULI, &&op_I_DIVI, &&op_I_MODI,
+        &&op_I_L_SHIFT, &&op_I_R_SHIFT,
+        &&op_I_BIT_AND, &&op_I_BIT_OR, &&op_I_BIT_XOR,
+        &&op_I_CMP, &&op_I_CMP_F,
+        &&op_I_ADDF, &&op_I_MULF, &&op_I_DIVF,
+        &&op_I_LDK8, &&op_I_LDK16, &&op_I_LDK32, &&op_I_LDK64,
+        &&op_I_EQ_K8, &&op_I_NE_K8,
+        &&op_I_NATIVE,
+    };
+    VM_NEXT;
+#else
+    while (1) switch ((InstrCode)code[code_idx++]) {
+#endif
+    VM_CASE(I_RETURN) return r0;
+
+    VM_CASE(I_LD8)  r0.ui = *(uint8_t  *)(data + r0.ui); VM_NEXT;
+    VM_CASE(I_LD16) r0.ui = *(uint16_t *)(data + r0.ui); VM_NEXT;
+    VM_CASE(I_LD32) r0.ui = *(uint32_t *)(data + r0.ui); VM_NEXT;
+    VM_CASE(I_LD64) r0.ui = *(uint64_t *)(data + r0.ui); VM_NEXT;
+
+    VM_CASE(I_IMM8)  VM_PUSH();
+                     r0.ui = code[code_idx];
+                     code_idx += 1;
+                     VM_NEXT;
+    VM_CASE(I_IMM16) VM_PUSH();
+                     r0.ui = 0;
+                     memcpy(&r0, code + code_idx, 2);
+                     code_idx += 2;
+                     VM_NEXT;
+    VM_CASE(I_IMM32) VM_PUSH();
+                     r0.ui = 0;
+                     memcpy(&r0, code + code_idx, 4);
+                     code_idx += 4;
+                     VM_NEXT;
+    VM_CASE(I_IMM64) VM_PUSH();
+                     memcpy(&r0, code + code_idx, 8);
+                     code_idx += 8;
+                     VM_NEXT;
+    VM_CASE(I_ZERO)  VM_PUSH();
+                     r0.ui = 0;
+                     VM_NEXT;
+
+    VM_CASE(I_CND_LD_TOP) r1 = stack[--stack_idx]; // alternate value
+                          r2 = stack[--stack_idx]; // condition
+                          if (r2.ui) r0 = r1;
+                          VM_NEXT;
+
+    VM_CASE(I_NEGATE_I)   r0.si = -r0.si; VM_NEXT;
+    VM_CASE(I_NEGATE_F)   r0.df = -r0.df; VM_NEXT;
+    VM_CASE(I_BIT_NOT)    r0.ui = ~r0.ui; VM_NEXT;
+    VM_CASE(I_BOOL)       r0.ui = !!r0.ui; VM_NEXT;
+    VM_CASE(I_BOOL_NOT)   r0.ui = ! r0.ui; VM_NEXT;
+    VM_CASE(I_SETE)       r0.ui = flag_e; VM_NEXT;
+    VM_CASE(I_SETL)       r0.ui = flag_l; VM_NEXT;
+    VM_CASE(I_SETLE)      r0.ui = flag_e || flag_l; VM_NEXT;
+    VM_CASE(I_CVT_D_TO_I) r0.si = (int64_t)r0.df; VM_NEXT;
+    VM_CASE(I_CVT_F_TO_I) r0.si = (int64_t)r0.sf; VM_NEXT;
+    VM_CASE(I_CVT_I_TO_D) r0.df = (double) r0.si; VM_NEXT;
+    VM_CASE(I_CVT_F_TO_D) r0.df = (double) r0.sf; VM_NEXT;
+
+    // binary operations: r0 is the left side, r1 the right side
+    VM_CASE(I_ADDI) VM_POP2(); r0.si += r1.si; VM_NEXT;
+    VM_CASE(I_MULI) VM_POP2(); r0.si *= r1.si; VM_NEXT;
+    VM_CASE(I_DIVI) VM_POP2(); r0.si /= r1.si; VM_NEXT;
+    VM_CASE(I_MODI) VM_POP2(); r0.si %= r1.si; VM_NEXT;
+
+    VM_CASE(I_L_SHIFT) VM_POP2(); r0.ui <<= r1.ui; VM_NEXT;
+    VM_CASE(I_R_SHIFT) VM_POP2(); r0.ui >>= r1.ui; VM_NEXT;
+
+    VM_CASE(I_BIT_AND) VM_POP2(); r0.ui &= r1.ui; VM_NEXT;
+    VM_CASE(I_BIT_OR)  VM_POP2(); r0.ui |= r1.ui; VM_NEXT;
+    VM_CASE(I_BIT_XOR) VM_POP2(); r0.ui ^= r1.ui; VM_NEXT;
+
+    VM_CASE(I_CMP)   VM_POP2();
+                     flag_l = r0.si < r1.si;
+                     flag_e = r0.si == r1.si;
+                     VM_NEXT;
+    VM_CASE(I_CMP_F) VM_POP2();
+                     flag_l = r0.df < r1.df;
+                     flag_e = r0.df == r1.df;
+                     VM_NEXT;
+
+    VM_CASE(I_ADDF) VM_POP2(); r0.df += r1.df; VM_NEXT;
+    VM_CASE(I_MULF) VM_POP2(); r0.df *= r1.df; VM_NEXT;
+    VM_CASE(I_DIVF) VM_POP2(); r0.df /= r1.df; VM_NEXT;
+
+    VM_CASE(I_LDK8)  VM_PUSH(); r0.ui = *(uint8_t  *)(data + (code[code_idx] | code[code_idx+1] << 8)); code_idx += 2; VM_NEXT;
+    VM_CASE(I_LDK16) VM_PUSH(); r0.ui = *(uint16_t *)(data + (code[code_idx] | code[code_idx+1] << 8)); code_idx += 2; VM_NEXT;
+    VM_CASE(I_LDK32) VM_PUSH(); r0.ui = *(uint32_t *)(data + (code[code_idx] | code[code_idx+1] << 8)); code_idx += 2; VM_NEXT;
+    VM_CASE(I_LDK64) VM_PUSH(); r0.ui = *(uint64_t *)(data + (code[code_idx] | code[code_idx+1] << 8)); code_idx += 2; VM_NEXT;
+
+    VM_CASE(I_EQ_K8) r0.ui = r0.si == (int64_t)code[code_idx++]; VM_NEXT;
+    VM_CASE(I_NE_K8) r0.ui = r0.si != (int64_t)code[code_idx++]; VM_NEXT;
+
+    VM_CASE(I_NATIVE) code_idx += 2; VM_NEXT;
+
+    VM_CASE(I_INVALID)
+#if !INTRO_VM_THREADED
+    case I_COUNT:
+#endif
+        assert(0);
+        return r0;
+#if !INTRO_VM_THREADED
     }
+#endif
 }
 
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_PUSH
+#undef VM_POP2
+#if INTRO_VM_THREADED
+  #pragma GCC diagnostic pop
+#endif
+
 static void
 intro__offset_pointers(const IntroContainer * p_base_cntr, void * base) {
     const IntroType * type = p_base_cntr->type;
@@ -1473,9 +1905,11 @@ intro_type_with_name_x(IntroContext * ctx, const char * name) {
 const IntroMember *
 intro_member_by_name_x(const IntroType * type, const char * name) {
     assert((type->category & 0xf0) == INTRO_STRUCT);
+    uint32_t hash = intro_name_hash(name);
     for (uint32_t i=0; i < type->count; i++) {
         const IntroMember * member = &type->u.members[i];
-        if (0==strcmp(name, member->name)) {
+        if (member->name && member->name_hash && member->name_hash != hash) continue;
+        if (member->name && 0==strcmp(name, member->name)) {
             return member;
         }
     }
@@ -1529,6 +1963,7 @@ intro_push(const IntroContainer * parent, int32_t index) {
 #define DO_INDENT(OPT) for (int _i=0; _i < (OPT)->indent; _i++) *p_out += sprintf(*p_out, "%s", (OPT)->tab)
 
 static void intro_generate_json_internal(IntroContext * ctx, char ** p_out, IntroContainer cntr, IntroPrintOptions * opt);
+static void intro_generate_json_struct(IntroContext * ctx, char ** p_out, IntroContainer cntr, IntroPrintOptions * opt, const IntroExprBatch * batch, size_t batch_i);
 
 static void
 intro_generate_json_array_internal(IntroContext * ctx, char ** p_out, IntroContainer cntr, size_t count, IntroPrintOptions * opt) {
@@ -1542,11 +1977,23 @@ intro_generate_json_array_internal(IntroContext * ctx, char ** p_out, IntroConta
 
     *p_out += sprintf(*p_out, "[%c", space);
 
+    bool is_struct = cntr.type->u.of->category == INTRO_STRUCT;
+    bool use_batch = intro__expr_batch_wanted(cntr.type->u.of);
+    IntroExprBatch batch;
     for (size_t elem_i=0; elem_i < count; elem_i++) {
+        size_t batch_i = elem_i % INTRO_EXPR_BATCH;
+        if (use_batch && batch_i == 0) {
+            size_t batch_count = (count - elem_i > INTRO_EXPR_BATCH)? INTRO_EXPR_BATCH : count - elem_i;
+            intro__expr_batch(ctx, &batch, cntr, elem_i, batch_count);
+        }
         if (do_newlines) {
             DO_INDENT(&n_opt);
         }
-        intro_generate_json_internal(ctx, p_out, intro_push(&cntr, elem_i), &n_opt);
+        if (is_struct) {
+            intro_generate_json_struct(ctx, p_out, intro_push(&cntr, elem_i), &n_opt, (use_batch)? &batch : NULL, batch_i);
+        } else {
+            intro_generate_json_internal(ctx, p_out, intro_push(&cntr, elem_i), &n_opt);
+        }
         if (elem_i < count - 1) {
             *p_out += sprintf(*p_out, ",%c", space);
         }
@@ -1559,6 +2006,85 @@ intro_generate_json_array_internal(IntroContext * ctx, char ** p_out, IntroConta
     *p_out += sprintf(*p_out, "]");
 }
 
+static void
+intro_generate_json_union(IntroContext * ctx, char ** p_out, IntroContainer cntr, IntroPrintOptions * opt, int32_t selected) {
+    if (selected < 0) {
+        *p_out += sprintf(*p_out, "null");
+        return;
+    }
+
+    IntroContainer m_cntr = intro_push(&cntr, selected);
+    IntroPrintOptions n_opt = *opt;
+    n_opt.indent += 1;
+
+    char type_buf [1024];
+    intro_sprint_type_name(type_buf, intro_get_member(m_cntr)->type);
+    *p_out += sprintf(*p_out, "{ \"type\" : \"%s\", \"content\" : ", type_buf);
+    intro_generate_json_internal(ctx, p_out, m_cntr, &n_opt);
+    *p_out += sprintf(*p_out, " }");
+}
+
+// 'p_length' is the batched length, or NULL to look it up
+static void
+intro_generate_json_pointer(IntroContext * ctx, char ** p_out, IntroContainer cntr, IntroPrintOptions * opt, const int64_t * p_length) {
+    void * ptr = *(void **)cntr.data;
+    // check for circular reference
+    {
+        const IntroContainer * super = &cntr;
+        while (super->parent) {
+            super = super->parent;
+            if (super->data == cntr.data) {
+                *p_out += sprintf(*p_out, "\"<circular>\"");
+                return;
+            }
+        }
+    }
+    if (!ptr) {
+        *p_out += sprintf(*p_out, "null");
+    } else if (intro_has_attribute_x(ctx, intro_get_attr(cntr), ctx->attr.builtin.cstring)) {
+        *p_out += sprintf(*p_out, "\"%s\"", (char *)ptr);
+    } else {
+        int64_t length;
+        if (p_length) {
+            intro_generate_json_array_internal(ctx, p_out, cntr, *p_length, opt);
+        } else if (intro_attribute_length_x(ctx, cntr, &length)) {
+            intro_generate_json_array_internal(ctx, p_out, cntr, length, opt);
+        } else {
+            intro_generate_json_internal(ctx, p_out, intro_push(&cntr, 0), opt);
+        }
+    }
+}
+
+// 'batch' holds the union selections and lengths of the members, or is NULL
+static void
+intro_generate_json_struct(IntroContext * ctx, char ** p_out, IntroContainer cntr, IntroPrintOptions * opt, const IntroExprBatch * batch, size_t batch_i) {
+    *p_out += sprintf(*p_out, "{\n");
+    for (size_t member_i=0; member_i < cntr.type->count; member_i++) {
+        IntroContainer m_cntr = intro_push(&cntr, member_i);
+        IntroPrintOptions m_opt = *opt;
+        m_opt.indent += 1;
+
+        DO_INDENT(&m_opt);
+        *p_out += sprintf(*p_out, "\"%s\" : ", intro_get_member(m_cntr)->name);
+
+        const int64_t * values = intro__expr_batch_get(batch, member_i);
+        if (!values) {
+            intro_generate_json_internal(ctx, p_out, m_cntr, &m_opt);
+        } else if (m_cntr.type->category == INTRO_UNION) {
+            intro_generate_json_union(ctx, p_out, m_cntr, &m_opt, values[batch_i]);
+        } else {
+            intro_generate_json_pointer(ctx, p_out, m_cntr, &m_opt, &values[batch_i]);
+        }
+
+        if (member_i < cntr.type->count - 1) {
+            *p_out += sprintf(*p_out, ",");
+        }
+        *p_out += sprintf(*p_out, "\n");
+    }
+    DO_INDENT(opt);
+    *p_out += sprintf(*p_out, "}");
+}
+
 static void
 intro_generate_json_internal(IntroContext * ctx, char ** p_out, IntroContainer cntr, IntroPrintOptions * opt) {
     switch (cntr.type->category) {
@@ -1587,46 +2113,19 @@ intro_generate_json_internal(IntroContext * ctx, char ** p_out, IntroContainer c
     }break;
 
     case INTRO_STRUCT: {
-        *p_out += sprintf(*p_out, "{\n");
-        for (size_t member_i=0; member_i < cntr.type->count; member_i++) {
-            IntroContainer m_cntr = intro_push(&cntr, member_i);
-            IntroPrintOptions m_opt = *opt;
-            m_opt.indent += 1;
-
-            DO_INDENT(&m_opt);
-            *p_out += sprintf(*p_out, "\"%s\" : ", intro_get_member(m_cntr)->name);
-
-            intro_generate_json_internal(ctx, p_out, m_cntr, &m_opt);
-
-            if (member_i < cntr.type->count - 1) {
-                *p_out += sprintf(*p_out, ",");
-            }
-            *p_out += sprintf(*p_out, "\n");
-        }
-        DO_INDENT(opt);
-        *p_out += sprintf(*p_out, "}");
+        intro_generate_json_struct(ctx, p_out, cntr, opt, NULL, 0);
     }break;
 
     case INTRO_UNION: {
-        IntroContainer m_cntr;
-
+        int32_t selected = -1;
         for (uint32_t member_i=0; member_i < cntr.type->count; member_i++) {
-            m_cntr = intro_push(&cntr, member_i);
             int64_t res;
-            if (intro_attribute_expr_x(ctx, m_cntr, ctx->attr.builtin.when, &res) && res) {
-                IntroPrintOptions n_opt = *opt;
-                n_opt.indent += 1;
-
-                char type_buf [1024];
-                intro_sprint_type_name(type_buf, intro_get_member(m_cntr)->type);
-                *p_out += sprintf(*p_out, "{ \"type\" : \"%s\", \"content\" : ", type_buf);
-                intro_generate_json_internal(ctx, p_out, m_cntr, &n_opt);
-                *p_out += sprintf(*p_out, " }");
-                return;
+            if (intro_attribute_expr_x(ctx, intro_push(&cntr, member_i), ctx->attr.builtin.when, &res) && res) {
+                selected = member_i;
+                break;
             }
         }
-
-        *p_out += sprintf(*p_out, "null");
+        intro_generate_json_union(ctx, p_out, cntr, opt, selected);
     }break;
 
     case INTRO_ENUM: {
@@ -1635,30 +2134,7 @@ intro_generate_json_internal(IntroContext * ctx, char ** p_out, IntroContainer c
     }break;
 
     case INTRO_POINTER: {
-        void * ptr = *(void **)cntr.data;
-        // check for circular reference
-        {
-            const IntroContainer * super = &cntr;
-            while (super->parent) {
-                super = super->parent;
-                if (super->data == cntr.data) {
-                    *p_out += sprintf(*p_out, "\"<circular>\"");
-                    return;
-                }
-            }
-        }
-        if (!ptr) {
-            *p_out += sprintf(*p_out, "null");
-        } else if (intro_has_attribute_x(ctx, intro_get_attr(cntr), ctx->attr.builtin.cstring)) {
-            *p_out += sprintf(*p_out, "\"%s\"", (char *)ptr);
-        } else {
-            int64_t length;
-            if (intro_attribute_length_x(ctx, cntr, &length)) {
-                intro_generate_json_array_internal(ctx, p_out, cntr, length, opt);
-            } else {
-                intro_generate_json_internal(ctx, p_out, intro_push(&cntr, 0), opt);
-            }
-        }
+        intro_generate_json_pointer(ctx, p_out, cntr, opt, NULL);
     }break;
 
     case INTRO_ARRAY: {
@@ -1690,18 +2166,34 @@ intro_sprint_json_x(IntroContext * ctx, char * buf, const void * data, const Int
 // CITY IMPLEMENTATION
 
 static const int implementation_version_major = 0;
-static const int implementation_version_minor = 4;
+static const int implementation_version_minor = 6;
 
 typedef struct {
     char magic_number [4];
     uint16_t version_major;
     uint16_t version_minor;
     uint8_t  size_info;
-    uint8_t  reserved_0 [3];
+    uint8_t  flags;
+    uint8_t  reserved_0 [2];
     uint32_t data_ptr;
     uint32_t count_types;
+    uint8_t  schema_hash [8]; // since 0.5
+    uint32_t checksum; // since 0.5, only valid with CITY_FLAG_CHECKSUM
 } CityHeader;
 
+// headers before version 0.5 end at the type count
+static size_t
+city__header_size(const CityHeader * header) {
+    return (header->version_minor >= 5)? sizeof(CityHeader) : offsetof(CityHeader, schema_hash);
+}
+
+// the hash generated for 'type' or 0 if there is none
+static uint64_t
+city__schema_hash(const IntroContext * ctx, const IntroType * type) {
+    if (!ctx->schema_hashes || type < ctx->types || type >= ctx->types + ctx->count_types) return 0;
+    return ctx->schema_hashes[type - ctx->types];
+}
+
 static long
 fsize(FILE * file) {
     long location = ftell(file);
@@ -1750,51 +2242,137 @@ intro_load_city_file_x(IntroContext * ctx, void * dest, const IntroType * dest_t
     return true;
 }
 
-bool
+static bool
+city__write_file_proc(void * user, const void * data, size_t size) {
+    return fwrite(data, size, 1, (FILE *)user) == 1;
+}
+
+static bool city__write_stream(IntroContext * ictx, IntroWriteProc write_proc, void * user, const void * src, const IntroType * s_type, bool native);
+
+static bool
+city__create_file(IntroContext * ctx, const char * filename, const void * src, const IntroType * src_type, bool native) {
+    FILE * file = fopen(filename, "wb");
+    if (!file) return false;
+
+    bool ok = city__write_stream(ctx, &city__write_file_proc, file, src, src_type, native);
+    if (fclose(file) != 0) ok = false;
+    if (!ok) remove(filename); // don't leave a truncated file behind
+    return ok;
+}
+
+bool
 intro_create_city_file_x(IntroContext * ctx, const char * filename, void * src, const IntroType * src_type) {
-    size_t size;
-    void * data = intro_create_city_x(ctx, src, src_type, &size);
-    if (!data) return false;
-    
-    int error = intro_dump_file(filename, data, size);
-    free(data);
-    if (error < 0) {
-        return false;
-    } else {
-        return true;
-    }
+    return city__create_file(ctx, filename, src, src_type, false);
+}
+
+// Native files store data with the layout of src_type and a table of pointer locations,
+// so that a program with the same types can use the data where it is loaded.
+bool
+intro_create_city_native_file_x(IntroContext * ctx, const char * filename, const void * src, const IntroType * src_type) {
+    return city__create_file(ctx, filename, src, src_type, true);
 }
 
+typedef struct {
+    IntroErrorProc proc;
+    void * user;
+} CityErrorHandler;
+
+// each thread has its own handler, workers take the one of the thread that started them
+static INTRO_THREAD_LOCAL CityErrorHandler city__error_handler = {NULL, NULL};
+#if INTRO_HAVE_THREADS
+static pthread_mutex_t city__error_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 static void
 city__error(const char * msg) {
+    CityErrorHandler handler = city__error_handler;
+    if (handler.proc) {
+#if INTRO_HAVE_THREADS
+        pthread_mutex_lock(&city__error_lock);
+        handler.proc(handler.user, msg);
+        pthread_mutex_unlock(&city__error_lock);
+#else
+        handler.proc(handler.user, msg);
+#endif
+        return;
+    }
     fprintf(stderr, "CITY error: %s\n", msg);
 }
 
+// Passes every error of the city functions called by this thread to 'proc' instead of printing it.
+// NULL restores printing to stderr. Load workers started with count_threads report to the 'proc' of
+// the thread that started them, one call at a time.
+void
+intro_city_set_error_proc(IntroErrorProc proc, void * user) {
+    city__error_handler.proc = proc;
+    city__error_handler.user = user;
+}
+
 static void
-put_uint(uint8_t ** o_array, uint32_t number, uint8_t bytes) {
+put_uint(uint8_t ** o_array, uint64_t number, uint8_t bytes) {
     assert(*o_array != NULL);
-    arr_append_range(*o_array, &number, bytes);
+    switch(bytes) { // fixed sizes let the compiler emit a single store
+    case 1: arr_append(*o_array, (uint8_t)number); break;
+    case 2: { uint16_t v = number; arr_append_range(*o_array, &v, 2); }break;
+    case 4: { uint32_t v = number; arr_append_range(*o_array, &v, 4); }break;
+    case 8: arr_append_range(*o_array, &number, 8); break;
+    default: arr_append_range(*o_array, &number, bytes); break; // LE to LE
+    }
 }
 
-static uint32_t
+static uint64_t
 next_uint(const uint8_t ** ptr, uint8_t size) {
-    uint32_t result = 0;
-    //memcpy(&result + 4 - size, *ptr, size); // BE to BE
-    memcpy(&result, *ptr, size); // LE to LE
+    uint64_t result = 0;
+    switch(size) {
+    case 1: result = **ptr; break;
+    case 2: { uint16_t v; memcpy(&v, *ptr, 2); result = v; }break;
+    case 4: { uint32_t v; memcpy(&v, *ptr, 4); result = v; }break;
+    case 8: memcpy(&result, *ptr, 8); break;
+    default: memcpy(&result, *ptr, size); break; // LE to LE
+    }
     *ptr += size;
     return result;
 }
 
 typedef struct {
     const u8 * origin;
-    uint32_t ser_offset;
-    uint32_t size;
+    const IntroType * ptr_type;
+    size_t ser_offset;
+    uint32_t length;
 } CityBuffer;
 
 typedef struct {
-    uint32_t data_location;
-    uint32_t ptr_value;
-} CityDeferredPointer;
+    uint64_t origin;
+    uint64_t size;
+} CityBufferKey;
+
+typedef struct {
+    uint32_t size;
+    uint32_t * member_offsets; // structs only
+    bool is_flat; // the packed data is the same as the memory
+} CityPackedInfo;
+
+typedef struct {
+    uint32_t d_index;
+    uint32_t d_offset;
+    uint32_t s_offset;
+    uint32_t copy_size; // non-zero: the data is identical, memcpy instead of loading s_type
+    const IntroType * s_type; // NULL: set the destination member to its fallback
+} CityLoadStep;
+
+typedef struct {
+    CityLoadStep * steps;
+    uint32_t count_steps;
+    const char * error;
+} CityLoadVariant;
+
+// How to load a source struct or union into a destination type, compiled once per pair of types.
+typedef struct {
+    CityLoadVariant * variants; // one for each source member of a union, otherwise one
+    uint32_t count_variants;
+    bool copy_only;    // a single variant made only of copies
+    bool is_identical; // the whole struct is one copy
+} CityLoadPlan;
 
 typedef struct {
     uint8_t * data;
@@ -1802,47 +2380,157 @@ typedef struct {
     IntroContext * ictx;
     uint8_t type_size;
     uint8_t ptr_size;
+    bool native;
+    bool shared_types; // the type info is in a schema file
+    bool name_hashes; // member names are followed by their hash, since 0.6
+    size_t data_size; // of the data section, only used while loading
 
     // Creation only
+    uint8_t overflow;
+    bool write_failed; // the write proc returned false
     uint32_t type_id_counter;
+    // city->data only holds a window of the data section when streaming.
+    // data offset 'data_base' is at index 'data_prefix' of the window.
+    size_t data_base;
+    size_t data_prefix;
+    size_t data_end;
+    size_t names_base;
+    uint8_t * names;
+    IntroWriteProc write_proc;
+    void * write_user;
+    bool measuring; // only finding the widths, data without pointers is skipped instead of written
     HashTable * type_set;
-    CityBuffer * buffers;
-    CityDeferredPointer * deferred_ptrs;
+    CityBuffer * buffers; // serialized in order after the main data
+    HashTable * buffer_set;
     HashTable * name_cache;
+    HashTable * packed_set;
+    CityPackedInfo * packed;
+    uint64_t * relocs; // native only: data offsets of every non-null pointer
+    MemArena * arena;
+    int count_threads;
+    bool in_parallel; // workers are running, nothing may be added to the context or its caches
+
+    // Loading only
+    HashTable * plan_set;
+    CityLoadPlan * plans;
+    const IntroLoadOptions * load_opt;
+    bool validate;
+    uint32_t depth;       // validating only: nested pointers being loaded
+    uint64_t load_budget; // validating only: source bytes that may still be loaded
+#if INTRO_HAVE_THREADS
+    pthread_mutex_t * alloc_lock; // workers only: a user allocator is called by one worker at a time
+#endif
 } CityContext;
 
 #define CITY_INVALID_CACHE UINT32_MAX
 
-static size_t
-packed_size(const CityContext * city, const IntroType * type) {
+enum {
+    CITY_OVERFLOW_TYPE = 0x01,
+    CITY_OVERFLOW_PTR  = 0x02,
+};
+
+enum {
+    CITY_FLAG_NATIVE     = 0x01,
+    CITY_FLAG_COMPRESSED = 0x02,
+    CITY_FLAG_CHECKSUM   = 0x04,
+    CITY_FLAG_LOG        = 0x08,
+    CITY_FLAG_SCHEMA       = 0x10, // only type info, for files with CITY_FLAG_SHARED_TYPES
+    CITY_FLAG_SHARED_TYPES = 0x20,
+};
+
+static const size_t CITY_STREAM_CHUNK_SIZE = 1 << 20;
+static const size_t CITY_NATIVE_ALIGN = 16;
+
+// the largest value that fits in 'bytes' bytes, minus the bit used to mark member ids
+static uint64_t
+city__width_max(uint8_t bytes) {
+    return ((uint64_t)1 << (bytes * 8 - 1)) - 1;
+}
+
+static void
+city__check_ptr_width(CityContext * city, uint64_t value) {
+    if (value > city__width_max(city->ptr_size)) {
+        city->overflow |= CITY_OVERFLOW_PTR;
+    }
+}
+
+// packed sizes and member offsets are computed once per type and cached in the context
+static CityPackedInfo
+city__packed_info(CityContext * city, const IntroType * type) {
+    CityPackedInfo info;
+    info.member_offsets = NULL;
+    info.is_flat = false;
+
+    switch(type->category) {
+    case INTRO_STRUCT:
+    case INTRO_UNION:
+    case INTRO_ARRAY: break;
+
+    case INTRO_POINTER:
+        info.size = city->ptr_size;
+        return info;
+
+    default:
+        info.size = type->size;
+        info.is_flat = true;
+        return info;
+    }
+
+    // native files keep the layout of the source type
+    if (city->native && type->category != INTRO_STRUCT) {
+        info.size = type->size;
+        return info;
+    }
+
+    HashEntry entry;
+    entry.key_data = &type;
+    entry.key_size = sizeof(type);
+    table_get(city->packed_set, &entry);
+    if (entry.value != TABLE_INVALID_VALUE) {
+        return city->packed[entry.value];
+    }
+
     switch(type->category) {
     case INTRO_STRUCT: {
-        size_t size = 0;
+        info.member_offsets = (uint32_t *)arena_alloc(city->arena, type->count * sizeof(uint32_t));
+        uint32_t size = 0;
+        bool is_flat = true;
         for (uint32_t i=0; i < type->count; i++) {
-            size += packed_size(city, type->u.members[i].type);
+            info.member_offsets[i] = (city->native)? type->u.members[i].offset : size;
+            CityPackedInfo m_info = city__packed_info(city, type->u.members[i].type);
+            size += m_info.size;
+            is_flat = is_flat && m_info.is_flat && info.member_offsets[i] == type->u.members[i].offset;
         }
-        return size;
-    }
+        info.size = (city->native)? type->size : size;
+        info.is_flat = is_flat && info.size == type->size;
+    }break;
 
     case INTRO_UNION: {
-        size_t size = 1;
+        uint32_t size = 1;
         for (uint32_t i=0; i < type->count; i++) {
-            size_t m_size = packed_size(city, type->u.members[i].type);
+            uint32_t m_size = city__packed_info(city, type->u.members[i].type).size;
             if (m_size > size) size = m_size;
         }
-        size += 2;
-        return size;
+        info.size = size + 2;
     }break;
 
-    case INTRO_ARRAY:
-        return type->count * packed_size(city, type->u.of);
+    case INTRO_ARRAY: {
+        CityPackedInfo elem_info = city__packed_info(city, type->u.of);
+        info.size = type->count * elem_info.size;
+        info.is_flat = elem_info.is_flat;
+    }break;
+    }
 
-    case INTRO_POINTER:
-        return city->ptr_size;
+    entry.value = arr_len(city->packed);
+    arr_append(city->packed, info);
+    table_set(city->packed_set, entry);
 
-    default:
-        return type->size;
-    }
+    return info;
+}
+
+static size_t
+packed_size(CityContext * city, const IntroType * type) {
+    return city__packed_info(city, type).size;
 }
 
 static uint32_t
@@ -1866,6 +2554,7 @@ city__get_serialized_id(CityContext * city, const IntroType * type) {
             put_uint(&city->info, type->category, 1);
             put_uint(&city->info, elem_type_id, city->type_size);
             put_uint(&city->info, type->count, city->ptr_size);
+            city__check_ptr_width(city, type->count);
         }break;
 
         case INTRO_POINTER: {
@@ -1897,17 +2586,20 @@ city__get_serialized_id(CityContext * city, const IntroType * type) {
                 m_type_ids[m_index] = city__get_serialized_id(city, m->type);
             }
 
-            size_t id_test_bit = 1 << (city->ptr_size * 8 - 1);
+            uint64_t id_test_bit = (uint64_t)1 << (city->ptr_size * 8 - 1);
 
             put_uint(&city->info, type->category, 1);
             put_uint(&city->info, type->count, city->ptr_size);
+            city__check_ptr_width(city, type->count);
+            if (city->native) put_uint(&city->info, type->size, city->ptr_size);
             for (uint32_t m_index=0; m_index < type->count; m_index++) {
                 const IntroMember * m = &type->u.members[m_index];
                 put_uint(&city->info, m_type_ids[m_index], city->type_size);
 
                 int32_t id;
                 if (intro_attribute_int_x(city->ictx, m->attr, city->ictx->attr.builtin.id, &id)) {
-                    size_t stored = id;
+                    uint64_t stored = (uint32_t)id;
+                    city__check_ptr_width(city, stored);
                     stored |= id_test_bit;
                     put_uint(&city->info, stored, city->ptr_size);
                 } else {
@@ -1925,14 +2617,17 @@ city__get_serialized_id(CityContext * city, const IntroType * type) {
                     table_get(city->name_cache, &h_entry);
                     size_t name_offset = h_entry.value;
                     if (name_offset == TABLE_INVALID_VALUE) {
-                        name_offset = arr_len(city->data);
-                        arr_append_range(city->data, m->name, m_name_len + 1);
+                        name_offset = city->names_base + arr_len(city->names);
+                        arr_append_range(city->names, m->name, m_name_len + 1);
 
                         h_entry.value = name_offset;
                         table_set(city->name_cache, h_entry);
                     }
+                    city__check_ptr_width(city, name_offset);
                     put_uint(&city->info, name_offset, city->ptr_size);
+                    put_uint(&city->info, intro_member_name_hash(m), 4);
                 }
+                if (city->native) put_uint(&city->info, m->offset, city->ptr_size);
             }
 
             free(m_type_ids);
@@ -1948,496 +2643,3346 @@ city__get_serialized_id(CityContext * city, const IntroType * type) {
     return type_id;
 }
 
+static u8 *
+city__out(CityContext * city, size_t data_offset) {
+    return city->data + city->data_prefix + (data_offset - city->data_base);
+}
+
+// data offset of the end of the written data
+static size_t
+city__offset(CityContext * city) {
+    return city->data_base + arr_len(city->data) - city->data_prefix;
+}
+
+// extend the window by 'size' bytes at the end of the written data
+static size_t
+city__reserve(CityContext * city, size_t size) {
+    size_t data_offset = city__offset(city);
+    size_t index = arr_alloc_idx(city->data, size);
+    if (city->native) memset(&city->data[index], 0, size); // padding must not leak
+    return data_offset;
+}
+
+// pass everything in the window to the write proc when streaming
 static void
-city__serialize(CityContext * city, uint32_t data_offset, IntroContainer cont) {
-    const IntroType * type = cont.type;
-    const u8 * src = cont.data;
+city__flush(CityContext * city, bool force) {
+    size_t window_size = arr_len(city->data);
+    if (!city->write_proc || window_size == 0 || (!force && window_size < CITY_STREAM_CHUNK_SIZE)) return;
 
-    if (!intro_has_attribute_x(city->ictx, intro_get_attr(cont), city->ictx->attr.builtin.city)) {
-        memset(city->data + data_offset, 0, packed_size(city, type));
-        return;
+    if (!city->write_proc(city->write_user, city->data, window_size)) {
+        city->write_failed = true;
     }
+    city->data_base += window_size - city->data_prefix;
+    city->data_prefix = 0;
+    arr_len(city->data) = 0;
+}
+
+static void city__serialize(CityContext * city, size_t data_offset, IntroContainer cont);
+static void city__serialize_batched(CityContext * city, size_t data_offset, IntroContainer cont, const IntroExprBatch * batch, size_t batch_i);
 
+// true if serializing 'type' never queues a buffer, so its elements can be written in any order
+static bool
+city__is_pointer_free(const IntroType * type) {
     switch(type->category) {
-    case INTRO_STRUCT: {
-        uint32_t current_offset = 0;
+    case INTRO_POINTER: return false;
+    case INTRO_ARRAY: return city__is_pointer_free(type->u.of);
+    case INTRO_STRUCT:
+    case INTRO_UNION: {
         for (uint32_t m_index=0; m_index < type->count; m_index++) {
-            city__serialize(city, data_offset + current_offset, intro_push(&cont, m_index));
+            if (!city__is_pointer_free(type->u.members[m_index].type)) return false;
+        }
+        return true;
+    }
+    default: return true;
+    }
+}
+
+static const size_t CITY_PARALLEL_MIN_SIZE = 1 << 16; // smaller element ranges are handled serially
+static const size_t CITY_PARALLEL_CHUNK = 1024; // elements taken by a worker at a time
+#define CITY_MAX_THREADS 64
+
+// 'worker_i' is the index of the calling worker, less than the number of threads
+typedef void (*CityRangeProc)(void * user, int worker_i, size_t start, size_t end);
+
+#if INTRO_HAVE_THREADS
+// Each worker starts with an equal share of the range and takes chunks from its front.
+// A worker that runs out steals the back half of another worker's remaining range.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t start;
+    size_t end;
+} CityWorkerRange;
+
+typedef struct {
+    CityRangeProc proc;
+    void * user;
+    CityWorkerRange * ranges;
+    int count_workers;
+    CityErrorHandler error_handler;
+} CityParallelJob;
+
+typedef struct {
+    CityParallelJob * job;
+    int index;
+} CityWorker;
 
-            IntroMember member = type->u.members[m_index];
-            current_offset += packed_size(city, member.type);
+static bool
+city__steal(CityParallelJob * job, int thief_i) {
+    CityWorkerRange * own = &job->ranges[thief_i];
+    for (int offset=1; offset < job->count_workers; offset++) {
+        CityWorkerRange * victim = &job->ranges[(thief_i + offset) % job->count_workers];
+        pthread_mutex_lock(&victim->lock);
+        size_t remaining = victim->end - victim->start;
+        if (remaining > CITY_PARALLEL_CHUNK) {
+            size_t middle = victim->end - remaining / 2;
+            pthread_mutex_lock(&own->lock);
+            own->start = middle;
+            own->end = victim->end;
+            pthread_mutex_unlock(&own->lock);
+            victim->end = middle;
+            pthread_mutex_unlock(&victim->lock);
+            return true;
         }
-    }break;
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return false;
+}
 
-    case INTRO_UNION: {
-        memset(city->data + data_offset, 0, packed_size(city, type));
-        for (uint32_t i=0; i < type->count; i++) {
-            int64_t is_valid;
-            IntroContainer m_cntr = intro_push(&cont, i);
-            if (intro_attribute_expr_x(city->ictx, m_cntr, city->ictx->attr.builtin.when, &is_valid) && is_valid) {
-                uint16_t selection_index = i;
-                memcpy(city->data + data_offset, &selection_index, 2);
-                city__serialize(city, data_offset + 2, m_cntr);
-                break;
-            }
+static void *
+city__worker(void * user) {
+    CityWorker * worker = (CityWorker *)user;
+    CityParallelJob * job = worker->job;
+    CityWorkerRange * own = &job->ranges[worker->index];
+    city__error_handler = job->error_handler;
+    while (1) {
+        pthread_mutex_lock(&own->lock);
+        size_t start = own->start;
+        size_t end = (own->end - start > CITY_PARALLEL_CHUNK)? start + CITY_PARALLEL_CHUNK : own->end;
+        own->start = end;
+        pthread_mutex_unlock(&own->lock);
+
+        if (start < end) {
+            job->proc(job->user, worker->index, start, end);
+        } else if (!city__steal(job, worker->index)) {
+            break;
         }
-    }break;
+    }
+    return NULL;
+}
+#endif
 
-    case INTRO_POINTER: {
-        if (type->u.of->size == 0) return;
-        const u8 * ptr = *(const u8 **)src;
-        if (!ptr) {
-            memset(city->data + data_offset, 0, city->ptr_size);
-            return;
+// Calls 'proc' on parts of [0, count) from up to 'count_threads' threads, including the calling thread.
+static void
+city__run_parallel(int count_threads, size_t count, CityRangeProc proc, void * user) {
+#if INTRO_HAVE_THREADS
+    if (count_threads > CITY_MAX_THREADS) count_threads = CITY_MAX_THREADS;
+    if (count_threads > 1 && count > CITY_PARALLEL_CHUNK) {
+        CityWorkerRange ranges [CITY_MAX_THREADS];
+        CityWorker workers [CITY_MAX_THREADS];
+        pthread_t threads [CITY_MAX_THREADS];
+
+        CityParallelJob job;
+        job.proc = proc;
+        job.user = user;
+        job.ranges = ranges;
+        job.count_workers = count_threads;
+        job.error_handler = city__error_handler;
+        for (int worker_i=0; worker_i < count_threads; worker_i++) {
+            pthread_mutex_init(&ranges[worker_i].lock, NULL);
+            ranges[worker_i].start = count * worker_i / count_threads;
+            ranges[worker_i].end = count * (worker_i + 1) / count_threads;
+            workers[worker_i].job = &job;
+            workers[worker_i].index = worker_i;
         }
 
-        int64_t length;
-        IntroAttributeDataId attr = intro_get_attr(cont);
-        if (intro_attribute_length_x(city->ictx, cont, &length)) {
-        } else if (intro_has_attribute_x(city->ictx, attr, city->ictx->attr.builtin.cstring)) {
-            length = strlen((char *)ptr) + 1;
-        } else {
-            length = 1;
+        // a worker that could not be started leaves its range to be stolen
+        bool started [CITY_MAX_THREADS];
+        for (int worker_i=1; worker_i < count_threads; worker_i++) {
+            started[worker_i] = pthread_create(&threads[worker_i], NULL, &city__worker, &workers[worker_i]) == 0;
         }
+        city__worker(&workers[0]);
+        for (int worker_i=1; worker_i < count_threads; worker_i++) {
+            if (started[worker_i]) pthread_join(threads[worker_i], NULL);
+        }
+        for (int worker_i=0; worker_i < count_threads; worker_i++) {
+            pthread_mutex_destroy(&ranges[worker_i].lock);
+        }
+        return;
+    }
+#else
+    (void) count_threads;
+#endif
+    proc(user, 0, 0, count);
+}
 
-        uint32_t elem_size = packed_size(city, type->u.of);
-        uint32_t buf_size = elem_size * length;
-        CityBuffer buf;
-        CityDeferredPointer dptr;
-        dptr.data_location = data_offset;
-        for (size_t buf_i=0; buf_i < arr_len(city->buffers); buf_i++) {
-            buf = city->buffers[buf_i];
-            if (ptr == buf.origin && buf_size == buf.size) {
-                dptr.ptr_value = buf.ser_offset;
-                return;
+typedef struct {
+    CityContext * city;
+    IntroContainer cont; // the array or pointer
+    size_t data_offset;
+    size_t elem_size;
+} CitySerializeJob;
+
+static void
+city__serialize_range(void * user, int worker_i, size_t start, size_t end) {
+    CitySerializeJob * job = (CitySerializeJob *)user;
+    (void) worker_i;
+    if (intro__expr_batch_wanted(job->cont.type->u.of)) {
+        // expressions of the members are evaluated for a run of elements at once
+        IntroExprBatch batch;
+        for (size_t batch_start=start; batch_start < end; batch_start += INTRO_EXPR_BATCH) {
+            size_t batch_end = (end - batch_start > INTRO_EXPR_BATCH)? batch_start + INTRO_EXPR_BATCH : end;
+            intro__expr_batch(job->city->ictx, &batch, job->cont, batch_start, batch_end - batch_start);
+            for (size_t elem_i=batch_start; elem_i < batch_end; elem_i++) {
+                city__serialize_batched(job->city, job->data_offset + elem_i * job->elem_size, intro_push(&job->cont, elem_i),
+                                        &batch, elem_i - batch_start);
             }
         }
+        return;
+    }
+    for (size_t elem_i=start; elem_i < end; elem_i++) {
+        city__serialize(job->city, job->data_offset + elem_i * job->elem_size, intro_push(&job->cont, elem_i));
+    }
+}
+
+// Serializes 'count' elements of 'cont' (an array or a pointer) packed at 'data_offset'.
+// Every element has a fixed place in the output, so when nothing new can be discovered
+// inside them they are split between threads.
+static void
+city__serialize_elements(CityContext * city, size_t data_offset, IntroContainer cont, uint32_t count) {
+    const IntroType * elem_type = cont.type->u.of;
+    if (city->measuring && city__is_pointer_free(elem_type)) return;
+
+    CitySerializeJob job;
+    job.city = city;
+    job.cont = cont;
+    job.data_offset = data_offset;
+    job.elem_size = packed_size(city, elem_type);
+
+    if (
+        city->count_threads > 1 && !city->in_parallel && !city->write_proc
+     && job.elem_size * count >= CITY_PARALLEL_MIN_SIZE && city__is_pointer_free(elem_type)
+       )
+    {
+        // the packed info of every nested type is cached first, workers only read it
+        (void) city__packed_info(city, elem_type);
+        city->in_parallel = true;
+        city__run_parallel(city->count_threads, count, &city__serialize_range, &job);
+        city->in_parallel = false;
+        return;
+    }
+
+    city__serialize_range(&job, 0, 0, count);
+}
+
+static void
+city__serialize_union(CityContext * city, size_t data_offset, IntroContainer cont, int32_t selected) {
+    const IntroType * type = cont.type;
+    memset(city__out(city, data_offset), 0, packed_size(city, type));
+    if (selected < 0) return;
+
+    IntroContainer m_cntr = intro_push(&cont, selected);
+    if (city->native) {
+        city__serialize(city, data_offset + type->u.members[selected].offset, m_cntr);
+        return;
+    }
+    uint16_t selection_index = selected;
+    memcpy(city__out(city, data_offset), &selection_index, 2);
+    city__serialize(city, data_offset + 2, m_cntr);
+}
+
+// 'p_length' is the batched length, or NULL to look it up
+static void
+city__serialize_pointer(CityContext * city, size_t data_offset, IntroContainer cont, const int64_t * p_length) {
+    const IntroType * type = cont.type;
+    const u8 * ptr = *(const u8 **)cont.data;
+    if (!ptr || type->u.of->size == 0) {
+        memset(city__out(city, data_offset), 0, city->ptr_size);
+        return;
+    }
+
+    int64_t length;
+    if (p_length) {
+        length = *p_length;
+    } else if (intro_attribute_length_x(city->ictx, cont, &length)) {
+    } else if (intro_has_attribute_x(city->ictx, intro_get_attr(cont), city->ictx->attr.builtin.cstring)) {
+        length = strlen((char *)ptr) + 1;
+    } else {
+        length = 1;
+    }
+
+    size_t elem_size = packed_size(city, type->u.of);
+    size_t buf_size = elem_size * length;
+
+    CityBufferKey key;
+    memset(&key, 0, sizeof(key));
+    key.origin = (uintptr_t)ptr;
+    key.size = buf_size;
+
+    HashEntry entry;
+    entry.key_data = &key;
+    entry.key_size = sizeof(key);
+    table_get(city->buffer_set, &entry);
+
+    size_t ser_offset;
+    if (entry.value != TABLE_INVALID_VALUE) {
+        ser_offset = entry.value;
+    } else {
+        ser_offset = city->data_end + 4; // TODO: the length should go with a ptr, not with the buffer
+        if (city->native) {
+            ser_offset = (ser_offset + CITY_NATIVE_ALIGN - 1) & ~(CITY_NATIVE_ALIGN - 1);
+        }
+        city__check_ptr_width(city, ser_offset + buf_size);
+        if (city->overflow) return;
 
-        uint32_t * ser_length = (uint32_t *)arr_alloc_ptr(city->data, 4); // TODO: this should go with a ptr, not with the buffer
-        memcpy(ser_length, &length, 4);
+        city->data_end = ser_offset + buf_size;
 
-        uint32_t ser_offset = arr_alloc_idx(city->data, buf_size);
+        entry.value = ser_offset;
+        table_set(city->buffer_set, entry);
 
+        // the buffer is written later, in order, so deep pointer chains don't recurse
+        CityBuffer buf;
         buf.origin = ptr;
+        buf.ptr_type = type;
         buf.ser_offset = ser_offset;
-        buf.size = buf_size;
+        buf.length = length;
         arr_append(city->buffers, buf);
+    }
+
+    memcpy(city__out(city, data_offset), &ser_offset, city->ptr_size);
+    if (city->native) arr_append(city->relocs, data_offset);
+}
 
-        dptr.ptr_value = ser_offset;
-        arr_append(city->deferred_ptrs, dptr);
+// Like city__serialize for a struct, with the union selections and lengths of its members taken from 'batch'.
+static void
+city__serialize_batched(CityContext * city, size_t data_offset, IntroContainer cont, const IntroExprBatch * batch, size_t batch_i) {
+    if (city->overflow) return;
 
-        if (intro_is_scalar(type->u.of)) {
-            memcpy(city->data + ser_offset, ptr, buf_size);
+    if (!intro_has_attribute_x(city->ictx, intro_get_attr(cont), city->ictx->attr.builtin.city)) {
+        memset(city__out(city, data_offset), 0, packed_size(city, cont.type));
+        return;
+    }
+
+    CityPackedInfo info = city__packed_info(city, cont.type);
+    for (uint32_t m_index=0; m_index < cont.type->count; m_index++) {
+        IntroContainer m_cntr = intro_push(&cont, m_index);
+        size_t m_offset = data_offset + info.member_offsets[m_index];
+        const int64_t * values = intro__expr_batch_get(batch, m_index);
+        if (!values || !intro_has_attribute_x(city->ictx, intro_get_attr(m_cntr), city->ictx->attr.builtin.city)) {
+            city__serialize(city, m_offset, m_cntr);
+        } else if (m_cntr.type->category == INTRO_UNION) {
+            city__serialize_union(city, m_offset, m_cntr, values[batch_i]);
         } else {
-            for (uint32_t elem_i=0; elem_i < length; elem_i++) {
-                uint32_t elem_offset = ser_offset + (elem_i * elem_size);
-                city__serialize(city, elem_offset, intro_push(&cont, elem_i));
+            city__serialize_pointer(city, m_offset, m_cntr, &values[batch_i]);
+        }
+    }
+}
+
+static void
+city__serialize(CityContext * city, size_t data_offset, IntroContainer cont) {
+    const IntroType * type = cont.type;
+    const u8 * src = cont.data;
+
+    if (city->overflow) return;
+
+    if (!intro_has_attribute_x(city->ictx, intro_get_attr(cont), city->ictx->attr.builtin.city)) {
+        memset(city__out(city, data_offset), 0, packed_size(city, type));
+        return;
+    }
+
+    switch(type->category) {
+    case INTRO_STRUCT: {
+        CityPackedInfo info = city__packed_info(city, type);
+        for (uint32_t m_index=0; m_index < type->count; m_index++) {
+            city__serialize(city, data_offset + info.member_offsets[m_index], intro_push(&cont, m_index));
+        }
+    }break;
+
+    case INTRO_UNION: {
+        int32_t selected = -1;
+        for (uint32_t i=0; i < type->count; i++) {
+            int64_t is_valid;
+            if (intro_attribute_expr_x(city->ictx, intro_push(&cont, i), city->ictx->attr.builtin.when, &is_valid) && is_valid) {
+                selected = i;
+                break;
             }
         }
+        city__serialize_union(city, data_offset, cont, selected);
+    }break;
+
+    case INTRO_POINTER: {
+        city__serialize_pointer(city, data_offset, cont, NULL);
     }break;
 
     case INTRO_ARRAY: {
         if (intro_is_scalar(type->u.of)) {
-            memcpy(city->data + data_offset, src, type->size);
+            memcpy(city__out(city, data_offset), src, type->size);
         } else {
-            size_t ser_size = packed_size(city, type->u.of);
-            for (uint32_t elem_i=0; elem_i < type->count; elem_i++) {
-                uint32_t elem_offset = data_offset + (elem_i * ser_size);
-                city__serialize(city, elem_offset, intro_push(&cont, elem_i));
-            }
+            city__serialize_elements(city, data_offset, cont, type->count);
         }
     }break;
 
     default: {
-        memcpy(city->data + data_offset, src, type->size);
+        memcpy(city__out(city, data_offset), src, type->size);
     }break;
     }
 }
 
-void *
-intro_create_city_x(IntroContext * ictx, const void * src, const IntroType * s_type, size_t *o_size) {
-    // init context
-    CityContext _city, * city = &_city;
-
-    CityHeader header;
-    memset(&header, 0, sizeof(header));
-    memcpy(header.magic_number, "ICTY", 4);
-    header.version_major = implementation_version_major;
-    header.version_minor = implementation_version_minor;
-
-    memset(city, 0, sizeof(_city));
+static void
+city__init_writer(CityContext * city, IntroContext * ictx, uint8_t type_size, uint8_t ptr_size) {
+    memset(city, 0, sizeof(*city));
 
     city->ictx = ictx;
-
-    city->type_size = 2;
-    city->ptr_size = 3;
-    header.size_info = ((city->type_size-1) << 4) | (city->ptr_size-1);
+    city->type_size = type_size;
+    city->ptr_size = ptr_size;
 
     arr_init(city->data);
     arr_init(city->info);
-    arr_init(city->deferred_ptrs);
+    arr_init(city->names);
     arr_init(city->buffers);
+    arr_init(city->packed);
+    arr_init(city->relocs);
+    city->buffer_set = new_table(128);
     city->name_cache = new_table(128);
     city->type_set = new_table(128);
+    city->packed_set = new_table(128);
+    city->arena = new_arena(4096);
+}
 
-    // reserve space for main data
-    (void) arr_alloc_idx(city->data, packed_size(city, s_type));
-
-    // create type info
-
-    uint32_t main_type_id = city__get_serialized_id(city, s_type);
-    uint32_t count_types = table_count(city->type_set);
-    assert(main_type_id == count_types - 1);
-
-    header.count_types = count_types;
-    header.data_ptr = sizeof(header) + arr_len(city->info);
-
-    // serialized data
-
-    CityBuffer src_buf;
-    src_buf.origin = (const u8 *)src;
-    src_buf.ser_offset = 0;
-    src_buf.size = packed_size(city, s_type);
+static void
+city__free_writer(CityContext * city) {
+    if (city->data) arr_free(city->data);
+    arr_free(city->info);
+    arr_free(city->names);
+    arr_free(city->buffers);
+    arr_free(city->packed);
+    arr_free(city->relocs);
+    free_table(city->buffer_set);
+    free_table(city->name_cache);
+    free_table(city->type_set);
+    free_table(city->packed_set);
+    free_arena(city->arena);
+}
 
-    arr_append(city->buffers, src_buf);
-    city__serialize(city, 0, intro_cntr((void *)src, s_type));
+// serializes 'src' at data offset 0. pointers back to it refer to the root instead of a copy
+static void
+city__write_root(CityContext * city, const void * src, const IntroType * s_type, size_t main_size) {
+    CityBufferKey src_key;
+    memset(&src_key, 0, sizeof(src_key));
+    src_key.origin = (uintptr_t)src;
+    src_key.size = main_size;
+
+    HashEntry src_entry;
+    src_entry.key_data = &src_key;
+    src_entry.key_size = sizeof(src_key);
+    src_entry.value = 0;
+    table_set(city->buffer_set, src_entry);
+
+    city__serialize(city, city__reserve(city, main_size), intro_cntr((void *)src, s_type));
+}
 
-    for (size_t i=0; i < arr_len(city->deferred_ptrs); i++) {
-        CityDeferredPointer dptr = city->deferred_ptrs[i];
-        u8 * o_ptr = city->data + dptr.data_location;
-        memcpy(o_ptr, &dptr.ptr_value, city->ptr_size);
+// serializes every queued pointer buffer, and the buffers they queue, in order
+static void
+city__write_buffers(CityContext * city) {
+    for (size_t buf_i=0; buf_i < arr_len(city->buffers) && !city->overflow && !city->write_failed; buf_i++) {
+        CityBuffer buf = city->buffers[buf_i];
+        IntroContainer ptr_cntr = intro_cntr((void *)&buf.origin, buf.ptr_type);
+        const IntroType * elem_type = buf.ptr_type->u.of;
+        size_t elem_size = packed_size(city, elem_type);
+
+        (void) city__reserve(city, buf.ser_offset - 4 - city__offset(city)); // alignment padding
+        put_uint(&city->data, buf.length, 4);
+        assert(city__offset(city) == buf.ser_offset);
+
+        if (city->measuring && city__is_pointer_free(elem_type)) {
+            // nothing in the buffer can move the widths, only its size matters
+            city__flush(city, true);
+            city->data_base += elem_size * buf.length;
+        } else if (intro_is_scalar(elem_type)) {
+            size_t buf_size = elem_size * buf.length;
+            if (city->write_proc && buf_size >= CITY_STREAM_CHUNK_SIZE) {
+                // large scalar buffers are passed straight through
+                city__flush(city, true);
+                if (!city->write_proc(city->write_user, buf.origin, buf_size)) {
+                    city->write_failed = true;
+                }
+                city->data_base += buf_size;
+            } else {
+                memcpy(city__out(city, city__reserve(city, buf_size)), buf.origin, buf_size);
+            }
+        } else if (!city->write_proc) {
+            city__serialize_elements(city, city__reserve(city, elem_size * buf.length), ptr_cntr, buf.length);
+        } else {
+            for (uint32_t elem_i=0; elem_i < buf.length; elem_i++) {
+                city__serialize(city, city__reserve(city, elem_size), intro_push(&ptr_cntr, elem_i));
+                city__flush(city, false);
+            }
+        }
+        city__flush(city, false);
+    }
+}
+
+// Creates the type info and the data. When city->write_proc is set, everything is passed to it
+// in order in bounded chunks. Otherwise city->data holds the header, type info and data.
+// Returns false if the chosen widths were too small or writing failed.
+static bool
+city__write(CityContext * city, const void * src, const IntroType * s_type) {
+    CityHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic_number, "ICTY", 4);
+    header.version_major = implementation_version_major;
+    header.version_minor = implementation_version_minor;
+    header.size_info = ((city->type_size-1) << 4) | (city->ptr_size-1);
+    if (city->native) header.flags |= CITY_FLAG_NATIVE;
+    if (city->shared_types) header.flags |= CITY_FLAG_SHARED_TYPES;
+    uint64_t schema_hash = city__schema_hash(city->ictx, s_type);
+    memcpy(header.schema_hash, &schema_hash, 8);
+
+    size_t main_size = packed_size(city, s_type);
+    city__check_ptr_width(city, main_size);
+    if (city->overflow) return false;
+
+    // create type info, member names are placed directly after the main data
+    // shared types are only identified by the schema hash, a schema file has them
+
+    uint32_t count_types = 0;
+    if (!city->shared_types) {
+        city->names_base = main_size;
+        uint32_t main_type_id = city__get_serialized_id(city, s_type);
+        count_types = table_count(city->type_set);
+        assert(main_type_id == count_types - 1);
+        (void) main_type_id;
+
+        if (count_types - 1 > ((uint64_t)1 << (city->type_size * 8)) - 1) {
+            city->overflow |= CITY_OVERFLOW_TYPE;
+        }
+    }
+    city->data_end = main_size + arr_len(city->names);
+    city__check_ptr_width(city, city->data_end);
+    if (city->overflow) return false;
+
+    header.count_types = count_types;
+    if (city->native) {
+        // the data section is aligned so it can be used where it is loaded
+        while ((sizeof(header) + arr_len(city->info)) % CITY_NATIVE_ALIGN != 0) {
+            arr_append(city->info, 0);
+        }
+    }
+    header.data_ptr = sizeof(header) + arr_len(city->info);
+
+    if (city->write_proc) {
+        if (
+            !city->write_proc(city->write_user, &header, sizeof(header))
+         || !city->write_proc(city->write_user, city->info, arr_len(city->info))
+           )
+        {
+            city->write_failed = true;
+            return false;
+        }
+    } else {
+        // the result is built in place so it doesn't need to be copied at the end
+        u8 * prefix = arr_alloc_ptr(city->data, header.data_ptr);
+        memcpy(prefix, &header, sizeof(header));
+        memcpy(prefix + sizeof(header), city->info, arr_len(city->info));
+        city->data_prefix = header.data_ptr;
+    }
+
+    // serialized data
+
+    city__write_root(city, src, s_type, main_size);
+    arr_append_range(city->data, city->names, arr_len(city->names));
+    city__flush(city, false);
+
+    city__write_buffers(city);
+
+    if (city->native && !city->overflow && !city->write_failed) {
+        // relocation table: offsets of every pointer followed by the count
+        (void) city__reserve(city, (8 - city__offset(city) % 8) % 8);
+        for (size_t reloc_i=0; reloc_i < arr_len(city->relocs); reloc_i++) {
+            put_uint(&city->data, city->relocs[reloc_i], 8);
+            city__flush(city, false);
+        }
+        put_uint(&city->data, arr_len(city->relocs), 8);
+    }
+    city__flush(city, true);
+
+    return !city->overflow && !city->write_failed;
+}
+
+static bool
+city__discard_proc(void * user, const void * data, size_t size) {
+    (void) user; (void) data; (void) size;
+    return true;
+}
+
+// Pointers start with 4 bytes, which fits almost everything in one pass. Narrower pointers only
+// make the data smaller, so once it is written the narrowest width that fits its size is known to
+// fit too and is used for one more pass. Whichever width overflowed grows.
+static bool
+city__choose_widths(CityContext * city, IntroContext * ictx, IntroWriteProc write_proc, void * user, const void * src, const IntroType * s_type, uint8_t flags, int count_threads) {
+    bool native = (flags & CITY_FLAG_NATIVE) != 0;
+    uint8_t type_size = 1, ptr_size = (native)? sizeof(void *) : 4;
+    while (1) {
+        city__init_writer(city, ictx, type_size, ptr_size);
+        city->native = native;
+        city->shared_types = (flags & CITY_FLAG_SHARED_TYPES) != 0;
+        city->count_threads = count_threads;
+        city->write_proc = write_proc;
+        city->write_user = user;
+        city->measuring = (write_proc == &city__discard_proc);
+        if (city__write(city, src, s_type)) {
+            if (native) return true;
+            uint8_t fit_size = 2;
+            while (city__width_max(fit_size) < city->data_end) fit_size++;
+            if (fit_size >= ptr_size) return true;
+            city__free_writer(city);
+            ptr_size = fit_size;
+            continue;
+        }
+
+        if (city->write_failed) return false;
+        if ((city->overflow & CITY_OVERFLOW_TYPE)) type_size++;
+        if ((city->overflow & CITY_OVERFLOW_PTR)) ptr_size++;
+        city__free_writer(city);
+
+        if (type_size > 4 || ptr_size > 8) {
+            city__error("data is too large.");
+            return false;
+        }
+    }
+}
+
+static void *
+city__create(IntroContext * ictx, const void * src, const IntroType * s_type, size_t *o_size, uint8_t flags, int count_threads) {
+    CityContext _city, * city = &_city;
+    if (!city__choose_widths(city, ictx, NULL, NULL, src, s_type, flags, count_threads)) {
+        return NULL;
     }
-    arr_free(city->deferred_ptrs);
 
-    size_t result_size = header.data_ptr + arr_len(city->data);
+    size_t result_size = arr_len(city->data);
     u8 * result = (u8 *)malloc(result_size);
-    u8 * p = result;
-    memcpy(p, &header, sizeof(header));
-    p += sizeof(header);
+    if (result) memcpy(result, city->data, result_size);
+    city__free_writer(city);
+    if (!result) {
+        city__error("out of memory.");
+        return NULL;
+    }
 
-    memcpy(p, city->info, arr_len(city->info));
-    p += arr_len(city->info);
+    *o_size = result_size;
+    return (void *)result;
+}
 
-    memcpy(p, city->data, arr_len(city->data));
+void *
+intro_create_city_x(IntroContext * ictx, const void * src, const IntroType * s_type, size_t *o_size) {
+    return city__create(ictx, src, s_type, o_size, 0, 1);
+}
 
-    arr_free(city->info);
-    arr_free(city->data);
-    free_table(city->name_cache);
-    free_table(city->type_set);
+// Same output as intro_create_city. Large arrays of elements without pointers are written by
+// 'count_threads' threads, or one per processor if it is 0.
+void *
+intro_create_city_parallel_x(IntroContext * ictx, const void * src, const IntroType * s_type, size_t *o_size, int count_threads) {
+#if INTRO_HAVE_THREADS
+    if (count_threads <= 0) count_threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (count_threads < 1) count_threads = 1;
+    return city__create(ictx, src, s_type, o_size, 0, count_threads);
+}
+
+static bool
+city__write_stream(IntroContext * ictx, IntroWriteProc write_proc, void * user, const void * src, const IntroType * s_type, bool native) {
+    CityContext _city, * city = &_city;
+
+    // widths can't change once something is written, so they are found first by a pass that
+    // only follows pointers and discards the output
+    if (!city__choose_widths(city, ictx, &city__discard_proc, NULL, src, s_type, (native)? CITY_FLAG_NATIVE : 0, 1)) {
+        return false;
+    }
+    uint8_t type_size = city->type_size, ptr_size = city->ptr_size;
+    city__free_writer(city);
+
+    city__init_writer(city, ictx, type_size, ptr_size);
+    city->native = native;
+    city->write_proc = write_proc;
+    city->write_user = user;
+    bool ok = city__write(city, src, s_type);
+    city__free_writer(city);
+
+    return ok;
+}
+
+bool
+intro_write_city_stream_x(IntroContext * ictx, IntroWriteProc write_proc, void * user, const void * src, const IntroType * s_type) {
+    return city__write_stream(ictx, write_proc, user, src, s_type, false);
+}
+
+// Starts city->data with a header and the type info of 'type', but no data. Member names are placed
+// at 'names_base' in the data section. Returns false if the types don't fit in 'ptr_size' bytes.
+static bool
+city__write_types(CityContext * city, IntroContext * ctx, const IntroType * type, uint8_t ptr_size, size_t names_base, uint8_t flags) {
+    uint8_t type_size = 1;
+    while (1) {
+        city__init_writer(city, ctx, type_size, ptr_size);
+        city->names_base = names_base;
+        (void) city__get_serialized_id(city, type);
+        if (table_count(city->type_set) - 1 > ((uint64_t)1 << (type_size * 8)) - 1) {
+            city->overflow |= CITY_OVERFLOW_TYPE;
+        }
+        city__check_ptr_width(city, names_base + arr_len(city->names));
+        if (!city->overflow) break;
+
+        bool retry = (city->overflow == CITY_OVERFLOW_TYPE && type_size < 4);
+        city__free_writer(city);
+        if (!retry) {
+            city__error("data is too large.");
+            return false;
+        }
+        type_size++;
+    }
+
+    CityHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic_number, "ICTY", 4);
+    header.version_major = implementation_version_major;
+    header.version_minor = implementation_version_minor;
+    header.size_info = ((city->type_size-1) << 4) | (city->ptr_size-1);
+    header.flags = flags;
+    header.count_types = table_count(city->type_set);
+    header.data_ptr = sizeof(header) + arr_len(city->info);
+    uint64_t schema_hash = city__schema_hash(ctx, type);
+    memcpy(header.schema_hash, &schema_hash, 8);
+
+    arr_append_range(city->data, (u8 *)&header, sizeof(header));
+    arr_append_range(city->data, city->info, arr_len(city->info));
+    return true;
+}
+
+// SHARED TYPES
+// A schema file holds only type info, its data section is the member names. Files created with
+// intro_create_city_shared have no type info, they are matched with a schema by the schema hash.
+// Type info that is read is kept in a cache for the rest of the process, keyed by schema hash and
+// pointer width, so loading many files of the same type only reads it once.
+
+void *
+intro_create_city_schema_x(IntroContext * ctx, const IntroType * type, size_t * o_size) {
+    if (city__schema_hash(ctx, type) == 0) {
+        city__error("a schema needs types with a schema hash.");
+        return NULL;
+    }
+    CityContext _city, * city = &_city;
+    if (!city__write_types(city, ctx, type, 4, 0, CITY_FLAG_SCHEMA)) return NULL;
+    arr_append_range(city->data, city->names, arr_len(city->names));
+
+    size_t result_size = arr_len(city->data);
+    u8 * result = (u8 *)malloc(result_size);
+    if (result) memcpy(result, city->data, result_size);
+    city__free_writer(city);
+    if (!result) {
+        city__error("out of memory.");
+        return NULL;
+    }
 
     *o_size = result_size;
     return (void *)result;
 }
 
-static int
-city__load_into(
-    CityContext * city,
-    IntroContainer d_cont,
-    void * restrict src,
-    const IntroType * restrict s_type
-) {
-    IntroContext * ctx = city->ictx;
-    const IntroType * d_type = d_cont.type;
-    u8 * dest = d_cont.data;
+// Same as intro_create_city, without the type info. Loading the result needs a schema of the
+// same type, or a destination type with the same schema hash.
+void *
+intro_create_city_shared_x(IntroContext * ctx, const void * src, const IntroType * s_type, size_t * o_size) {
+    if (city__schema_hash(ctx, s_type) == 0) {
+        city__error("shared types need a schema hash.");
+        return NULL;
+    }
+    return city__create(ctx, src, s_type, o_size, CITY_FLAG_SHARED_TYPES, 1);
+}
 
-    uint16_t union_selection = 0;
-    if (s_type->category == INTRO_UNION) {
-        memcpy(&union_selection, src, 2);
-        src = (u8 *)src + 2;
+// LOG
+// A log has one header and type info, then a stream of records that share them. The data section
+// begins with a u32 size and the member names. Each record is a u32 size followed by its own
+// data section: the root at offset 0 then its pointer buffers, with offsets relative to the record.
+// Closing the log adds an index: a u32 size with CITY_LOG_INDEX_MARK set, the u64 data offset of
+// every CITY_LOG_INDEX_STRIDE-th record, the u64 record count, the u32 stride and the u32 size again.
+
+static const uint8_t CITY_LOG_PTR_SIZE = 4;
+static const uint32_t CITY_LOG_INDEX_MARK = 0x80000000; // never set on a record size
+static const uint32_t CITY_LOG_INDEX_STRIDE = 64;
+
+struct IntroCityLog {
+    CityContext city;
+    const IntroType * type;
+    size_t main_size;
+    IntroWriteProc write_proc;
+    void * write_user;
+    uint64_t count_records;
+    uint64_t end; // data offset after the last record
+    uint64_t * index;
+};
+
+// Writes the header and type info of a log of 'type' records. Returns NULL if writing failed.
+IntroCityLog *
+intro_city_log_create_x(IntroContext * ctx, const IntroType * type, IntroWriteProc write_proc, void * user) {
+    IntroCityLog * log = (IntroCityLog *)calloc(1, sizeof(*log));
+    CityContext * city = &log->city;
+    log->type = type;
+    log->write_proc = write_proc;
+    log->write_user = user;
+
+    // records can't change the widths, so the offsets in every record use CITY_LOG_PTR_SIZE bytes
+    if (!city__write_types(city, ctx, type, CITY_LOG_PTR_SIZE, 4, CITY_FLAG_LOG)) {
+        free(log);
+        return NULL;
+    }
+    log->main_size = packed_size(city, type);
+    city__check_ptr_width(city, log->main_size);
+    if (city->overflow) {
+        city__error("data is too large.");
+        city__free_writer(city);
+        free(log);
+        return NULL;
     }
 
-    switch(s_type->category) {
-    case INTRO_UNION:
-    case INTRO_STRUCT: {
-        const char ** aliases = NULL;
-        arr_init(aliases);
+    put_uint(&city->data, arr_len(city->names), 4);
+    arr_append_range(city->data, city->names, arr_len(city->names));
+    if (!write_proc(user, city->data, arr_len(city->data))) {
+        city__free_writer(city);
+        free(log);
+        return NULL;
+    }
+    log->end = 4 + arr_len(city->names);
+    arr_init(log->index);
+    return log;
+}
 
-        for (uint32_t dm_i=0; dm_i < d_type->count; dm_i++) {
-#if 0
-            bool do_skip = false;
-            for (int skip_i=0; skip_i < arr_len(skip_members); skip_i++) {
-                if (skip_members[skip_i] == dm_i) {
-                    uint32_t last = skip_members[--arr_len(skip_members)];
-                    if (arr_len(skip_members) >= 1) {
-                        skip_members[dm_i] = last;
-                    }
-                    do_skip = true;
-                    break;
-                }
-            }
-            if (do_skip) continue;
+// Serializes 'record' and passes it to the write proc in a single call.
+// Returns false if the record is too large or writing failed.
+bool
+intro_city_log_append(IntroCityLog * log, const void * record) {
+    CityContext * city = &log->city;
+
+    // the context is reused, only the state of the previous record is cleared
+    arr_len(city->data) = 0;
+    arr_len(city->buffers) = 0;
+    table_clear(city->buffer_set);
+    city->overflow = 0;
+    city->write_failed = false;
+    city->data_base = 0;
+    city->data_prefix = 4;
+    city->data_end = log->main_size;
+    (void) arr_alloc_idx(city->data, 4);
+
+    city__write_root(city, record, log->type, log->main_size);
+    city__write_buffers(city);
+    // a size with CITY_LOG_INDEX_MARK set would be read as the index
+    if (city->overflow || city__offset(city) >= CITY_LOG_INDEX_MARK) {
+        city__error("record is too large.");
+        return false;
+    }
+
+    uint32_t record_size = city__offset(city);
+    memcpy(city->data, &record_size, 4);
+    if (!log->write_proc(log->write_user, city->data, arr_len(city->data))) return false;
+
+    if (log->count_records % CITY_LOG_INDEX_STRIDE == 0) arr_append(log->index, log->end);
+    log->count_records += 1;
+    log->end += arr_len(city->data);
+    return true;
+}
+
+// Writes the index and frees the log. Returns false if writing the index failed.
+bool
+intro_city_log_close(IntroCityLog * log) {
+    CityContext * city = &log->city;
+    uint32_t index_size = arr_len(log->index) * 8 + 16;
+
+    arr_len(city->data) = 0;
+    put_uint(&city->data, CITY_LOG_INDEX_MARK | index_size, 4);
+    arr_append_range(city->data, (u8 *)log->index, arr_len(log->index) * 8);
+    put_uint(&city->data, log->count_records, 8);
+    put_uint(&city->data, CITY_LOG_INDEX_STRIDE, 4);
+    put_uint(&city->data, index_size, 4);
+    bool ok = log->write_proc(log->write_user, city->data, arr_len(city->data));
+
+    arr_free(log->index);
+    city__free_writer(city);
+    free(log);
+    return ok;
+}
+
+// COMPRESSION
+// The data section is split into blocks that are compressed independently with a small LZ codec.
+// A sequence is a token byte (literal count << 4 | match length - 4), extra literal count bytes,
+// the literals, a u16 match offset, then extra match length bytes. Counts of 15 continue in
+// following bytes, which are added until one is not 255. The last sequence has only literals.
+
+static const uint32_t CITY_BLOCK_SIZE = 1 << 16; // match offsets must fit in a u16
+static const uint32_t CITY_BLOCK_STORED = 0x80000000; // set on block sizes that were not compressed
+#define CITY_LZ_HASH_BITS 12
+#define CITY_LZ_MIN_MATCH 4
+#define CITY_LZ_LAST_LITERALS 5
+
+static size_t
+city__lz_bound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+static void
+city__lz_put_count(u8 ** p_out, size_t count) {
+    u8 * out = *p_out;
+    while (count >= 255) {
+        *out++ = 255;
+        count -= 255;
+    }
+    *out++ = (u8)count;
+    *p_out = out;
+}
+
+static u8 *
+city__lz_put_sequence(u8 * out, const u8 * literals, size_t count_literals, uint32_t offset, size_t match_length) {
+    u8 * token = out++;
+    *token = (u8)(((count_literals < 15)? count_literals : 15) << 4);
+    if (count_literals >= 15) city__lz_put_count(&out, count_literals - 15);
+    memcpy(out, literals, count_literals);
+    out += count_literals;
+
+    if (match_length > 0) {
+        out[0] = offset & 0xff;
+        out[1] = (offset >> 8) & 0xff;
+        out += 2;
+        size_t extra = match_length - CITY_LZ_MIN_MATCH;
+        *token |= (extra < 15)? extra : 15;
+        if (extra >= 15) city__lz_put_count(&out, extra - 15);
+    }
+    return out;
+}
+
+// 'dest' must have room for city__lz_bound(size) bytes. Returns the compressed size.
+static size_t
+city__lz_compress(const u8 * src, size_t size, u8 * dest) {
+    uint32_t table [1 << CITY_LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    const u8 * ip = src;
+    const u8 * anchor = src;
+    const u8 * match_limit = (size > CITY_LZ_LAST_LITERALS)? src + size - CITY_LZ_LAST_LITERALS : src;
+    u8 * out = dest;
+
+    while (ip + CITY_LZ_MIN_MATCH <= match_limit) {
+        uint32_t seq;
+        memcpy(&seq, ip, 4);
+        uint32_t hash = (seq * 2654435761u) >> (32 - CITY_LZ_HASH_BITS);
+        const u8 * ref = src + table[hash];
+        table[hash] = ip - src;
+
+        uint32_t ref_seq;
+        memcpy(&ref_seq, ref, 4);
+        if (ref < ip && ip - ref <= 0xffff && ref_seq == seq) {
+            size_t length = CITY_LZ_MIN_MATCH;
+            while (ip + length < match_limit && ref[length] == ip[length]) length++;
+            out = city__lz_put_sequence(out, anchor, ip - anchor, ip - ref, length);
+            ip += length;
+            anchor = ip;
+        } else {
+            ip++;
+        }
+    }
+
+    out = city__lz_put_sequence(out, anchor, src + size - anchor, 0, 0);
+    return out - dest;
+}
+
+static bool
+city__lz_get_count(const u8 ** p_in, const u8 * in_end, size_t * o_count) {
+    const u8 * in = *p_in;
+    u8 b;
+    do {
+        if (in >= in_end) return false;
+        b = *in++;
+        *o_count += b;
+    } while (b == 255);
+    *p_in = in;
+    return true;
+}
+
+// Returns false if 'src' is malformed or does not decode to exactly 'dest_size' bytes.
+static bool
+city__lz_decompress(const u8 * src, size_t src_size, u8 * dest, size_t dest_size) {
+    const u8 * in = src, * in_end = src + src_size;
+    u8 * out = dest, * out_end = dest + dest_size;
+
+    while (1) {
+        if (in >= in_end) return false;
+        u8 token = *in++;
+
+        size_t count_literals = token >> 4;
+        if (count_literals == 15 && !city__lz_get_count(&in, in_end, &count_literals)) return false;
+        if (count_literals > (size_t)(in_end - in) || count_literals > (size_t)(out_end - out)) return false;
+        memcpy(out, in, count_literals);
+        in += count_literals;
+        out += count_literals;
+
+        if (in == in_end) return out == out_end;
+
+        if (in_end - in < 2) return false;
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        if (offset == 0 || offset > (size_t)(out - dest)) return false;
+
+        size_t length = token & 0x0f;
+        if (length == 15 && !city__lz_get_count(&in, in_end, &length)) return false;
+        length += CITY_LZ_MIN_MATCH;
+        if (length > (size_t)(out_end - out)) return false;
+
+        const u8 * ref = out - offset;
+        if (offset >= length) {
+            memcpy(out, ref, length);
+        } else {
+            for (size_t i=0; i < length; i++) out[i] = ref[i]; // overlapping repeats
+        }
+        out += length;
+    }
+}
+
+// CHECKSUM
+// CRC32C (Castagnoli) of everything after the header.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define CITY_CRC32C_SSE42 1
+  #include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+  #define CITY_CRC32C_ARM 1
+  #include <arm_acle.h>
 #endif
-            const IntroMember * dm = &d_type->u.members[dm_i];
 
-            arr_append(aliases, dm->name);
-            IntroVariant var;
-            if (intro_attribute_value_x(ctx, NULL, dm->attr, ctx->attr.builtin.alias, &var)) {
-                char * alias = (char *)var.data;
-                arr_append(aliases, alias);
-            }
+static uint32_t city__crc32c_table [8][256];
 
-            bool found_match = false;
-            // TODO: it would probably be faster to build a hash lookup during the type parse so this isn't slow searching
+static void
+city__init_crc32c_table(void) {
+    for (uint32_t i=0; i < 256; i++) {
+        uint32_t c = i;
+        for (int bit=0; bit < 8; bit++) c = (c >> 1) ^ ((c & 1)? 0x82F63B78 : 0);
+        city__crc32c_table[0][i] = c;
+    }
+    for (uint32_t i=0; i < 256; i++) {
+        for (int t=1; t < 8; t++) {
+            uint32_t prev = city__crc32c_table[t-1][i];
+            city__crc32c_table[t][i] = (prev >> 8) ^ city__crc32c_table[0][prev & 0xff];
+        }
+    }
+}
 
-            uint32_t iter_start, iter_end;
-            if (s_type->category == INTRO_UNION) {
-                iter_start = union_selection;
-                iter_end = union_selection + 1;
-            } else {
-                iter_start = 0;
-                iter_end = s_type->count;
-            }
+// the table is filled once, even if several threads check files at the same time
+#if INTRO_HAVE_THREADS
+static pthread_once_t city__crc32c_table_once = PTHREAD_ONCE_INIT;
+#else
+static bool city__crc32c_table_ready = false;
+#endif
 
-            for (uint32_t j = iter_start; j < iter_end; j++) {
-                const IntroMember * sm = &s_type->u.members[j];
+// slicing by 8, used when the processor has no crc32 instruction
+static uint32_t
+city__crc32c_sw(uint32_t crc, const u8 * data, size_t size) {
+#if INTRO_HAVE_THREADS
+    pthread_once(&city__crc32c_table_once, &city__init_crc32c_table);
+#else
+    if (!city__crc32c_table_ready) {
+        city__init_crc32c_table();
+        city__crc32c_table_ready = true;
+    }
+#endif
 
-                bool match = false;
-                if (sm->name) {
-                    for (size_t alias_i=0; alias_i < arr_len(aliases); alias_i++) {
-                        if (strcmp(aliases[alias_i], sm->name) == 0) {
-                            match = true;
-                            break;
-                        }
-                    }
-                } else {
-                    int32_t sm_id = (int32_t)sm->attr.offset;
-                    int32_t dm_id;
-                    if (intro_attribute_int_x(ctx, dm->attr, ctx->attr.builtin.id, &dm_id) && dm_id == sm_id) {
-                        match = true;
-                    }
-                }
-                if (match) {
-                    found_match = true;
-                    if (dm->type->category != sm->type->category) {
-                        char from [128];
-                        char to [128];
-                        char msg [512];
-                        intro_sprint_type_name(from, sm->type);
-                        intro_sprint_type_name(to,   dm->type);
-                        snprintf(msg, sizeof(msg), "type mismatch. from: %s to: %s", from, to);
-                        city__error(msg);
-                        return -1;
-                    }
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word ^= crc;
+        crc = city__crc32c_table[7][word & 0xff]
+            ^ city__crc32c_table[6][(word >> 8) & 0xff]
+            ^ city__crc32c_table[5][(word >> 16) & 0xff]
+            ^ city__crc32c_table[4][(word >> 24) & 0xff]
+            ^ city__crc32c_table[3][(word >> 32) & 0xff]
+            ^ city__crc32c_table[2][(word >> 40) & 0xff]
+            ^ city__crc32c_table[1][(word >> 48) & 0xff]
+            ^ city__crc32c_table[0][word >> 56];
+        data += 8;
+        size -= 8;
+    }
+    while (size--) crc = (crc >> 8) ^ city__crc32c_table[0][(crc ^ *data++) & 0xff];
+    return crc;
+}
+
+#if CITY_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t
+city__crc32c_hw(uint32_t crc, const u8 * data, size_t size) {
+  #if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+  #endif
+    for (; size > 0; data++, size--) crc = _mm_crc32_u8(crc, *data);
+    return crc;
+}
+#elif CITY_CRC32C_ARM
+static uint32_t
+city__crc32c_hw(uint32_t crc, const u8 * data, size_t size) {
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+    }
+    for (; size > 0; data++, size--) crc = __crc32cb(crc, *data);
+    return crc;
+}
+#endif
+
+static uint32_t
+city__crc32c(const void * data, size_t size) {
+    uint32_t crc = 0xFFFFFFFF;
+#if CITY_CRC32C_SSE42
+    if (__builtin_cpu_supports("sse4.2")) return ~city__crc32c_hw(crc, (const u8 *)data, size);
+#elif CITY_CRC32C_ARM
+    return ~city__crc32c_hw(crc, (const u8 *)data, size);
+#endif
+    return ~city__crc32c_sw(crc, (const u8 *)data, size);
+}
+
+static uint32_t
+city__checksum(const void * data, size_t data_size) {
+    size_t header_size = sizeof(CityHeader);
+    return city__crc32c((const u8 *)data + header_size, data_size - header_size);
+}
+
+// Stores a checksum of 'data' in its header. Loads with IntroLoadOptions.validate check it.
+bool
+intro_city_set_checksum(void * data, size_t data_size) {
+    CityHeader header;
+    if (data_size < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic_number, "ICTY", 4) != 0 || header.version_minor < 5) return false;
+
+    header.flags |= CITY_FLAG_CHECKSUM;
+    header.checksum = city__checksum(data, data_size);
+    memcpy(data, &header, sizeof(header));
+    return true;
+}
+
+// Compressed data section: u64 uncompressed size, u32 block size, u32 size of each block, the blocks.
+void *
+intro_create_city_compressed_x(IntroContext * ctx, const void * src, const IntroType * s_type, size_t * o_size) {
+    size_t raw_size;
+    u8 * raw = (u8 *)intro_create_city_x(ctx, src, s_type, &raw_size);
+    if (!raw) return NULL;
+
+    CityHeader header;
+    memcpy(&header, raw, sizeof(header));
+    header.flags |= CITY_FLAG_COMPRESSED;
+
+    uint64_t data_size = raw_size - header.data_ptr;
+    size_t count_blocks = (data_size + CITY_BLOCK_SIZE - 1) / CITY_BLOCK_SIZE;
+    size_t table_size = 12 + 4 * count_blocks;
+    u8 * result = (u8 *)malloc(header.data_ptr + table_size + count_blocks * city__lz_bound(CITY_BLOCK_SIZE));
+
+    memcpy(result, raw, header.data_ptr);
+    memcpy(result, &header, sizeof(header));
+    u8 * section = result + header.data_ptr;
+    memcpy(section, &data_size, 8);
+    memcpy(section + 8, &CITY_BLOCK_SIZE, 4);
+
+    u8 * out = section + table_size;
+    for (size_t block_i=0; block_i < count_blocks; block_i++) {
+        const u8 * block = raw + header.data_ptr + block_i * CITY_BLOCK_SIZE;
+        size_t block_size = data_size - block_i * CITY_BLOCK_SIZE;
+        if (block_size > CITY_BLOCK_SIZE) block_size = CITY_BLOCK_SIZE;
+
+        uint32_t stored_size = city__lz_compress(block, block_size, out);
+        if (stored_size >= block_size) {
+            memcpy(out, block, block_size);
+            stored_size = block_size | CITY_BLOCK_STORED;
+        }
+        memcpy(section + 12 + 4 * block_i, &stored_size, 4);
+        out += stored_size & ~CITY_BLOCK_STORED;
+    }
+    free(raw);
+
+    *o_size = out - result;
+    return result;
+}
+
+// Decodes a compressed data section into a new allocation.
+// Returns NULL after reporting the error if the section is malformed or memory runs out.
+static u8 *
+city__decompress(const u8 * section, size_t section_size, size_t * o_size) {
+    uint64_t data_size = 0;
+    uint32_t block_size = 0;
+    if (section_size >= 12) {
+        memcpy(&data_size, section, 8);
+        memcpy(&block_size, section + 8, 4);
+    }
+    uint64_t count_blocks = (block_size)? (data_size + block_size - 1) / block_size : 0;
+    if (
+        section_size < 12 || block_size == 0
+     || data_size > (uint64_t)section_size * 256 // more than the codec can expand to
+     || count_blocks > (section_size - 12) / 4
+    ) {
+        city__error("malformed compressed data.");
+        return NULL;
+    }
+    u8 * result = (data_size < SIZE_MAX)? (u8 *)malloc(data_size + 1) : NULL;
+    if (!result) {
+        city__error("out of memory.");
+        return NULL;
+    }
+
+    const u8 * in = section + 12 + 4 * count_blocks;
+    const u8 * in_end = section + section_size;
+    for (uint64_t block_i=0; block_i < count_blocks; block_i++) {
+        uint32_t stored_size;
+        memcpy(&stored_size, section + 12 + 4 * block_i, 4);
+        bool is_stored = (stored_size & CITY_BLOCK_STORED) != 0;
+        stored_size &= ~CITY_BLOCK_STORED;
+
+        u8 * out = result + block_i * block_size;
+        size_t out_size = data_size - block_i * block_size;
+        if (out_size > block_size) out_size = block_size;
+
+        bool ok = stored_size <= (size_t)(in_end - in);
+        if (ok && is_stored) {
+            ok = stored_size == out_size;
+            if (ok) memcpy(out, in, out_size);
+        } else if (ok) {
+            ok = city__lz_decompress(in, stored_size, out, out_size);
+        }
+        if (!ok) {
+            city__error("malformed compressed data.");
+            free(result);
+            return NULL;
+        }
+        in += stored_size;
+    }
+
+    *o_size = data_size;
+    return result;
+}
+
+static CityLoadPlan city__load_plan(CityContext * city, const IntroType * s_type, const IntroType * d_type);
+
+// true if packed source data has the same bytes as the destination type
+static bool
+city__layout_identical(CityContext * city, const IntroType * s_type, const IntroType * d_type) {
+    if (s_type->size != d_type->size) return false;
+    if (intro_is_scalar(s_type) || s_type->category == INTRO_ENUM) {
+        return s_type->category == d_type->category;
+    }
+    switch(s_type->category) {
+    case INTRO_ARRAY:
+        return d_type->category == INTRO_ARRAY
+            && s_type->count == d_type->count
+            && city__layout_identical(city, s_type->u.of, d_type->u.of);
+
+    case INTRO_STRUCT:
+        return d_type->category == INTRO_STRUCT && city__load_plan(city, s_type, d_type).is_identical;
+
+    default: return false;
+    }
+}
+
+// Matches destination members to source members by name, alias or id.
+// The result is cached so this is only done once per pair of types.
+static CityLoadPlan
+city__load_plan(CityContext * city, const IntroType * s_type, const IntroType * d_type) {
+    IntroContext * ctx = city->ictx;
+
+    const IntroType * key [2] = {s_type, d_type};
+    HashEntry entry;
+    entry.key_data = key;
+    entry.key_size = sizeof(key);
+    table_get(city->plan_set, &entry);
+    if (entry.value != TABLE_INVALID_VALUE) {
+        return city->plans[entry.value];
+    }
+
+    CityLoadPlan plan;
+    plan.count_variants = (s_type->category == INTRO_UNION)? s_type->count : 1;
+    plan.variants = (CityLoadVariant *)arena_alloc(city->arena, plan.count_variants * sizeof(plan.variants[0]));
+    memset(plan.variants, 0, plan.count_variants * sizeof(plan.variants[0]));
+
+    const char ** aliases = NULL;
+    arr_init(aliases);
+    uint32_t * alias_hashes = NULL;
+    arr_init(alias_hashes);
+    CityLoadStep * steps = NULL;
+    arr_init(steps);
+
+    for (uint32_t variant_i=0; variant_i < plan.count_variants; variant_i++) {
+        CityLoadVariant * variant = &plan.variants[variant_i];
+        arr_len(steps) = 0;
+
+        uint32_t iter_start, iter_end;
+        if (s_type->category == INTRO_UNION) {
+            iter_start = variant_i;
+            iter_end = variant_i + 1;
+        } else {
+            iter_start = 0;
+            iter_end = s_type->count;
+        }
+
+        for (uint32_t dm_i=0; dm_i < d_type->count; dm_i++) {
+            const IntroMember * dm = &d_type->u.members[dm_i];
+
+            arr_len(aliases) = 0;
+            arr_len(alias_hashes) = 0;
+            if (dm->name) {
+                arr_append(aliases, dm->name);
+                arr_append(alias_hashes, intro_member_name_hash(dm));
+            }
+            IntroVariant var;
+            if (intro_attribute_value_x(ctx, NULL, dm->attr, ctx->attr.builtin.alias, &var)) {
+                char * alias = (char *)var.data;
+                arr_append(aliases, alias);
+                arr_append(alias_hashes, intro_name_hash(alias));
+            }
+
+            bool found_match = false;
+            for (uint32_t j = iter_start; j < iter_end; j++) {
+                const IntroMember * sm = &s_type->u.members[j];
+
+                bool match = false;
+                if (sm->name) {
+                    // names are compared only when the hashes match
+                    uint32_t sm_hash = intro_member_name_hash(sm);
+                    for (size_t alias_i=0; alias_i < arr_len(aliases); alias_i++) {
+                        if (alias_hashes[alias_i] == sm_hash && strcmp(aliases[alias_i], sm->name) == 0) {
+                            match = true;
+                            break;
+                        }
+                    }
+                } else {
+                    int32_t sm_id = (int32_t)sm->attr.offset;
+                    int32_t dm_id;
+                    if (intro_attribute_int_x(ctx, dm->attr, ctx->attr.builtin.id, &dm_id) && dm_id == sm_id) {
+                        match = true;
+                    }
+                }
+                if (match) {
+                    found_match = true;
+                    if (dm->type->category != sm->type->category) {
+                        char from [128];
+                        char to [128];
+                        char msg [512];
+                        intro_sprint_type_name(from, sm->type);
+                        intro_sprint_type_name(to,   dm->type);
+                        int len = snprintf(msg, sizeof(msg), "type mismatch. from: %s to: %s", from, to);
+                        char * error = (char *)arena_alloc(city->arena, len + 1);
+                        memcpy(error, msg, len + 1);
+                        variant->error = error;
+                        break;
+                    }
+
+                    CityLoadStep step;
+                    step.d_index = dm_i;
+                    step.d_offset = dm->offset;
+                    step.s_offset = sm->offset;
+                    step.copy_size = 0;
+                    step.s_type = sm->type;
+                    if (city__layout_identical(city, sm->type, dm->type)) {
+                        step.copy_size = dm->type->size;
+
+                        // merge with the previous copy if both sides are contiguous
+                        CityLoadStep * last = (arr_len(steps) > 0)? &steps[arr_len(steps) - 1] : NULL;
+                        if (
+                            last && last->copy_size
+                         && last->s_offset + last->copy_size == step.s_offset
+                         && last->d_offset + last->copy_size == step.d_offset
+                           )
+                        {
+                            last->copy_size += step.copy_size;
+                            break;
+                        }
+                    }
+                    arr_append(steps, step);
+                    break;
+                }
+            }
+            if (variant->error) break;
+            if (found_match) {
+                if (d_type->category == INTRO_UNION) break;
+            } else {
+                CityLoadStep step;
+                memset(&step, 0, sizeof(step));
+                step.d_index = dm_i;
+                arr_append(steps, step);
+            }
+        }
+
+        variant->count_steps = arr_len(steps);
+        variant->steps = (CityLoadStep *)arena_alloc(city->arena, arr_len(steps) * sizeof(steps[0]));
+        memcpy(variant->steps, steps, arr_len(steps) * sizeof(steps[0]));
+    }
+
+    arr_free(aliases);
+    arr_free(alias_hashes);
+    arr_free(steps);
+
+    plan.copy_only = plan.count_variants == 1 && !plan.variants[0].error;
+    for (uint32_t step_i=0; plan.copy_only && step_i < plan.variants[0].count_steps; step_i++) {
+        if (plan.variants[0].steps[step_i].copy_size == 0) plan.copy_only = false;
+    }
+    plan.is_identical = plan.copy_only
+                     && s_type->category == INTRO_STRUCT && d_type->category == INTRO_STRUCT
+                     && s_type->size == d_type->size
+                     && plan.variants[0].count_steps == 1
+                     && plan.variants[0].steps[0].s_offset == 0
+                     && plan.variants[0].steps[0].d_offset == 0
+                     && plan.variants[0].steps[0].copy_size == d_type->size;
+
+    entry.value = arr_len(city->plans);
+    arr_append(city->plans, plan);
+    table_set(city->plan_set, entry);
+
+    return plan;
+}
+
+static int city__load_into(CityContext * city, IntroContainer d_cont, void * restrict src, const IntroType * restrict s_type);
+
+// What a lazy pointer will be loaded from. Pointers to these are stored with the low bit set.
+typedef struct {
+    const u8 * src;
+    const IntroType * s_elem; // NULL when the file has the destination's types
+    const IntroType * d_ptr_type;
+    uint32_t length;
+} CityLazyPointer;
+
+static void *
+city__alloc(CityContext * city, size_t size) {
+    const IntroLoadOptions * opt = city->load_opt;
+    if (opt && opt->arena) return arena_alloc(opt->arena, size);
+    if (opt && opt->alloc) {
+#if INTRO_HAVE_THREADS
+        if (city->alloc_lock) {
+            pthread_mutex_lock(city->alloc_lock);
+            void * result = opt->alloc(opt->alloc_user, size);
+            pthread_mutex_unlock(city->alloc_lock);
+            return result;
+        }
+#endif
+        return opt->alloc(opt->alloc_user, size);
+    }
+    return malloc(size);
+}
+
+typedef struct {
+    u8 * dest;
+    const u8 * src;
+    size_t d_stride;
+    size_t s_stride;
+    const CityLoadStep * steps; // copies for each element, or none to copy everything
+    uint32_t count_steps;
+} CityGatherJob;
+
+static void
+city__gather_range(void * user, int worker_i, size_t start, size_t end) {
+    const CityGatherJob * job = (const CityGatherJob *)user;
+    (void) worker_i;
+    if (job->count_steps == 0) {
+        memcpy(job->dest + start * job->d_stride, job->src + start * job->s_stride, (end - start) * job->d_stride);
+        return;
+    }
+    for (size_t i=start; i < end; i++) {
+        u8 * d_elem_data = job->dest + i * job->d_stride;
+        const u8 * s_elem_data = job->src + i * job->s_stride;
+        for (uint32_t step_i=0; step_i < job->count_steps; step_i++) {
+            const CityLoadStep * step = &job->steps[step_i];
+            memcpy(d_elem_data + step->d_offset, s_elem_data + step->s_offset, step->copy_size);
+        }
+    }
+}
+
+// Copies 'count' elements, split between threads if the load options ask for it.
+static void
+city__gather(CityContext * city, CityGatherJob * job, uint32_t count) {
+    int count_threads = (city->load_opt)? city->load_opt->count_threads : 1;
+    if (count_threads > 1 && !city->in_parallel && (size_t)count * job->d_stride >= CITY_PARALLEL_MIN_SIZE) {
+        city__run_parallel(count_threads, count, &city__gather_range, job);
+    } else {
+        city__gather_range(job, 0, 0, count);
+    }
+}
+
+// Validating loads give up past this many nested pointers, so cyclic data can't recurse forever.
+#define CITY_MAX_VALIDATE_DEPTH 1024
+// Shared buffers are loaded once per reference. Validating loads read at most this many times the data.
+#define CITY_VALIDATE_BUDGET 16
+
+// Checks that the buffer at 'offset' and its elements are inside the data section.
+static bool
+city__buffer_in_bounds(CityContext * city, uint64_t offset, size_t elem_size, uint32_t * o_length) {
+    if (offset < 4 || offset > city->data_size) return false;
+    memcpy(o_length, city->data + offset - 4, 4);
+    uint64_t available = city->data_size - offset;
+    return elem_size == 0 || *o_length <= available / elem_size;
+}
+
+static int city__load_same(CityContext * city, IntroContainer d_cont, const u8 * src);
+static int city__load_pointer(CityContext * city, IntroContainer d_cont, const u8 * src, const IntroType * s_elem);
+
+// Fills the plan and packed layout caches for everything loading 's_type' into 'd_type' can reach,
+// so workers only read them. 's_type' is NULL when the source has the destination's types.
+static void
+city__prepare_load(CityContext * city, const IntroType * s_type, const IntroType * d_type, HashTable * visited) {
+    const IntroType * key [2] = {s_type, d_type};
+    HashEntry entry;
+    entry.key_data = key;
+    entry.key_size = sizeof(key);
+    table_get(visited, &entry);
+    if (entry.value != TABLE_INVALID_VALUE) return;
+    entry.value = 1;
+    table_set(visited, entry);
+
+    if (!s_type) {
+        (void) city__packed_info(city, d_type);
+        switch(d_type->category) {
+        case INTRO_STRUCT:
+        case INTRO_UNION:
+            for (uint32_t m_index=0; m_index < d_type->count; m_index++) {
+                city__prepare_load(city, NULL, d_type->u.members[m_index].type, visited);
+            }
+            break;
+
+        case INTRO_ARRAY:
+        case INTRO_POINTER:
+            city__prepare_load(city, NULL, d_type->u.of, visited);
+            break;
+
+        default: break;
+        }
+        return;
+    }
+
+    switch(s_type->category) {
+    case INTRO_STRUCT:
+    case INTRO_UNION: {
+        CityLoadPlan plan = city__load_plan(city, s_type, d_type);
+        for (uint32_t variant_i=0; variant_i < plan.count_variants; variant_i++) {
+            const CityLoadVariant * variant = &plan.variants[variant_i];
+            for (uint32_t step_i=0; step_i < variant->count_steps; step_i++) {
+                const CityLoadStep * step = &variant->steps[step_i];
+                if (step->s_type && !step->copy_size) {
+                    city__prepare_load(city, step->s_type, d_type->u.members[step->d_index].type, visited);
+                }
+            }
+        }
+    }break;
+
+    case INTRO_ARRAY:
+    case INTRO_POINTER:
+        (void) city__layout_identical(city, s_type->u.of, d_type->u.of);
+        city__prepare_load(city, s_type->u.of, d_type->u.of, visited);
+        break;
+
+    default: break;
+    }
+}
+
+static int
+city__load_element_range(CityContext * city, IntroContainer d_cont, const u8 * src, const IntroType * s_elem, size_t s_stride, size_t start, size_t end) {
+    for (size_t i=start; i < end; i++) {
+        IntroContainer d_elem = intro_push(&d_cont, i);
+        const u8 * s_elem_data = src + i * s_stride;
+        int ret = (s_elem)? city__load_into(city, d_elem, (u8 *)s_elem_data, s_elem) : city__load_same(city, d_elem, s_elem_data);
+        if (ret < 0) return ret;
+    }
+    return 0;
+}
+
+#if INTRO_HAVE_THREADS
+typedef struct {
+    IntroContainer d_cont;
+    const u8 * src;
+    const IntroType * s_elem;
+    size_t s_stride;
+    CityContext workers [CITY_MAX_THREADS]; // copies of the context, with their own arenas
+    IntroLoadOptions worker_opts [CITY_MAX_THREADS];
+    int rets [CITY_MAX_THREADS];
+} CityLoadJob;
+
+static void
+city__load_worker_range(void * user, int worker_i, size_t start, size_t end) {
+    CityLoadJob * job = (CityLoadJob *)user;
+    if (job->rets[worker_i] < 0) return; // the load fails anyway
+    job->rets[worker_i] = city__load_element_range(&job->workers[worker_i], job->d_cont, job->src, job->s_elem, job->s_stride, start, end);
+}
+#endif
+
+// Loads 'count' elements one by one. Large ranges are split between threads if the load options ask
+// for it. Every cache the elements need is filled first and each worker allocates from its own arena.
+static int
+city__load_element_loop(CityContext * city, IntroContainer d_cont, const u8 * src, const IntroType * s_elem, size_t s_stride, uint32_t count) {
+#if INTRO_HAVE_THREADS
+    const IntroLoadOptions * opt = city->load_opt;
+    int count_threads = (opt)? opt->count_threads : 1;
+    if (count_threads > CITY_MAX_THREADS) count_threads = CITY_MAX_THREADS;
+    if (
+        count_threads > 1 && !city->in_parallel && count > CITY_PARALLEL_CHUNK
+     && (size_t)count * d_cont.type->u.of->size >= CITY_PARALLEL_MIN_SIZE
+       )
+    {
+        HashTable * visited = new_table(64);
+        city__prepare_load(city, s_elem, d_cont.type->u.of, visited);
+        free_table(visited);
+
+        CityLoadJob * job = (CityLoadJob *)calloc(1, sizeof(*job));
+        if (!job) {
+            city__error("out of memory.");
+            return -1;
+        }
+        job->d_cont = d_cont;
+        job->src = src;
+        job->s_elem = s_elem;
+        job->s_stride = s_stride;
+
+        pthread_mutex_t alloc_lock;
+        pthread_mutex_init(&alloc_lock, NULL);
+        for (int worker_i=0; worker_i < count_threads; worker_i++) {
+            CityContext * worker = &job->workers[worker_i];
+            *worker = *city;
+            worker->in_parallel = true;
+            worker->alloc_lock = &alloc_lock;
+            worker->arena = new_arena(4096);
+            job->worker_opts[worker_i] = *opt;
+            if (opt->arena) job->worker_opts[worker_i].arena = new_arena(4096);
+            worker->load_opt = &job->worker_opts[worker_i];
+        }
+
+        city__run_parallel(count_threads, count, &city__load_worker_range, job);
+
+        // what the workers allocated is kept until the arenas it belongs with are freed
+        int ret = 0;
+        bool adopted = true;
+        uint64_t used_budget = 0;
+        for (int worker_i=0; worker_i < count_threads; worker_i++) {
+            CityContext * worker = &job->workers[worker_i];
+            if (job->rets[worker_i] < 0) ret = job->rets[worker_i];
+            used_budget += city->load_budget - worker->load_budget;
+            adopted = arena_adopt(city->arena, worker->arena) && adopted;
+            if (opt->arena) adopted = arena_adopt(opt->arena, job->worker_opts[worker_i].arena) && adopted;
+        }
+        pthread_mutex_destroy(&alloc_lock);
+        free(job);
+
+        if (!adopted) {
+            city__error("out of memory.");
+            return -1;
+        }
+        if (ret == 0 && city->validate) {
+            // each worker had the whole budget, together they must not exceed it either
+            if (used_budget > city->load_budget) {
+                city__error("data references too much data.");
+                return -1;
+            }
+            city->load_budget -= used_budget;
+        }
+        return ret;
+    }
+#endif
+    return city__load_element_range(city, d_cont, src, s_elem, s_stride, 0, count);
+}
+
+// Loads 'count' consecutive source elements into the elements of 'd_cont' (an array or pointer).
+// If 's_elem' is NULL the source has the same type as the destination.
+static int
+city__load_elements(CityContext * city, IntroContainer d_cont, u8 * dest, const u8 * src, const IntroType * s_elem, uint32_t count) {
+    const IntroType * d_elem = d_cont.type->u.of;
+
+    CityGatherJob job;
+    job.dest = dest;
+    job.src = src;
+    job.d_stride = d_elem->size;
+    job.steps = NULL;
+    job.count_steps = 0;
+
+    CityLoadStep * member_steps = NULL;
+    if (!s_elem) {
+        CityPackedInfo info = city__packed_info(city, d_elem);
+        job.s_stride = info.size;
+        if (info.is_flat) {
+            city__gather(city, &job, count);
+            return 0;
+        }
+        bool members_flat = d_elem->category == INTRO_STRUCT;
+        for (uint32_t m_index=0; members_flat && m_index < d_elem->count; m_index++) {
+            members_flat = city__packed_info(city, d_elem->u.members[m_index].type).is_flat;
+        }
+        if (members_flat) {
+            // only padding differs, gather the members of each element
+            arr_init(member_steps);
+            for (uint32_t m_index=0; m_index < d_elem->count; m_index++) {
+                const IntroMember * m = &d_elem->u.members[m_index];
+                CityLoadStep step;
+                memset(&step, 0, sizeof(step));
+                step.d_offset = m->offset;
+                step.s_offset = info.member_offsets[m_index];
+                step.copy_size = m->type->size;
+                arr_append(member_steps, step);
+            }
+            job.steps = member_steps;
+            job.count_steps = arr_len(member_steps);
+            city__gather(city, &job, count);
+            arr_free(member_steps);
+            return 0;
+        }
+        return city__load_element_loop(city, d_cont, src, NULL, info.size, count);
+    }
+
+    job.s_stride = s_elem->size;
+    if (city__layout_identical(city, s_elem, d_elem)) {
+        city__gather(city, &job, count);
+        return 0;
+    }
+
+    if (s_elem->category == INTRO_STRUCT && d_elem->category == INTRO_STRUCT) {
+        CityLoadPlan plan = city__load_plan(city, s_elem, d_elem);
+        if (plan.copy_only) {
+            // gather each element's runs, no recursion needed
+            job.steps = plan.variants[0].steps;
+            job.count_steps = plan.variants[0].count_steps;
+            city__gather(city, &job, count);
+            return 0;
+        }
+    }
+
+    return city__load_element_loop(city, d_cont, src, s_elem, s_elem->size, count);
+}
+
+static int
+city__load_pointer(CityContext * city, IntroContainer d_cont, const u8 * src, const IntroType * s_elem) {
+    IntroContext * ctx = city->ictx;
+    const IntroType * d_type = d_cont.type;
+    u8 * dest = d_cont.data;
+
+    const u8 * b = src;
+    uintptr_t offset = next_uint(&b, city->ptr_size);
+    if (offset == 0) {
+        intro_set_value_x(ctx, d_cont, ctx->attr.builtin.fallback);
+        return 0;
+    }
+
+    uint32_t length = 1;
+    if (city->validate) {
+        size_t elem_size = (s_elem)? s_elem->size : city__packed_info(city, d_type->u.of).size;
+        if (!city__buffer_in_bounds(city, offset, elem_size, &length)) {
+            city__error("malformed");
+            return -1;
+        }
+        uint64_t buffer_size = (uint64_t)length * elem_size;
+        if (buffer_size > city->load_budget || city->depth >= CITY_MAX_VALIDATE_DEPTH) {
+            city__error("data references too much data.");
+            return -1;
+        }
+        city->load_budget -= buffer_size;
+    } else {
+        memcpy(&length, city->data + offset - 4, 4); // TODO: remove
+    }
+
+    u8 * src_ptr = city->data + offset;
+
+    if (city->load_opt && city->load_opt->lazy) {
+        CityLazyPointer * lazy = (CityLazyPointer *)arena_alloc(city->arena, sizeof(*lazy));
+        if (!lazy) {
+            city__error("out of memory.");
+            return -1;
+        }
+        lazy->src = src_ptr;
+        lazy->s_elem = s_elem;
+        lazy->d_ptr_type = d_type;
+        lazy->length = length;
+        uintptr_t handle = (uintptr_t)lazy | 1;
+        memcpy(dest, &handle, sizeof(void *));
+        return 0;
+    }
+
+    u8 * dest_ptr = (u8 *)city__alloc(city, (size_t)d_type->u.of->size * length);
+    memcpy(dest, &dest_ptr, sizeof(void *));
+    if (!dest_ptr) {
+        city__error("out of memory.");
+        return -1;
+    }
+
+    city->depth++;
+    int ret = city__load_elements(city, d_cont, dest_ptr, src_ptr, s_elem, length);
+    city->depth--;
+    return ret;
+}
+
+// Loads data that was saved with the destination's types, without the file's type info.
+static int
+city__load_same(CityContext * city, IntroContainer d_cont, const u8 * src) {
+    IntroContext * ctx = city->ictx;
+    const IntroType * type = d_cont.type;
+
+    switch(type->category) {
+    case INTRO_STRUCT: {
+        CityPackedInfo info = city__packed_info(city, type);
+        if (info.is_flat) {
+            memcpy(d_cont.data, src, type->size);
+            return 0;
+        }
+        for (uint32_t m_index=0; m_index < type->count; m_index++) {
+            int ret = city__load_same(city, intro_push(&d_cont, m_index), src + info.member_offsets[m_index]);
+            if (ret < 0) return ret;
+        }
+    }break;
+
+    case INTRO_UNION: {
+        uint16_t selection;
+        memcpy(&selection, src, 2);
+        if (selection >= type->count) {
+            city__error("malformed");
+            return -1;
+        }
+        // same as loading through a plan: members before the selection get their fallback
+        for (uint32_t m_index=0; m_index < selection; m_index++) {
+            intro_set_value_x(ctx, intro_push(&d_cont, m_index), ctx->attr.builtin.fallback);
+        }
+        return city__load_same(city, intro_push(&d_cont, selection), src + 2);
+    }
+
+    case INTRO_POINTER:
+        return city__load_pointer(city, d_cont, src, NULL);
+
+    case INTRO_ARRAY:
+        return city__load_elements(city, d_cont, d_cont.data, src, NULL, type->count);
+
+    default: {
+        memcpy(d_cont.data, src, type->size);
+    }break;
+    }
+
+    return 0;
+}
+
+static int
+city__load_into(
+    CityContext * city,
+    IntroContainer d_cont,
+    void * restrict src,
+    const IntroType * restrict s_type
+) {
+    IntroContext * ctx = city->ictx;
+    const IntroType * d_type = d_cont.type;
+    u8 * dest = d_cont.data;
+
+    uint16_t union_selection = 0;
+    if (s_type->category == INTRO_UNION) {
+        memcpy(&union_selection, src, 2);
+        src = (u8 *)src + 2;
+    }
+
+    switch(s_type->category) {
+    case INTRO_UNION:
+    case INTRO_STRUCT: {
+        CityLoadPlan plan = city__load_plan(city, s_type, d_type);
+        uint32_t variant_i = (s_type->category == INTRO_UNION)? union_selection : 0;
+        if (variant_i >= plan.count_variants) {
+            city__error("malformed");
+            return -1;
+        }
+
+        const CityLoadVariant * variant = &plan.variants[variant_i];
+        if (variant->error) {
+            city__error(variant->error);
+            return -1;
+        }
+
+        for (uint32_t step_i=0; step_i < variant->count_steps; step_i++) {
+            CityLoadStep step = variant->steps[step_i];
+            if (step.copy_size) {
+                memcpy(dest + step.d_offset, (u8 *)src + step.s_offset, step.copy_size);
+                continue;
+            }
+            IntroContainer d_member = intro_push(&d_cont, step.d_index);
+            if (step.s_type) {
+                int ret = city__load_into(city, d_member, (u8 *)src + step.s_offset, step.s_type);
+                if (ret < 0) return ret;
+            } else {
+                intro_set_value_x(ctx, d_member, ctx->attr.builtin.fallback);
+            }
+        }
+    }break;
+
+    case INTRO_POINTER: {
+        int ret = city__load_pointer(city, d_cont, (u8 *)src, s_type->u.of);
+        if (ret < 0) return ret;
+    }break;
+
+    case INTRO_ARRAY: {
+        int ret = city__load_elements(city, d_cont, dest, (u8 *)src, s_type->u.of, s_type->count);
+        if (ret < 0) return ret;
+    }break;
+
+    default: {
+        memcpy(dest, src, d_type->size);
+    }break;
+    }
+
+    return 0;
+}
+
+// Checks the header and sets up the sizes and data. Returns the schema hash of the file, or 0 if it has none.
+static bool
+city__read_header(CityContext * city, void * data, size_t data_size, uint64_t * o_schema_hash) {
+    const CityHeader * header = (const CityHeader *)data;
+    
+    if (
+        data_size < offsetof(CityHeader, schema_hash)
+     || memcmp(header->magic_number, "ICTY", 4) != 0
+     || data_size < city__header_size(header)
+    ) {
+        city__error("invalid CTY file");
+        return false;
+    }
+
+    if (header->version_major != implementation_version_major) {
+        city__error("unsupported CTY version.");
+        return false;
+    }
+
+    if (header->version_minor > implementation_version_minor) {
+        city__error("warning: some features will be unsupported.");
+    }
+
+    city->type_size = 1 + ((header->size_info >> 4) & 0x0f);
+    city->ptr_size  = 1 + ((header->size_info) & 0x0f);
+    city->native = (header->flags & CITY_FLAG_NATIVE) != 0;
+    city->name_hashes = header->version_minor >= 6;
+
+    if (
+        city->type_size > 4 || city->ptr_size > 8
+     || header->data_ptr < city__header_size(header) || header->data_ptr > data_size
+       )
+    {
+        city__error("invalid CTY file");
+        return false;
+    }
+
+    city->data = (uint8_t *)data + header->data_ptr;
+    city->data_size = data_size - header->data_ptr;
+
+    *o_schema_hash = 0;
+    if (header->version_minor >= 5) memcpy(o_schema_hash, header->schema_hash, 8);
+    return true;
+}
+
+// Parses the type info into 'arena'. Returns the type of the root data or NULL.
+// Every read is bounds checked, type ids must refer to earlier types (except for pointers)
+// and member names must be terminated inside the data section.
+// If 'copy_names' is set, member names are copied into 'arena' instead of pointing to the data.
+// Pointers in the data the types describe are 'data_ptr_size' wide. That is city->ptr_size, except
+// when the types are read from a schema for a file with shared types.
+static const IntroType *
+city__read_types(CityContext * city, void * data, size_t data_size, MemArena * arena, bool copy_names, uint8_t data_ptr_size) {
+    const CityHeader * header = (const CityHeader *)data;
+    const uint8_t * b = (u8 *)data + city__header_size(header);
+    const uint8_t * end = (u8 *)data + header->data_ptr;
+    (void) data_size;
+
+    uint64_t id_test_bit = (uint64_t)1 << (city->ptr_size * 8 - 1);
+    size_t member_info_size = city->type_size + city->ptr_size + ((city->native)? city->ptr_size : 0);
+
+    typedef struct {
+        IntroType * type;
+        uint32_t of_id;
+    } TypePtrOf;
+    TypePtrOf * deferred_pointer_ofs = NULL;
+    arr_init(deferred_pointer_ofs);
+
+    IntroType ** info_by_id;
+    arr_init(info_by_id);
+
+    bool ok = header->count_types > 0;
+    for (uint32_t i=0; i < header->count_types && ok; i++) {
+        IntroType * type = (IntroType *)arena_alloc(arena, sizeof(*type));
+        memset(type, 0, sizeof(*type));
+
+        if (b >= end) {
+            ok = false;
+            break;
+        }
+        type->category = next_uint(&b, 1);
+        uint32_t count_defined = arr_len(info_by_id);
+
+        switch(type->category) {
+        case INTRO_STRUCT:
+        case INTRO_UNION: {
+            if ((size_t)(end - b) < city->ptr_size * ((city->native)? 2 : 1)) {
+                ok = false;
+                break;
+            }
+            uint64_t count = next_uint(&b, city->ptr_size);
+            uint64_t native_size = (city->native)? next_uint(&b, city->ptr_size) : 0;
+
+            if (count > (size_t)(end - b) / member_info_size || native_size > UINT32_MAX) {
+                ok = false;
+                break;
+            }
+            type->count = count;
+
+            IntroMember * members = (IntroMember *)arena_alloc(arena, type->count * sizeof(members[0]));
+            uint64_t current_offset = 0, size = 0;
+            for (uint32_t m=0; m < type->count; m++) {
+                IntroMember member;
+                memset(&member, 0, sizeof(member));
+
+                uint32_t type_id = next_uint(&b, city->type_size);
+                if (type_id >= count_defined) {
+                    ok = false;
+                    break;
+                }
+                member.type   = info_by_id[type_id];
+                member.offset = current_offset;
+                if (type->category == INTRO_UNION) {
+                    if (member.type->size > size) {
+                        size = member.type->size;
+                    }
+                } else {
+                    current_offset += member.type->size;
+                    size = current_offset;
+                }
+
+                uint64_t next = next_uint(&b, city->ptr_size);
+                if ((next & id_test_bit)) {
+                    member.attr.offset = (uint32_t)(next & (~id_test_bit)); // store id directly in attr since that isn't being used for anything else
+                } else if (next < city->data_size && memchr(city->data + next, 0, city->data_size - next)) {
+                    member.name = (char *)(city->data + next);
+                    if (copy_names) {
+                        size_t name_size = strlen(member.name) + 1;
+                        char * name = (char *)arena_alloc(arena, name_size);
+                        memcpy(name, member.name, name_size);
+                        member.name = name;
+                    }
+                    if (!city->name_hashes) {
+                        member.name_hash = intro_name_hash(member.name);
+                    } else if ((size_t)(end - b) >= 4) {
+                        member.name_hash = next_uint(&b, 4);
+                        // the hash is trusted when matching members, so a bad one would pick the wrong member
+                        if (city->validate && member.name_hash != intro_name_hash(member.name)) {
+                            ok = false;
+                            break;
+                        }
+                    } else {
+                        ok = false;
+                        break;
+                    }
+                } else {
+                    ok = false;
+                    break;
+                }
+
+                if (city->native) {
+                    uint64_t offset = next_uint(&b, city->ptr_size);
+                    if (offset + member.type->size > native_size) {
+                        ok = false;
+                        break;
+                    }
+                    member.offset = offset;
+                }
+
+                members[m] = member;
+            }
+            type->u.members = members;
+            if (city->native) {
+                size = native_size;
+            } else if (type->category == INTRO_UNION) {
+                size += 2;
+            }
+            if (size > UINT32_MAX) ok = false;
+            type->size = size;
+        }break;
+
+        case INTRO_POINTER: {
+            if ((size_t)(end - b) < city->type_size) {
+                ok = false;
+                break;
+            }
+            uint32_t of_id = next_uint(&b, city->type_size);
+            if (of_id >= header->count_types) {
+                ok = false;
+                break;
+            }
+
+            TypePtrOf ptrof;
+            ptrof.type = type;
+            ptrof.of_id = of_id;
+
+            arr_append(deferred_pointer_ofs, ptrof);
+
+            type->size = data_ptr_size;
+        }break;
+
+        case INTRO_ARRAY: {
+            if ((size_t)(end - b) < (size_t)city->type_size + city->ptr_size) {
+                ok = false;
+                break;
+            }
+            uint32_t elem_id = next_uint(&b, city->type_size);
+            uint64_t count = next_uint(&b, city->ptr_size);
+            if (elem_id >= count_defined || count > UINT32_MAX) {
+                ok = false;
+                break;
+            }
+
+            IntroType * elem_type = info_by_id[elem_id];
+            if (elem_type->size > 0 && count > UINT32_MAX / elem_type->size) {
+                ok = false;
+                break;
+            }
+            type->u.of = elem_type;
+            type->count = count;
+            type->size = elem_type->size * count;
+        }break;
+
+        case INTRO_ENUM: {
+            if (b >= end) {
+                ok = false;
+                break;
+            }
+            uint32_t size = next_uint(&b, 1);
+
+            type->size = size;
+        }break;
+
+        default: break;
+        }
+        if (type->size == 0) {
+            switch(type->category) {
+            case INTRO_U8: case INTRO_S8:                   type->size = 1; break;
+            case INTRO_U16: case INTRO_S16:                 type->size = 2; break;
+            case INTRO_U32: case INTRO_S32: case INTRO_F32: type->size = 4; break;
+            case INTRO_U64: case INTRO_S64: case INTRO_F64: type->size = 8; break;
+            case INTRO_F128: type->size = 16; break;
+            }
+        }
+        arr_append(info_by_id, type);
+    }
+
+    const IntroType * s_type = NULL;
+    if (ok) {
+        for (size_t i=0; i < arr_len(deferred_pointer_ofs); i++) {
+            TypePtrOf ptrof = deferred_pointer_ofs[i];
+            ptrof.type->u.of = info_by_id[ptrof.of_id];
+        }
+        s_type = info_by_id[arr_len(info_by_id) - 1];
+    } else {
+        city__error("malformed");
+    }
+    arr_free(deferred_pointer_ofs);
+    arr_free(info_by_id);
+
+    return s_type;
+}
+
+int
+intro_load_city_x(IntroContext * ctx, void * dest, const IntroType * d_type, void * data, size_t data_size) {
+    return intro_load_city_opt_x(ctx, dest, d_type, data, data_size, NULL);
+}
+
+// Pointer types, and so the offsets of packed members, depend on the pointer width of the file
+// the data is in. Other widths only change how the type info is read, not the types.
+typedef struct {
+    uint64_t schema_hash;
+    uint64_t ptr_size;
+} CitySchemaKey;
+
+typedef struct {
+    void * data; // copy of the registered file
+    size_t size;
+} CitySchemaSource;
+
+typedef struct {
+    HashTable * index; // CitySchemaKey -> index in 'types'
+    const IntroType ** types;
+    HashTable * source_index; // schema hash -> index in 'sources'
+    CitySchemaSource * sources; // registered schemas, read again for files with other pointer widths
+    MemArena * arena;
+#if INTRO_HAVE_THREADS
+    pthread_mutex_t lock;
+#endif
+} CitySchemaCache;
+
+static CitySchemaCache city__schema_cache = {
+    NULL, NULL, NULL, NULL, NULL,
+#if INTRO_HAVE_THREADS
+    PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+
+static void
+city__lock_schemas(bool lock) {
+#if INTRO_HAVE_THREADS
+    if (lock) {
+        pthread_mutex_lock(&city__schema_cache.lock);
+    } else {
+        pthread_mutex_unlock(&city__schema_cache.lock);
+    }
+#else
+    (void) lock;
+#endif
+}
+
+// The lock must be held.
+static void
+city__init_schema_cache(CitySchemaCache * cache) {
+    if (!cache->index) {
+        cache->index = new_table(64);
+        arr_init(cache->types);
+        cache->source_index = new_table(16);
+        arr_init(cache->sources);
+        cache->arena = new_arena(4096);
+    }
+}
+
+// Returns the types of the registered schema 'schema_hash' for data with pointers city->ptr_size wide,
+// or NULL if no such schema is registered. The header hash of a file is not trusted to describe
+// its type info, so only registered schemas are cached, read once for every pointer width they are used with.
+static const IntroType *
+city__cached_types(CityContext * city, uint64_t schema_hash) {
+    CitySchemaCache * cache = &city__schema_cache;
+    city__lock_schemas(true);
+    city__init_schema_cache(cache);
+
+    CitySchemaKey key;
+    memset(&key, 0, sizeof(key));
+    key.schema_hash = schema_hash;
+    key.ptr_size = city->ptr_size;
+
+    HashEntry entry;
+    entry.key_data = &key;
+    entry.key_size = sizeof(key);
+    table_get(cache->index, &entry);
+
+    const IntroType * type = NULL;
+    if (entry.value != TABLE_INVALID_VALUE) {
+        type = cache->types[entry.value];
+    } else {
+        HashEntry s_entry;
+        s_entry.key_data = &schema_hash;
+        s_entry.key_size = sizeof(schema_hash);
+        table_get(cache->source_index, &s_entry);
+        if (s_entry.value != TABLE_INVALID_VALUE) {
+            // the type info is read with the widths of the schema, names are copied
+            CitySchemaSource source = cache->sources[s_entry.value];
+            CityContext schema_city;
+            memset(&schema_city, 0, sizeof(schema_city));
+            schema_city.ictx = city->ictx;
+            schema_city.validate = true;
+            uint64_t source_hash;
+            if (city__read_header(&schema_city, source.data, source.size, &source_hash)) {
+                type = city__read_types(&schema_city, source.data, source.size, cache->arena, true, city->ptr_size);
+            }
+        }
+        if (type) {
+            entry.value = arr_len(cache->types);
+            arr_append(cache->types, type);
+            table_set(cache->index, entry);
+        }
+    }
+    city__lock_schemas(false);
+    return type;
+}
+
+// Registers the types of a schema, or any city file, for files with the same schema hash. Returns false
+// if they can't be read. The file is copied, so it doesn't need to outlive the registration.
+bool
+intro_city_register_schema_x(IntroContext * ctx, void * data, size_t data_size) {
+    CityContext city;
+    memset(&city, 0, sizeof(city));
+    city.ictx = ctx;
+    uint64_t schema_hash;
+    if (!city__read_header(&city, data, data_size, &schema_hash)) return false;
+
+    const CityHeader * header = (const CityHeader *)data;
+    if (schema_hash == 0 || city.native || (header->flags & (CITY_FLAG_COMPRESSED | CITY_FLAG_SHARED_TYPES))) {
+        city__error("CTY file has no schema that can be shared.");
+        return false;
+    }
+
+    // nothing is cached unless the whole type info is valid
+    city.validate = true;
+    MemArena * check_arena = new_arena(4096);
+    bool ok = city__read_types(&city, data, data_size, check_arena, false, city.ptr_size) != NULL;
+    free_arena(check_arena);
+    if (!ok) return false;
+
+    CitySchemaCache * cache = &city__schema_cache;
+    city__lock_schemas(true);
+    city__init_schema_cache(cache);
+    HashEntry entry;
+    entry.key_data = &schema_hash;
+    entry.key_size = sizeof(schema_hash);
+    table_get(cache->source_index, &entry);
+    if (entry.value == TABLE_INVALID_VALUE) {
+        CitySchemaSource source;
+        source.data = malloc(data_size);
+        source.size = data_size;
+        memcpy(source.data, data, data_size);
+        entry.value = arr_len(cache->sources);
+        arr_append(cache->sources, source);
+        table_set(cache->source_index, entry);
+    }
+    city__lock_schemas(false);
+    return true;
+}
+
+// Frees every cached schema. Types from the cache must no longer be used by open cities.
+void
+intro_city_clear_schema_cache(void) {
+    CitySchemaCache * cache = &city__schema_cache;
+    city__lock_schemas(true);
+    if (cache->index) {
+        free_table(cache->index);
+        arr_free(cache->types);
+        free_table(cache->source_index);
+        for (uint32_t i=0; i < arr_len(cache->sources); i++) {
+            free(cache->sources[i].data);
+        }
+        arr_free(cache->sources);
+        free_arena(cache->arena);
+        cache->types = NULL;
+        cache->sources = NULL;
+        cache->arena = NULL;
+    }
+    city__lock_schemas(false);
+}
+
+struct IntroCity {
+    CityContext city;
+    void * raw;
+    size_t raw_size;
+    u8 * unpacked; // decompressed data section
+    uint64_t schema_hash;
+    const IntroType * s_type; // the file's type info is only read when it is needed
+    u8 * section; // the whole data section, city.data only points to the current record of a log
+    size_t section_size;
+    size_t log_next; // offset of the next record in a log, 0 if the file isn't a log
+    size_t log_first;
+    // found on first use by intro_city_count or intro_city_load_index
+    bool records_found;
+    uint64_t count_records;
+    const u8 * records;         // arrays only: the first element
+    const IntroType * s_record; // arrays only
+    uint64_t * log_index;       // logs only: data offset of every log_index_stride-th record
+    uint32_t log_index_stride;
+    size_t log_end;             // logs only: data offset after the last record
+    IntroLoadOptions opt;
+    IntroCityMap map; // only when opened from a file
+};
+
+// Checks the header. 'data' must outlive the result.
+IntroCity *
+intro_city_open_x(IntroContext * ctx, void * data, size_t data_size, const IntroLoadOptions * opt) {
+    IntroCity * result = (IntroCity *)calloc(1, sizeof(*result));
+    CityContext * city = &result->city;
+    city->ictx = ctx;
+    if (opt) {
+        result->opt = *opt;
+        city->load_opt = &result->opt;
+    }
+
+    if (!city__read_header(city, data, data_size, &result->schema_hash)) {
+        free(result);
+        return NULL;
+    }
+    result->raw = data;
+    result->raw_size = data_size;
+
+    const CityHeader * header = (const CityHeader *)data;
+    if (result->opt.validate) {
+        city->validate = true;
+        if ((header->flags & CITY_FLAG_CHECKSUM) && city__checksum(data, data_size) != header->checksum) {
+            city__error("checksum does not match.");
+            free(result);
+            return NULL;
+        }
+    }
+
+    if ((header->flags & CITY_FLAG_COMPRESSED)) {
+        result->unpacked = city__decompress(city->data, city->data_size, &city->data_size);
+        if (!result->unpacked) {
+            free(result);
+            return NULL;
+        }
+        city->data = result->unpacked;
+    }
+    result->section = city->data;
+    result->section_size = city->data_size;
+
+    if ((header->flags & CITY_FLAG_LOG)) {
+        uint32_t names_size = 0;
+        if (city->data_size >= 4) memcpy(&names_size, city->data, 4);
+        if (city->data_size < 4 || names_size > city->data_size - 4) {
+            city__error("invalid CTY file");
+            free(result->unpacked);
+            free(result);
+            return NULL;
+        }
+        result->log_next = 4 + names_size;
+        result->log_first = result->log_next;
+    }
+
+    city->arena = new_arena(4096);
+    city->plan_set = new_table(64);
+    arr_init(city->plans);
+    city->packed_set = new_table(64);
+    arr_init(city->packed);
+    return result;
+}
+
+static const IntroType *
+city__file_types(IntroCity * result) {
+    if (!result->s_type) {
+        // member names are found in the data section, not the current record
+        CityContext * city = &result->city;
+        u8 * data = city->data;
+        size_t data_size = city->data_size;
+        city->data = result->section;
+        city->data_size = result->section_size;
+        bool shared = (((const CityHeader *)result->raw)->flags & CITY_FLAG_SHARED_TYPES) != 0;
+        if (shared) {
+            result->s_type = city__cached_types(city, result->schema_hash);
+            if (!result->s_type) city__error("the schema of this CTY file is not registered.");
+        } else {
+            // a validating load reads the file's own type info instead of trusting its schema hash
+            if (result->schema_hash != 0 && !city->native && !city->validate) {
+                result->s_type = city__cached_types(city, result->schema_hash);
+            }
+            if (!result->s_type) {
+                result->s_type = city__read_types(city, result->raw, result->raw_size, city->arena, false, city->ptr_size);
+            }
+        }
+        city->data = data;
+        city->data_size = data_size;
+    }
+    return result->s_type;
+}
+
+static int
+city__load_root(IntroCity * result, void * dest, const IntroType * d_type) {
+    CityContext * city = &result->city;
+
+    // the file was written with these types, nothing needs to be matched
+    bool same = result->schema_hash != 0 && result->schema_hash == city__schema_hash(city->ictx, d_type);
+    const IntroType * s_type = NULL;
+    if (!same) {
+        s_type = city__file_types(result);
+        if (!s_type) return -1;
+    }
+
+    if (city->validate) {
+        uint64_t root_size = (same)? city__packed_info(city, d_type).size : s_type->size;
+        if (root_size > city->data_size) {
+            city__error("malformed");
+            return -1;
+        }
+        city->load_budget = CITY_VALIDATE_BUDGET * (uint64_t)city->data_size;
+        city->depth = 0;
+    }
+
+    if (same) return city__load_same(city, intro_cntr(dest, d_type), city->data);
+    return city__load_into(city, intro_cntr(dest, d_type), city->data, s_type);
+}
+
+int
+intro_city_load(IntroCity * result, void * dest, const IntroType * d_type) {
+    if (result->city.native) {
+        city__error("native CTY files can only be loaded in place.");
+        return -1;
+    }
+    if (result->log_next) {
+        city__error("CTY logs are loaded with intro_city_log_next.");
+        return -1;
+    }
+    if ((((const CityHeader *)result->raw)->flags & CITY_FLAG_SCHEMA)) {
+        city__error("CTY schema files have no data.");
+        return -1;
+    }
+    return city__load_root(result, dest, d_type);
+}
+
+// Loads the next record of a log into 'dest'. Returns 1 if a record was loaded, 0 at the end
+// of the log and -1 on error.
+int
+intro_city_log_next(IntroCity * result, void * dest, const IntroType * d_type) {
+    CityContext * city = &result->city;
+    if (!result->log_next) {
+        city__error("CTY file is not a log.");
+        return -1;
+    }
+    size_t remaining = result->section_size - result->log_next;
+    if (remaining == 0) return 0;
+
+    uint32_t record_size = 0;
+    if (remaining >= 4) memcpy(&record_size, result->section + result->log_next, 4);
+    if ((record_size & CITY_LOG_INDEX_MARK)) return 0;
+    if (remaining < 4 || record_size > remaining - 4) {
+        city__error("log record is truncated.");
+        return -1;
+    }
+    city->data = result->section + result->log_next + 4;
+    city->data_size = record_size;
+    result->log_next += 4 + record_size;
+
+    int ret = city__load_root(result, dest, d_type);
+    return (ret < 0)? ret : 1;
+}
+
+// Uses the index at the end of a log if it is intact, otherwise the records are scanned to build one.
+static bool
+city__read_log_index(IntroCity * result) {
+    const u8 * section = result->section;
+    size_t size = result->section_size;
+    size_t first = result->log_first;
+    arr_init(result->log_index);
+
+    uint32_t index_size = 0;
+    if (size - first >= 4) memcpy(&index_size, section + size - 4, 4);
+    if (index_size >= 16 && index_size % 8 == 0 && index_size <= size - first - 4) {
+        size_t start = size - 4 - index_size;
+        const u8 * b = section + start;
+        uint32_t mark = next_uint(&b, 4);
+        uint64_t count_entries = (index_size - 16) / 8;
+        const u8 * tail = section + size - 16;
+        uint64_t count_records = next_uint(&tail, 8);
+        uint32_t stride = next_uint(&tail, 4);
+
+        bool valid = mark == (CITY_LOG_INDEX_MARK | index_size) && stride > 0
+                  && count_entries == (count_records + stride - 1) / stride;
+        uint64_t last = 0;
+        for (uint64_t entry_i=0; entry_i < count_entries && valid; entry_i++) {
+            uint64_t offset = next_uint(&b, 8);
+            valid = offset >= first && offset < start && (entry_i == 0 || offset > last);
+            last = offset;
+            arr_append(result->log_index, offset);
+        }
+        if (valid) {
+            result->count_records = count_records;
+            result->log_index_stride = stride;
+            result->log_end = start;
+            return true;
+        }
+        arr_len(result->log_index) = 0;
+    }
+
+    // no index, e.g. the log was never closed
+    result->log_index_stride = CITY_LOG_INDEX_STRIDE;
+    size_t offset = first;
+    while (offset < size) {
+        uint32_t record_size = 0;
+        if (size - offset >= 4) memcpy(&record_size, section + offset, 4);
+        if ((record_size & CITY_LOG_INDEX_MARK)) break;
+        if (size - offset < 4 || record_size > size - offset - 4) {
+            city__error("log record is truncated.");
+            return false;
+        }
+        if (result->count_records % CITY_LOG_INDEX_STRIDE == 0) arr_append(result->log_index, offset);
+        result->count_records += 1;
+        offset += 4 + record_size;
+    }
+    result->log_end = offset;
+    return true;
+}
+
+// Arrays are the root or the first array or pointer member of a root struct.
+static bool
+city__find_records(IntroCity * result) {
+    if (result->records_found) return true;
+    CityContext * city = &result->city;
+
+    if (result->log_next) {
+        if (!city__read_log_index(result)) return false;
+        result->records_found = true;
+        return true;
+    }
+    if ((((const CityHeader *)result->raw)->flags & CITY_FLAG_SCHEMA)) {
+        city__error("CTY schema files have no data.");
+        return false;
+    }
+
+    const IntroType * s_type = city__file_types(result);
+    if (!s_type) return false;
+    if (s_type->size > city->data_size) {
+        city__error("malformed");
+        return false;
+    }
+    const u8 * src = city->data;
+    if (s_type->category == INTRO_STRUCT) {
+        const IntroMember * found = NULL;
+        for (uint32_t m_index=0; m_index < s_type->count && !found; m_index++) {
+            const IntroMember * sm = &s_type->u.members[m_index];
+            if (sm->type->category == INTRO_ARRAY || sm->type->category == INTRO_POINTER) found = sm;
+        }
+        if (found) {
+            src += found->offset;
+            s_type = found->type;
+        }
+    }
+
+    if (s_type->category == INTRO_ARRAY) {
+        result->count_records = s_type->count;
+        result->records = src;
+    } else if (s_type->category == INTRO_POINTER) {
+        uint64_t offset = next_uint(&src, city->ptr_size);
+        uint32_t length = 0;
+        if (offset != 0 && !city__buffer_in_bounds(city, offset, s_type->u.of->size, &length)) {
+            city__error("malformed");
+            return false;
+        }
+        result->count_records = length;
+        result->records = city->data + offset;
+    } else {
+        city__error("CTY data has no array of records.");
+        return false;
+    }
+    result->s_record = s_type->u.of;
+    result->records_found = true;
+    return true;
+}
+
+// Returns the number of records in a log, or of elements in the root array, or -1 on error.
+int64_t
+intro_city_count(IntroCity * result) {
+    if (!city__find_records(result)) return -1;
+    return result->count_records;
+}
+
+// Loads record 'index' of a log, or element 'index' of the root array, without reading the ones before it.
+int
+intro_city_load_index(IntroCity * result, uint64_t index, void * dest, const IntroType * d_type) {
+    CityContext * city = &result->city;
+    if (city->native) {
+        city__error("native CTY files can only be loaded in place.");
+        return -1;
+    }
+    if (!city__find_records(result)) return -1;
+    if (index >= result->count_records) {
+        city__error("record index out of bounds.");
+        return -1;
+    }
+
+    if (!result->log_next) {
+        const u8 * src = result->records + index * result->s_record->size;
+        if (city->validate) {
+            city->load_budget = CITY_VALIDATE_BUDGET * (uint64_t)city->data_size;
+            city->depth = 0;
+        }
+        return city__load_into(city, intro_cntr(dest, d_type), (void *)src, result->s_record);
+    }
+
+    // the index is sparse, skip the records after the closest entry
+    size_t offset = result->log_index[index / result->log_index_stride];
+    uint32_t record_size;
+    for (uint64_t skip = index % result->log_index_stride; ; skip--) {
+        record_size = 0;
+        if (result->log_end - offset >= 4) memcpy(&record_size, result->section + offset, 4);
+        if (result->log_end - offset < 4 || record_size > result->log_end - offset - 4) {
+            city__error("log record is truncated.");
+            return -1;
+        }
+        if (skip == 0) break;
+        offset += 4 + record_size;
+    }
+    city->data = result->section + offset + 4;
+    city->data_size = record_size;
+    return city__load_root(result, dest, d_type);
+}
+
+// Returns the value of the pointer at 'p_ptr', loading its data first if it is a lazy handle.
+// Lazy handles must be resolved before the city is closed.
+void *
+intro_city_resolve(IntroCity * result, void * p_ptr) {
+    CityContext * city = &result->city;
+    uintptr_t value;
+    memcpy(&value, p_ptr, sizeof(value));
+    if (!(value & 1)) return (void *)value;
+
+    const CityLazyPointer * lazy = (const CityLazyPointer *)(value & ~(uintptr_t)1);
+    const IntroType * d_elem = lazy->d_ptr_type->u.of;
+    u8 * dest_ptr = (u8 *)city__alloc(city, (size_t)d_elem->size * lazy->length);
+    memcpy(p_ptr, &dest_ptr, sizeof(void *));
+    if (!dest_ptr) {
+        city__error("out of memory.");
+        return NULL;
+    }
+
+    int ret = city__load_elements(city, intro_cntr(p_ptr, lazy->d_ptr_type), dest_ptr, lazy->src, lazy->s_elem, lazy->length);
+    if (ret < 0) {
+        memset(p_ptr, 0, sizeof(void *));
+        return NULL;
+    }
+    return dest_ptr;
+}
+
+void
+intro_city_close(IntroCity * result) {
+    CityContext * city = &result->city;
+    free_table(city->plan_set);
+    arr_free(city->plans);
+    free_table(city->packed_set);
+    arr_free(city->packed);
+    free_arena(city->arena);
+    free(result->unpacked);
+    if (result->log_index) arr_free(result->log_index);
+    intro_unmap_city_file(&result->map);
+    free(result);
+}
+
+static int
+city__path_error(const char * path, const char * msg) {
+    char buf [512];
+    snprintf(buf, sizeof(buf), "%s in path \"%s\"", msg, path);
+    city__error(buf);
+    return -1;
+}
+
+// Loads only the data at 'path', e.g. "entities[42].transform". Members are named, or '#N' for
+// members saved with id N. '[N]' indexes arrays and pointers, and a pointer followed by a member is the same as [0].
+// In a log, the path is found in the record last loaded by intro_city_log_next.
+int
+intro_city_load_at(IntroCity * result, const char * path, void * dest, const IntroType * d_type) {
+    CityContext * city = &result->city;
+    if (city->native) {
+        city__error("native CTY files can only be loaded in place.");
+        return -1;
+    }
+    if (result->log_next && city->data == result->section) {
+        city__error("no log record has been loaded.");
+        return -1;
+    }
+
+    const IntroType * s_type = city__file_types(result);
+    if (!s_type) return -1;
+    const u8 * src = city->data;
+    const char * p = path;
+
+    while (*p) {
+        uint64_t index = 0;
+        const char * name = NULL;
+        size_t name_len = 0;
+        if (*p == '[') {
+            char * end;
+            index = strtoull(p + 1, &end, 10);
+            if (end == p + 1 || *end != ']') return city__path_error(path, "bad index");
+            p = end + 1;
+        } else {
+            if (*p == '.') p++;
+            name = p;
+            while (*p && *p != '.' && *p != '[') p++;
+            name_len = p - name;
+            if (name_len == 0) return city__path_error(path, "missing member name");
+        }
+
+        if (s_type->category == INTRO_POINTER) {
+            const u8 * b = src;
+            uint64_t offset = next_uint(&b, city->ptr_size);
+            if (offset == 0) return city__path_error(path, "null pointer");
+            uint32_t length;
+            if (!city__buffer_in_bounds(city, offset, s_type->u.of->size, &length)) return city__path_error(path, "malformed");
+            if (index >= length) return city__path_error(path, "index out of bounds");
+            s_type = s_type->u.of;
+            src = city->data + offset + index * s_type->size;
+            if (!name) continue;
+        } else if (!name) {
+            if (s_type->category != INTRO_ARRAY) return city__path_error(path, "index of a type that isn't an array or pointer");
+            if (index >= s_type->count) return city__path_error(path, "index out of bounds");
+            s_type = s_type->u.of;
+            src += index * s_type->size;
+            continue;
+        }
 
-                    int ret = city__load_into(city,
-                        intro_push(&d_cont, dm_i),
-                        (u8 *)src + sm->offset, sm->type
-                    );
-                    if (ret < 0) return ret;
-                    if (d_type->category == INTRO_UNION) {
-                        return 0;
-                    } else {
-                        break;
-                    }
-                }
-            }
-            if (!found_match) {
-                intro_set_value_x(ctx, intro_push(&d_cont, dm_i), ctx->attr.builtin.fallback);
-            }
-            arr_header(aliases)->len = 0;
+        if (s_type->category != INTRO_STRUCT && s_type->category != INTRO_UNION) {
+            return city__path_error(path, "member of a type that isn't a struct or union");
+        }
+        uint32_t union_selection = 0;
+        if (s_type->category == INTRO_UNION) {
+            uint16_t selection;
+            memcpy(&selection, src, 2);
+            union_selection = selection;
+            src += 2;
         }
-        arr_free(aliases);
-    }break;
 
-    case INTRO_POINTER: {
-    #if 0 // TODO...
-        int32_t length_member_index;
-        if (intro_attribute_member_x(ctx, dm->attr, ctx->attr.builtin.length, &length_member_index)) {
-            const IntroMember * lm = &d_type->u.members[length_member_index];
-            size_t wr_size = lm->type->size;
-            if (wr_size > 4) wr_size = 4;
-            memcpy((u8 *)dest + lm->offset, &length, wr_size);
-            if ((uint32_t)length_member_index > dm_i) {
-                arr_append(skip_members, length_member_index);
-            }
-        }
-    #endif
-        const u8 * b = (u8 *)src;
-        uintptr_t offset = next_uint(&b, city->ptr_size);
-        if (offset != 0) {
-            uint32_t length = 1;
-            memcpy(&length, city->data + offset - 4, 4); // TODO: remove
-
-            u8 * src_ptr = city->data + offset;
-
-            u8 * dest_ptr = (u8 *)malloc(d_type->u.of->size * length); // TODO: track
-            memcpy(dest, &dest_ptr, sizeof(void *));
-
-            if (intro_is_scalar(d_type->u.of)) {
-                memcpy(dest_ptr, src_ptr, length * d_type->u.of->size);
+        bool by_id = (name[0] == '#');
+        uint32_t id = (by_id)? strtoul(name + 1, NULL, 10) : 0;
+
+        const IntroMember * found = NULL;
+        for (uint32_t m_index=0; m_index < s_type->count; m_index++) {
+            const IntroMember * sm = &s_type->u.members[m_index];
+            bool match;
+            if (by_id) {
+                match = !sm->name && sm->attr.offset == id;
             } else {
-                for (uint32_t i=0; i < length; i++) {
-                    city__load_into(city, intro_push(&d_cont, i), src_ptr + (i * s_type->u.of->size), s_type->u.of);
+                match = sm->name && strlen(sm->name) == name_len && 0==memcmp(sm->name, name, name_len);
+            }
+            if (match) {
+                if (s_type->category == INTRO_UNION && m_index != union_selection) {
+                    return city__path_error(path, "union member is not selected");
                 }
+                found = sm;
+                break;
             }
-        } else {
-            intro_set_value_x(ctx, d_cont, ctx->attr.builtin.fallback);
-        }
-    }break;
-
-    case INTRO_ARRAY: {
-        for (uint32_t i=0; i < s_type->count; i++) {
-            city__load_into(city, intro_push(&d_cont, i), (u8 *)src + (i * s_type->u.of->size), s_type->u.of);
         }
-    }break;
+        if (!found) return city__path_error(path, "no such member");
+        src += found->offset;
+        s_type = found->type;
+    }
 
-    default: {
-        memcpy(dest, src, d_type->size);
-    }break;
+    if (city->validate) {
+        if (s_type->size > city->data_size - (src - city->data)) return city__path_error(path, "malformed");
+        city->load_budget = CITY_VALIDATE_BUDGET * (uint64_t)city->data_size;
+        city->depth = 0;
     }
+    return city__load_into(city, intro_cntr(dest, d_type), (void *)src, s_type);
+}
 
-    return 0;
+int
+intro_city_load_path_x(IntroContext * ctx, void * data, size_t data_size, const char * path, void * dest, const IntroType * d_type) {
+    IntroCity * city = intro_city_open_x(ctx, data, data_size, NULL);
+    if (!city) return -1;
+
+    int result = intro_city_load_at(city, path, dest, d_type);
+    intro_city_close(city);
+
+    return result;
 }
 
 int
-intro_load_city_x(IntroContext * ctx, void * dest, const IntroType * d_type, void * data, size_t data_size) {
-    CityContext _city, * city = &_city;
-    memset(city, 0, sizeof(_city));
-    const CityHeader * header = (const CityHeader *)data;
-    city->ictx = ctx;
-    
-    if (
-        data_size < sizeof(*header)
-     || memcmp(header->magic_number, "ICTY", 4) != 0
-    ) {
-        city__error("invalid CTY file");
+intro_load_city_opt_x(IntroContext * ctx, void * dest, const IntroType * d_type, void * data, size_t data_size, const IntroLoadOptions * opt) {
+    if (opt && opt->lazy) {
+        city__error("lazy loading needs intro_city_open.");
         return -1;
     }
 
-    if (header->version_major != implementation_version_major) {
-        city__error("unsupported CTY version.");
-        return -1;
+    IntroCity * city = intro_city_open_x(ctx, data, data_size, opt);
+    if (!city) return -1;
+
+    int copy_result = intro_city_load(city, dest, d_type);
+    intro_city_close(city);
+
+    return copy_result;
+}
+
+// DELTA
+// A delta patches the City data of the base, as intro_create_city writes it, into the City data
+// of the new data, which is then loaded. Both are written by the same walk as any City file,
+// so members with ~city are ignored and buffers are found the same way.
+// After the 12 byte header comes a list of records: a zigzag varint the read position in the
+// base moves by, a varint count of bytes copied from there, and a varint count of bytes that
+// follow in the delta and are written next. Written bytes move the read position as if they
+// replaced as many bytes of the base. After the last record the rest of the base is copied.
+
+static const char CITY_DELTA_MAGIC [4] = {'I','C','T','D'};
+static const size_t CITY_DELTA_MIN_MATCH = 8; // shorter runs of equal bytes are written as they are
+
+typedef struct {
+    int64_t seek;
+    uint64_t copy;
+    size_t written_start; // range of the new data that is written
+    size_t written_end;
+} CityDeltaRecord;
+
+static void
+city__put_varint(u8 ** o_array, uint64_t value) {
+    while (value >= 0x80) {
+        arr_append(*o_array, (u8)(value | 0x80));
+        value >>= 7;
     }
+    arr_append(*o_array, (u8)value);
+}
 
-    if (header->version_minor > implementation_version_minor) {
-        city__error("warning: some features will be unsupported.");
+static bool
+city__read_varint(const u8 ** p_in, const u8 * in_end, uint64_t * o_value) {
+    uint64_t result = 0;
+    for (int shift=0; shift < 64; shift += 7) {
+        if (*p_in >= in_end) break;
+        u8 b = *(*p_in)++;
+        result |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *o_value = result;
+            return true;
+        }
     }
+    return false;
+}
 
-    city->type_size = 1 + ((header->size_info >> 4) & 0x0f);
-    city->ptr_size  = 1 + ((header->size_info) & 0x0f);
+static void
+city__delta_put_record(u8 ** o_out, CityDeltaRecord * rec, const u8 * new_data) {
+    city__put_varint(o_out, ((uint64_t)rec->seek << 1) ^ (uint64_t)(rec->seek >> 63));
+    city__put_varint(o_out, rec->copy);
+    city__put_varint(o_out, rec->written_end - rec->written_start);
+    arr_append_range(*o_out, new_data + rec->written_start, rec->written_end - rec->written_start);
+    memset(rec, 0, sizeof(*rec));
+}
 
-    city->data = (uint8_t *)data + header->data_ptr;
-    const uint8_t * b = (u8 *)data + sizeof(*header);
+static size_t
+city__common_length(const u8 * a, size_t a_size, const u8 * b, size_t b_size) {
+    size_t count = (a_size < b_size)? a_size : b_size;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        uint64_t a8, b8;
+        memcpy(&a8, a + i, 8);
+        memcpy(&b8, b + i, 8);
+        if (a8 != b8) break;
+    }
+    while (i < count && a[i] == b[i]) i++;
+    return i;
+}
 
-    size_t id_test_bit = 1 << (city->ptr_size * 8 - 1);
+static size_t
+city__delta_hash(const u8 * data, int bits) {
+    uint64_t value;
+    memcpy(&value, data, 8);
+    return (value * 0x9E3779B97F4A7C15ull) >> (64 - bits);
+}
 
-    typedef struct {
-        IntroType * type;
-        uint32_t of_id;
-    } TypePtrOf;
-    TypePtrOf * deferred_pointer_ofs = NULL;
-    arr_init(deferred_pointer_ofs);
+// Creates a delta that turns 'base' into 'new_data'. Both have the type 'type'.
+void *
+intro_city_diff_x(IntroContext * ctx, const void * base, const void * new_data, const IntroType * type, size_t * o_size) {
+    size_t base_size, next_size;
+    u8 * a = (u8 *)intro_create_city_x(ctx, base, type, &base_size);
+    u8 * b = (u8 *)intro_create_city_x(ctx, new_data, type, &next_size);
+    if (!a || !b) {
+        free(a);
+        free(b);
+        return NULL;
+    }
 
-    IntroType ** info_by_id;
-    arr_init(info_by_id);
+    // every CITY_DELTA_MIN_MATCH-th position of the base + 1 by a hash of the bytes there, to find data that moved
+    int anchor_bits = 10;
+    while (((size_t)1 << anchor_bits) < base_size / CITY_DELTA_MIN_MATCH) anchor_bits++;
+    size_t * anchors = (size_t *)calloc((size_t)1 << anchor_bits, sizeof(anchors[0]));
+    for (size_t i=0; i + CITY_DELTA_MIN_MATCH <= base_size; i += CITY_DELTA_MIN_MATCH) {
+        size_t * anchor = &anchors[city__delta_hash(a + i, anchor_bits)];
+        if (*anchor == 0) *anchor = i + 1;
+    }
 
-    MemArena * arena = new_arena(4096);
+    u8 * out;
+    arr_init(out);
+    uint64_t schema_hash = city__schema_hash(ctx, type);
+    arr_append_range(out, CITY_DELTA_MAGIC, 4);
+    arr_append_range(out, &schema_hash, 8);
+
+    CityDeltaRecord rec;
+    memset(&rec, 0, sizeof(rec));
+    size_t cursor = 0, next_i = 0;
+    while (next_i < next_size) {
+        size_t match = (cursor < base_size)? city__common_length(a + cursor, base_size - cursor, b + next_i, next_size - next_i) : 0;
+        if (match >= CITY_DELTA_MIN_MATCH || (match > 0 && next_i + match == next_size)) {
+            if (rec.written_end > rec.written_start) city__delta_put_record(&out, &rec, b);
+            rec.copy += match;
+            cursor += match;
+            next_i += match;
+            continue;
+        }
 
-    for (uint32_t i=0; i < header->count_types; i++) {
-        IntroType * type = (IntroType *)arena_alloc(arena, sizeof(*type));
-        memset(type, 0, sizeof(*type));
+        if (next_size - next_i >= CITY_DELTA_MIN_MATCH) {
+            size_t anchor = anchors[city__delta_hash(b + next_i, anchor_bits)];
+            if (anchor != 0 && anchor - 1 != cursor && 0==memcmp(a + anchor - 1, b + next_i, CITY_DELTA_MIN_MATCH)) {
+                if (rec.seek != 0 || rec.copy > 0 || rec.written_end > rec.written_start) city__delta_put_record(&out, &rec, b);
+                rec.seek = (int64_t)(anchor - 1) - (int64_t)cursor;
+                cursor = anchor - 1;
+                continue;
+            }
+        }
 
-        type->category = next_uint(&b, 1);
+        if (rec.written_end == rec.written_start) rec.written_start = next_i;
+        rec.written_end = ++next_i;
+        cursor++;
+    }
+    // the rest of the base is copied after the last record
+    if (rec.seek != 0 || rec.written_end > rec.written_start || cursor != base_size) {
+        city__delta_put_record(&out, &rec, b);
+        if (cursor != base_size) {
+            rec.seek = (int64_t)base_size - (int64_t)cursor;
+            city__delta_put_record(&out, &rec, b);
+        }
+    }
+    free(anchors);
+    free(a);
+    free(b);
 
-        switch(type->category) {
-        case INTRO_STRUCT:
-        case INTRO_UNION: {
-            type->count = next_uint(&b, city->ptr_size);
+    size_t result_size = arr_len(out);
+    u8 * result = (u8 *)malloc(result_size);
+    memcpy(result, out, result_size);
+    arr_free(out);
 
-            if (b + type->count * (city->type_size + city->ptr_size + city->ptr_size) > (u8 *)data + data_size) {
-                city__error("malformed");
-                return -1;
-            }
+    *o_size = result_size;
+    return result;
+}
 
-            IntroMember * members = (IntroMember *)arena_alloc(arena, type->count * sizeof(members[0]));
-            int32_t current_offset = 0;
-            for (uint32_t m=0; m < type->count; m++) {
-                IntroMember member;
-                memset(&member, 0, sizeof(member));
+typedef struct {
+    void ** buffers;
+} CityDeltaAllocs;
 
-                uint32_t type_id = next_uint(&b, city->type_size);
-                member.type   = info_by_id[type_id];
-                member.offset = current_offset;
-                if (type->category == INTRO_UNION) {
-                    if (member.type->size > type->size) {
-                        type->size = member.type->size;
-                    }
-                } else {
-                    current_offset += member.type->size;
-                    type->size = current_offset;
-                }
+static void *
+city__delta_alloc(void * user, size_t size) {
+    CityDeltaAllocs * allocs = (CityDeltaAllocs *)user;
+    void * result = malloc(size);
+    if (result) arr_append(allocs->buffers, result);
+    return result;
+}
 
-                size_t next = next_uint(&b, city->ptr_size);
-                if ((next & id_test_bit)) {
-                    member.attr.offset = (uint32_t)(next & (~id_test_bit)); // store id directly in attr since that isn't being used for anything else
-                } else {
-                    member.name = (char *)(city->data + next);
-                }
+// Writes the data 'delta' was created from into 'dest'. 'base' must hold the same values as when
+// the delta was created. Buffers are allocated with malloc like intro_load_city. 'dest' is only
+// written if the whole delta can be applied, otherwise nothing is allocated.
+int
+intro_city_apply_delta_x(IntroContext * ctx, void * dest, const void * base, const IntroType * type, const void * delta, size_t delta_size) {
+    uint64_t schema_hash, expected_hash = city__schema_hash(ctx, type);
+    if (delta_size < 12 || memcmp(delta, CITY_DELTA_MAGIC, 4) != 0) {
+        city__error("invalid delta.");
+        return -1;
+    }
+    memcpy(&schema_hash, (const u8 *)delta + 4, 8);
+    if (schema_hash != 0 && expected_hash != 0 && schema_hash != expected_hash) {
+        city__error("delta was created for a different type.");
+        return -1;
+    }
 
-                members[m] = member;
+    size_t base_size;
+    u8 * a = (u8 *)intro_create_city_x(ctx, base, type, &base_size);
+    if (!a) return -1;
+
+    u8 * next;
+    arr_init(next);
+    const u8 * in = (const u8 *)delta + 12;
+    const u8 * in_end = (const u8 *)delta + delta_size;
+    uint64_t cursor = 0;
+    bool ok = true;
+    while (in < in_end) {
+        uint64_t seek, copy, written;
+        ok = city__read_varint(&in, in_end, &seek) && city__read_varint(&in, in_end, &copy) && city__read_varint(&in, in_end, &written);
+        if (!ok) break;
+        cursor += (seek >> 1) ^ (~(seek & 1) + 1);
+        if ((copy > 0 && (cursor > base_size || copy > base_size - cursor)) || written > (size_t)(in_end - in)) {
+            ok = false;
+            break;
+        }
+        arr_append_range(next, a + cursor, copy);
+        arr_append_range(next, in, written);
+        cursor += copy + written;
+        in += written;
+    }
+    if (ok && cursor < base_size) arr_append_range(next, a + cursor, base_size - cursor);
+    free(a);
+    if (!ok) {
+        arr_free(next);
+        city__error("malformed delta.");
+        return -1;
+    }
+
+    // the result is loaded aside, so a delta that doesn't load leaves nothing behind
+    CityDeltaAllocs allocs;
+    arr_init(allocs.buffers);
+    IntroLoadOptions opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.validate = true;
+    opt.alloc = city__delta_alloc;
+    opt.alloc_user = &allocs;
+    void * result = malloc(type->size);
+    int ret = intro_load_city_opt_x(ctx, result, type, next, arr_len(next), &opt);
+    arr_free(next);
+    if (ret == 0) {
+        memcpy(dest, result, type->size);
+    } else {
+        for (size_t i=0; i < arr_len(allocs.buffers); i++) free(allocs.buffers[i]);
+    }
+    arr_free(allocs.buffers);
+    free(result);
+    return (ret == 0)? 0 : -1;
+}
+
+// true if data of file type 's' can be used as data of type 'd' without any conversion
+static bool
+city__types_identical(CityContext * city, const IntroType * s, const IntroType * d, HashTable * visited) {
+    if (s->category != d->category || s->size != d->size) return false;
+
+    const IntroType * pair [2] = {s, d};
+    HashEntry entry;
+    entry.key_data = pair;
+    entry.key_size = sizeof(pair);
+    table_get(visited, &entry);
+    if (entry.value != TABLE_INVALID_VALUE) return true; // already checked or being checked
+    entry.value = 1;
+    table_set(visited, entry);
+
+    switch(s->category) {
+    case INTRO_ARRAY:
+        if (s->count != d->count) return false;
+        // fallthrough
+    case INTRO_POINTER:
+        return city__types_identical(city, s->u.of, d->u.of, visited);
+
+    case INTRO_STRUCT:
+    case INTRO_UNION: {
+        if (s->count != d->count) return false;
+        for (uint32_t m_index=0; m_index < s->count; m_index++) {
+            const IntroMember * sm = &s->u.members[m_index];
+            const IntroMember * dm = &d->u.members[m_index];
+            if (sm->offset != dm->offset) return false;
+            if (sm->name) {
+                if (!dm->name || intro_member_name_hash(sm) != intro_member_name_hash(dm) || 0 != strcmp(sm->name, dm->name)) return false;
+            } else {
+                int32_t dm_id;
+                if (!intro_attribute_int_x(city->ictx, dm->attr, city->ictx->attr.builtin.id, &dm_id)) return false;
+                if ((uint32_t)dm_id != sm->attr.offset) return false;
             }
-            type->u.members = members;
-            if (type->category == INTRO_UNION) {
-                type->size += 2;
+            if (!city__types_identical(city, sm->type, dm->type, visited)) return false;
+        }
+    }break;
+
+    default: break;
+    }
+
+    return true;
+}
+
+// Records every pointer slot reachable from 'cont' in 'slots' and queues the buffers they point to,
+// the way city__serialize found them. Returns false if a buffer doesn't fit before the relocation table.
+static bool
+city__find_native_slots(CityContext * city, IntroContainer cont, size_t table_offset, HashTable * slots) {
+    const IntroType * type = cont.type;
+    if (!intro_has_attribute_x(city->ictx, intro_get_attr(cont), city->ictx->attr.builtin.city)) return true;
+
+    switch(type->category) {
+    case INTRO_STRUCT: {
+        for (uint32_t m_index=0; m_index < type->count; m_index++) {
+            if (!city__find_native_slots(city, intro_push(&cont, m_index), table_offset, slots)) return false;
+        }
+    }break;
+
+    case INTRO_UNION: {
+        for (uint32_t i=0; i < type->count; i++) {
+            int64_t is_valid;
+            if (intro_attribute_expr_x(city->ictx, intro_push(&cont, i), city->ictx->attr.builtin.when, &is_valid) && is_valid) {
+                return city__find_native_slots(city, intro_push(&cont, i), table_offset, slots);
             }
-        }break;
+        }
+    }break;
 
-        case INTRO_POINTER: {
-            uint32_t of_id = next_uint(&b, city->type_size);
+    case INTRO_ARRAY: {
+        if (intro_is_scalar(type->u.of)) break;
+        for (uint32_t elem_i=0; elem_i < type->count; elem_i++) {
+            if (!city__find_native_slots(city, intro_push(&cont, elem_i), table_offset, slots)) return false;
+        }
+    }break;
 
-            TypePtrOf ptrof;
-            ptrof.type = type;
-            ptrof.of_id = of_id;
+    case INTRO_POINTER: {
+        uint64_t offset;
+        memcpy(&offset, cont.data, 8);
+        size_t elem_size = type->u.of->size;
+        if (offset == 0 || elem_size == 0) break;
+
+        uint32_t length;
+        if (offset % CITY_NATIVE_ALIGN != 0 || offset < 4 || offset > table_offset) return false;
+        memcpy(&length, city->data + offset - 4, 4);
+        if (length > (table_offset - offset) / elem_size) return false;
+
+        uint64_t location = cont.data - city->data;
+        HashEntry entry;
+        entry.key_data = &location;
+        entry.key_size = sizeof(location);
+        entry.value = 0;
+        table_set(slots, entry);
+
+        CityBufferKey key;
+        memset(&key, 0, sizeof(key));
+        key.origin = offset;
+        key.size = elem_size * length;
+        entry.key_data = &key;
+        entry.key_size = sizeof(key);
+        table_get(city->buffer_set, &entry);
+        if (entry.value != TABLE_INVALID_VALUE) break;
+        if (key.size > city->load_budget) return false;
+        city->load_budget -= key.size;
+        entry.value = offset;
+        table_set(city->buffer_set, entry);
 
-            arr_append(deferred_pointer_ofs, ptrof);
+        CityBuffer buf;
+        buf.origin = city->data + offset;
+        buf.ptr_type = type;
+        buf.ser_offset = offset;
+        buf.length = length;
+        arr_append(city->buffers, buf);
+    }break;
 
-            type->size = city->ptr_size;
-        }break;
+    default: break;
+    }
+    return true;
+}
 
-        case INTRO_ARRAY: {
-            uint32_t elem_id = next_uint(&b, city->type_size);
-            uint32_t count = next_uint(&b, city->ptr_size);
+// True if the relocation table lists exactly the pointer slots reachable from the root, each once,
+// and every buffer they point to fits before the table.
+static bool
+city__check_native_relocs(CityContext * city, const IntroType * d_type, size_t table_offset, uint64_t count_relocs) {
+    HashTable * slots = new_table(64);
+    city->buffer_set = new_table(64);
+    arr_init(city->buffers);
+    city->load_budget = CITY_VALIDATE_BUDGET * (uint64_t)table_offset;
+
+    // buffers are walked in order, so deep pointer chains don't recurse
+    bool ok = city__find_native_slots(city, intro_cntr(city->data, d_type), table_offset, slots);
+    for (size_t buf_i=0; buf_i < arr_len(city->buffers) && ok; buf_i++) {
+        CityBuffer buf = city->buffers[buf_i];
+        IntroContainer ptr_cntr = intro_cntr((void *)&buf.origin, buf.ptr_type);
+        for (uint32_t elem_i=0; elem_i < buf.length && ok; elem_i++) {
+            ok = city__find_native_slots(city, intro_push(&ptr_cntr, elem_i), table_offset, slots);
+        }
+    }
 
-            IntroType * elem_type = info_by_id[elem_id];
-            type->u.of = elem_type;
-            type->count = count;
-            type->size = elem_type->size * count;
-        }break;
+    uint64_t count_slots = 0;
+    for (uint64_t reloc_i=0; reloc_i < count_relocs && ok; reloc_i++) {
+        uint64_t location;
+        memcpy(&location, city->data + table_offset + reloc_i * 8, 8);
+        HashEntry entry;
+        entry.key_data = &location;
+        entry.key_size = sizeof(location);
+        table_get(slots, &entry);
+        ok = entry.value == 0; // a slot, and not listed before
+        entry.value = 1;
+        table_set(slots, entry);
+        count_slots++;
+    }
+    ok = ok && count_slots == table_count(slots);
 
-        case INTRO_ENUM: {
-            uint32_t size = next_uint(&b, 1);
+    arr_free(city->buffers);
+    free_table(city->buffer_set);
+    free_table(slots);
+    return ok;
+}
 
-            type->size = size;
-        }break;
+// Loads a native city file without copying. Pointers are relocated in place, so 'data' must be writable
+// and outlive the result. Returns a pointer to the root data inside 'data', or NULL on failure.
+void *
+intro_load_city_in_place_x(IntroContext * ctx, void * data, size_t data_size, const IntroType * d_type) {
+    CityContext _city, * city = &_city;
+    memset(city, 0, sizeof(_city));
+    city->ictx = ctx;
 
-        default: break;
+    MemArena * arena = new_arena(4096);
+    uint64_t schema_hash;
+    bool ok_header = city__read_header(city, data, data_size, &schema_hash);
+
+    u8 * result = NULL;
+    const CityHeader * header = (const CityHeader *)data;
+    if (!ok_header) {
+    } else if (!city->native || city->ptr_size != sizeof(void *) || (header->flags & CITY_FLAG_COMPRESSED)) {
+        city__error("only native CTY files can be loaded in place.");
+    } else if (header->data_ptr % CITY_NATIVE_ALIGN != 0 || (uintptr_t)data % CITY_NATIVE_ALIGN != 0) {
+        city__error("CTY data is not aligned.");
+    } else {
+        // with a matching schema hash the type info does not need to be compared
+        bool identical = (schema_hash != 0 && schema_hash == city__schema_hash(ctx, d_type));
+        if (!identical) {
+            const IntroType * s_type = city__read_types(city, data, data_size, arena, false, city->ptr_size);
+            if (s_type) {
+                HashTable * visited = new_table(64);
+                identical = city__types_identical(city, s_type, d_type, visited);
+                free_table(visited);
+            }
         }
-        if (type->size == 0) {
-            switch(type->category) {
-            case INTRO_U8: case INTRO_S8:                   type->size = 1; break;
-            case INTRO_U16: case INTRO_S16:                 type->size = 2; break;
-            case INTRO_U32: case INTRO_S32: case INTRO_F32: type->size = 4; break;
-            case INTRO_U64: case INTRO_S64: case INTRO_F64: type->size = 8; break;
-            case INTRO_F128: type->size = 16; break;
+
+        // the relocation table is at the end of the data section, the count is last
+        size_t section_size = (header->data_ptr <= data_size)? data_size - header->data_ptr : 0;
+        uint64_t count_relocs = 0;
+        if (section_size >= 8) memcpy(&count_relocs, city->data + section_size - 8, 8);
+
+        if (!identical) {
+            city__error("types do not match the file exactly, use intro_load_city instead.");
+        } else if (section_size < 8 || count_relocs > (section_size - 8) / 8) {
+            city__error("malformed");
+        } else {
+            size_t table_offset = section_size - 8 - count_relocs * 8;
+            bool ok = d_type->size <= table_offset && city__check_native_relocs(city, d_type, table_offset, count_relocs);
+            for (uint64_t reloc_i=0; reloc_i < count_relocs && ok; reloc_i++) {
+                uint64_t location, offset;
+                memcpy(&location, city->data + table_offset + reloc_i * 8, 8);
+                memcpy(&offset, city->data + location, 8);
+                void * ptr = city->data + offset;
+                memcpy(city->data + location, &ptr, sizeof(ptr));
+            }
+            if (ok) {
+                result = city->data;
+            } else {
+                city__error("malformed");
             }
         }
-        arr_append(info_by_id, type);
     }
 
-    for (size_t i=0; i < arr_len(deferred_pointer_ofs); i++) {
-        TypePtrOf ptrof = deferred_pointer_ofs[i];
-        ptrof.type->u.of = info_by_id[ptrof.of_id];
+    free_arena(arena);
+    return result;
+}
+
+// Maps a file, with copy on write if 'writable'. Reads it into memory where mmap isn't available.
+static bool
+city__map_file(const char * filename, bool writable, IntroCityMap * o_map) {
+    memset(o_map, 0, sizeof(*o_map));
+#if INTRO_HAVE_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return false;
     }
-    arr_free(deferred_pointer_ofs);
+    int prot = (writable)? PROT_READ | PROT_WRITE : PROT_READ;
+    void * base = mmap(NULL, st.st_size, prot, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return false;
+    o_map->base = base;
+    o_map->size = st.st_size;
+    o_map->is_mapped = true;
+#else
+    (void) writable;
+    o_map->base = intro_read_file(filename, &o_map->size);
+    if (!o_map->base) return false;
+#endif
+    return true;
+}
 
-    const IntroType * s_type = info_by_id[arr_len(info_by_id) - 1];
+// Maps a native city file with copy on write, so pages without pointers are shared between processes.
+// Returns a pointer to the root data or NULL on failure. Release with intro_unmap_city_file.
+void *
+intro_map_city_file_x(IntroContext * ctx, const char * filename, const IntroType * d_type, IntroCityMap * o_map) {
+    if (!city__map_file(filename, true, o_map)) return NULL;
 
-    int copy_result = city__load_into(city, intro_cntr(dest, d_type), city->data, s_type);
+    void * result = intro_load_city_in_place_x(ctx, o_map->base, o_map->size, d_type);
+    if (!result) intro_unmap_city_file(o_map);
+    return result;
+}
 
-    arr_free(info_by_id);
-    free_arena(arena);
+// The file is mapped read only and only the parts that are loaded are read.
+IntroCity *
+intro_city_open_file_x(IntroContext * ctx, const char * filename, const IntroLoadOptions * opt) {
+    IntroCityMap map;
+    if (!city__map_file(filename, false, &map)) return NULL;
 
-    return copy_result;
+    IntroCity * result = intro_city_open_x(ctx, map.base, map.size, opt);
+    if (!result) {
+        intro_unmap_city_file(&map);
+        return NULL;
+    }
+    result->map = map;
+    return result;
+}
+
+void
+intro_unmap_city_file(IntroCityMap * map) {
+#if INTRO_HAVE_MMAP
+    if (map->is_mapped) {
+        munmap(map->base, map->size);
+        memset(map, 0, sizeof(*map));
+        return;
+    }
+#endif
+    free(map->base);
+    memset(map, 0, sizeof(*map));
 }
 #endif // INTRO_IMPL
 
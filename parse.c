@@ -121,6 +121,7 @@ struct ParseContext {
     uint32_t attribute_id_counter;
     uint32_t flag_temp_id_counter;
     ParseInfo * p_info;
+    bool gen_expr_funcs;
 };
 
 static void
@@ -1315,6 +1316,7 @@ parse_preprocessed_tokens(const Config * cfg, PreInfo * pre_info, ParseInfo * o_
     ctx->expr_ctx->ctx = ctx;
     ctx->loc = pre_info->loc;
     ctx->loc.tk_list = pre_info->result_list;
+    ctx->gen_expr_funcs = cfg->gen_expr_funcs;
 
     sh_new_arena(ctx->type_map);
     sh_new_arena(ctx->enum_name_set);
@@ -1370,6 +1372,7 @@ parse_preprocessed_tokens(const Config * cfg, PreInfo * pre_info, ParseInfo * o_
 
     o_info->types = NULL;
     o_info->index_by_ptr_map = NULL;
+    o_info->expr_offsets = NULL;
     for (int i=0; i < hmlen(ctx->type_set); i++) {
         IntroType * type_ptr = ctx->type_set[i].value;
         if (i < LENGTH(known_types) || (type_ptr->flags & INTRO_EXPLICITLY_GENERATED)) {
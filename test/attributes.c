@@ -167,8 +167,50 @@ special_free(void * dest_struct, const IntroType * type) {
     }
 }
 
+// looks up every attribute that has a value on every member, returns a sum of the results
+static uint64_t
+query_all_attributes(IntroContext * ctx, uint64_t * o_count_queries) {
+    uint64_t sum = 0;
+    for (uint32_t type_i=0; type_i < ctx->count_types; type_i++) {
+        const IntroType * type = &ctx->types[type_i];
+        if (!intro_has_members(type)) continue;
+        for (uint32_t mi=0; mi < type->count; mi++) {
+            const IntroMember * m = &type->members[mi];
+            for (uint32_t attr_id=0; attr_id < ctx->attr.first_flag; attr_id++) {
+                int32_t i32 = 0;
+                float f = 0;
+                switch(ctx->attr.available[attr_id].category) {
+                case INTRO_AT_INT:    intro_attribute_int_x(ctx, m->attr, attr_id, &i32); break;
+                case INTRO_AT_MEMBER: intro_attribute_member_x(ctx, m->attr, attr_id, &i32); break;
+                case INTRO_AT_FLOAT:  intro_attribute_float_x(ctx, m->attr, attr_id, &f); i32 = (int32_t)f; break;
+                case INTRO_AT_TYPE:   i32 = (intro_attribute_type_x(ctx, m->attr, attr_id) != NULL); break;
+                default: continue;
+                }
+                sum += (uint32_t)i32 + attr_id;
+                *o_count_queries += 1;
+            }
+        }
+    }
+    return sum;
+}
+
 int
 main() {
+    {
+        // attribute queries with the generated prefix counts find the same values as without
+        IntroContext loop_ctx = *INTRO_CTX;
+        loop_ctx.attr.prefix_counts = NULL;
+        IntroContext * contexts [] = {INTRO_CTX, &loop_ctx};
+        uint64_t sums [2];
+        uint64_t counts [2] = {0, 0};
+        assert(INTRO_CTX->attr.prefix_counts != NULL);
+        for (int ctx_i=0; ctx_i < LENGTH(contexts); ctx_i++) {
+            sums[ctx_i] = query_all_attributes(contexts[ctx_i], &counts[ctx_i]);
+        }
+        assert(counts[0] > 0 && counts[0] == counts[1]);
+        assert(sums[0] == sums[1]);
+    }
+
     JointAllocTest data = {0};
 
     data.length_name = 12;
@@ -0,0 +1,86 @@
+#include "basic.h"
+#include <intro.h>
+#include <time.h>
+
+I(attribute bench_ (
+    weight: float,
+    rank: int,
+    other: member,
+    hidden: flag,
+    tag: int @propagate,
+))
+
+I(bench_tag 3)
+typedef struct {
+    float x, y, z;
+} BenchVector;
+
+typedef struct {
+    char * name I(length length_name, bench_rank 1);
+    int length_name I(bench_: weight 0.5, other name);
+
+    BenchVector position I(bench_weight 2.0);
+    BenchVector velocity I(bench_: rank 4, hidden);
+    int flags I(id 3, fallback 7);
+    float mass I(bench_: weight 9.5, rank -2, other flags);
+} BenchEntity;
+
+#include "attributes_bench.c.intro"
+
+static double
+time_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// looks up every attribute that has a value on every member, returns a sum of the results
+static uint64_t
+query_all_attributes(IntroContext * ctx, uint64_t * o_count_queries) {
+    uint64_t sum = 0;
+    for (uint32_t type_i=0; type_i < ctx->count_types; type_i++) {
+        const IntroType * type = &ctx->types[type_i];
+        if (!intro_has_members(type)) continue;
+        for (uint32_t mi=0; mi < type->count; mi++) {
+            const IntroMember * m = &type->members[mi];
+            for (uint32_t attr_id=0; attr_id < ctx->attr.first_flag; attr_id++) {
+                int32_t i32 = 0;
+                float f = 0;
+                switch(ctx->attr.available[attr_id].category) {
+                case INTRO_AT_INT:    intro_attribute_int_x(ctx, m->attr, attr_id, &i32); break;
+                case INTRO_AT_MEMBER: intro_attribute_member_x(ctx, m->attr, attr_id, &i32); break;
+                case INTRO_AT_FLOAT:  intro_attribute_float_x(ctx, m->attr, attr_id, &f); i32 = (int32_t)f; break;
+                case INTRO_AT_TYPE:   i32 = (intro_attribute_type_x(ctx, m->attr, attr_id) != NULL); break;
+                default: continue;
+                }
+                sum += (uint32_t)i32 + attr_id;
+                *o_count_queries += 1;
+            }
+        }
+    }
+    return sum;
+}
+
+int
+main() {
+    // attribute queries with the generated prefix counts and without
+    IntroContext loop_ctx = *INTRO_CTX;
+    loop_ctx.attr.prefix_counts = NULL;
+    IntroContext * contexts [] = {INTRO_CTX, &loop_ctx};
+    const char * context_names [] = {"prefix counts", "popcount loop"};
+    uint64_t sums [2];
+    assert(INTRO_CTX->attr.prefix_counts != NULL);
+    for (int ctx_i=0; ctx_i < LENGTH(contexts); ctx_i++) {
+        uint64_t count_queries = 0;
+        sums[ctx_i] = 0;
+        double start = time_seconds();
+        for (int rep=0; rep < 2000; rep++) {
+            sums[ctx_i] += query_all_attributes(contexts[ctx_i], &count_queries);
+        }
+        double elapsed = time_seconds() - start;
+        printf("attribute queries (%s): %.1f million per second\n", context_names[ctx_i], count_queries / elapsed / 1e6);
+    }
+    assert(sums[0] == sums[1]);
+
+    return 0;
+}
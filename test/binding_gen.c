@@ -65,6 +65,9 @@ fprint_odin_type(FILE * out, const OdinGenOptions * opt, IntroContainer cntr, in
         if (type->of == ITYPE(void)) {
             fprintf(out, "rawptr");
             return;
+        } else if (type->of->category == INTRO_FUNCTION) {
+            fprint_odin_type(out, opt, intro_cntr(NULL, type->of), depth);
+            return;
         } else if (intro_has_attribute_x(INTRO_CTX, attr, IATTR_cstring)) {
             fprintf(out, "cstring");
             return;
@@ -164,6 +167,21 @@ fprint_odin_type(FILE * out, const OdinGenOptions * opt, IntroContainer cntr, in
             }
         }break;
 
+        case INTRO_FUNCTION: {
+            fprintf(out, "proc \"c\" (");
+            for (int arg_i=1; arg_i < type->count; arg_i++) {
+                if (arg_i > 1) fprintf(out, ", ");
+                fprint_odin_type(out, opt, intro_cntr(NULL, type->arg_types[arg_i]), depth + 1);
+            }
+            fprintf(out, ")");
+            const IntroType * return_type = type->arg_types[0];
+            if (return_type->category != INTRO_UNKNOWN) {
+                fprintf(out, " -> ");
+                fprint_odin_type(out, opt, intro_cntr(NULL, return_type), depth + 1);
+            }
+            return;
+        }break;
+
         default: break;
         }
 
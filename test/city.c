@@ -131,6 +131,85 @@ typedef struct {
     Selection selections [4] I(12);
 } BasicPlus;
 
+I(attribute my_ (
+    dyn_array: flag @transient @imply(header DynArrayHeader, length .count),
+))
+
+typedef struct {
+    int32_t count;
+    int32_t cap;
+} DynArrayHeader;
+
+typedef struct {
+    int id;
+    int * values I(my_dyn_array);
+} DynItem;
+
+typedef struct {
+    int count_items;
+    DynItem * items I(length count_items);
+} DynRoot;
+
+typedef struct ListNode ListNode;
+struct ListNode {
+    ListNode * next;
+    int value;
+};
+
+typedef struct {
+    ListNode * first;
+    int32_t count_nodes;
+} NodeList;
+
+typedef struct {
+    uint8_t * bytes I(length count_bytes);
+    uint32_t count_bytes;
+} Blob;
+
+typedef struct {
+    int32_t id;
+    float position [3];
+    uint16_t flags;
+    double weight;
+    struct {
+        uint8_t r, g, b, a;
+    } color;
+} Record;
+
+// Record with fewer members in a different order, so its schema hash is different
+typedef struct {
+    double weight;
+    int32_t id;
+} RecordPart;
+
+typedef struct {
+    Record * records I(length count_records);
+    int32_t count_records;
+} Records;
+
+// Records with its members swapped, so loading it needs the type info of the file
+typedef struct {
+    int32_t count_records;
+    Record * records I(length count_records);
+} RecordsSwapped;
+
+typedef struct {
+    Blob * blobs I(length count_blobs);
+    int32_t count_blobs;
+} Blobs;
+
+// Blob reordered with a member the file doesn't have
+typedef struct {
+    uint32_t count_bytes;
+    int32_t version I(fallback 3);
+    uint8_t * bytes I(length count_bytes);
+} BlobNext;
+
+typedef struct {
+    int32_t count_blobs;
+    BlobNext * blobs I(length count_blobs);
+} BlobsNext;
+
 #define GEN_LINK_REPORT(TYPE) \
 void \
 report_ ## TYPE (TYPE * node) { \
@@ -148,6 +227,709 @@ GEN_LINK_REPORT(LinkNodeLoad)
 
 #include "city.c.intro"
 
+static ListNode *
+create_nodes(int count) {
+    ListNode * nodes = calloc(count, sizeof(*nodes));
+    for (int i=0; i < count; i++) {
+        nodes[i].value = i;
+        nodes[i].next = (i + 1 < count)? &nodes[i + 1] : NULL;
+    }
+    return nodes;
+}
+
+typedef struct {
+    uint8_t * data;
+    size_t size;
+    size_t capacity;
+    int count_writes;
+} StreamBuffer;
+
+static bool
+stream_write(void * user, const void * data, size_t size) {
+    StreamBuffer * buf = user;
+    if (buf->size + size > buf->capacity) {
+        buf->capacity = (buf->size + size) * 2;
+        buf->data = realloc(buf->data, buf->capacity);
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+    buf->count_writes += 1;
+    return true;
+}
+
+static void *
+counting_alloc(void * user, size_t size) {
+    *(int *)user += 1;
+    return malloc(size);
+}
+
+static void *
+failing_alloc(void * user, size_t size) {
+    (void) user;
+    (void) size;
+    return NULL;
+}
+
+static void
+count_error(void * user, const char * msg) {
+    (void) msg;
+    *(int *)user += 1;
+}
+
+static void
+test_lists() {
+    NodeList list = {.first = create_nodes(100), .count_nodes = 100};
+
+    size_t size;
+    void * city = intro_create_city(&list, ITYPE(NodeList), &size);
+    // every node is serialized exactly once: ptr + int + length header
+    assert(city != NULL);
+    assert(size > 100 * 11 && size < 100 * 11 + 256);
+
+    NodeList loaded;
+    int ret = intro_load_city(&loaded, ITYPE(NodeList), city, size);
+    assert(ret == 0);
+    ListNode * node = loaded.first;
+    for (int i=0; i < 100; i++) {
+        assert(node && node->value == i);
+        ListNode * next = node->next;
+        free(node);
+        node = next;
+    }
+    assert(node == NULL);
+
+    // every node comes from the arena and is freed with it
+    IntroLoadOptions opt = {0};
+    opt.arena = intro_create_arena();
+    ret = intro_load_city_opt(&loaded, ITYPE(NodeList), city, size, &opt);
+    assert(ret == 0);
+    node = loaded.first;
+    for (int i=0; i < 100; i++) {
+        assert(node && node->value == i);
+        node = node->next;
+    }
+    intro_free_arena(opt.arena);
+
+    int count_allocs = 0;
+    memset(&opt, 0, sizeof(opt));
+    opt.alloc = counting_alloc;
+    opt.alloc_user = &count_allocs;
+    ret = intro_load_city_opt(&loaded, ITYPE(NodeList), city, size, &opt);
+    assert(ret == 0);
+    assert(count_allocs == 100);
+    for (node = loaded.first; node; ) {
+        ListNode * next = node->next;
+        free(node);
+        node = next;
+    }
+
+    // a failed allocation is a load error
+    memset(&opt, 0, sizeof(opt));
+    opt.alloc = failing_alloc;
+    assert(0 > intro_load_city_opt(&loaded, ITYPE(NodeList), city, size, &opt));
+    free(city);
+
+    // a cycle must not serialize any node twice
+    size_t cycle_size;
+    list.first[99].next = &list.first[42];
+    city = intro_create_city(&list, ITYPE(NodeList), &cycle_size);
+    assert(cycle_size == size);
+    free(city);
+    free(list.first);
+
+    // streaming in chunks produces the same bytes as the in-memory writer
+    int count = 200000;
+    list.first = create_nodes(count);
+    list.count_nodes = count;
+    city = intro_create_city(&list, ITYPE(NodeList), &size);
+    StreamBuffer buf = {0};
+    assert(intro_write_city_stream(stream_write, &buf, &list, ITYPE(NodeList)));
+    assert(buf.size == size);
+    assert(buf.count_writes > 1);
+    assert(0==memcmp(buf.data, city, size));
+    free(buf.data);
+    free(city);
+    free(list.first);
+}
+
+static void
+test_large_blob() {
+    // data past 16 MiB needs 4 byte pointers
+    Blob blob;
+    blob.count_bytes = (1 << 24) + 100;
+    blob.bytes = malloc(blob.count_bytes);
+    for (uint32_t i=0; i < blob.count_bytes; i++) {
+        blob.bytes[i] = i * 7;
+    }
+
+    size_t size;
+    uint8_t * city = intro_create_city(&blob, ITYPE(Blob), &size);
+    uint8_t size_info = city[8];
+    assert(1 + (size_info & 0x0f) == 4);
+
+    // smaller data gets the narrowest pointers that fit it
+    uint32_t count_bytes = blob.count_bytes;
+    uint32_t small_counts [2] = {100, 1 << 16};
+    for (int i=0; i < 2; i++) {
+        size_t small_size;
+        blob.count_bytes = small_counts[i];
+        uint8_t * small = intro_create_city(&blob, ITYPE(Blob), &small_size);
+        assert(1 + (small[8] & 0x0f) == 2 + i);
+        free(small);
+    }
+    blob.count_bytes = count_bytes;
+
+    // the schema hash follows the type count
+    uint16_t version_minor;
+    uint64_t schema_hash;
+    memcpy(&version_minor, city + 6, 2);
+    memcpy(&schema_hash, city + 20, 8);
+    assert(version_minor >= 5);
+    assert(schema_hash != 0);
+
+    Blob loaded;
+    int ret = intro_load_city(&loaded, ITYPE(Blob), city, size);
+    assert(ret == 0);
+    assert(loaded.count_bytes == blob.count_bytes);
+    assert(0==memcmp(loaded.bytes, blob.bytes, blob.count_bytes));
+    free(loaded.bytes);
+
+    // a buffer larger than an arena bucket gets its own block
+    IntroLoadOptions opt = {0};
+    opt.arena = intro_create_arena();
+    for (int i=0; i < 3; i++) {
+        ret = intro_load_city_opt(&loaded, ITYPE(Blob), city, size, &opt);
+        assert(ret == 0);
+        assert(loaded.count_bytes == blob.count_bytes);
+        assert(0==memcmp(loaded.bytes, blob.bytes, blob.count_bytes));
+    }
+    intro_free_arena(opt.arena);
+
+    // the widths are found before the bytes are streamed
+    StreamBuffer buf = {0};
+    assert(intro_write_city_stream(stream_write, &buf, &blob, ITYPE(Blob)));
+    assert(buf.size == size && 0==memcmp(buf.data, city, size));
+    free(buf.data);
+
+    free(blob.bytes);
+    free(city);
+}
+
+static void
+test_parallel() {
+    // threads must produce the same bytes as the serial writer
+    int count = 20000;
+    Records src;
+    src.count_records = count;
+    src.records = calloc(count, sizeof(src.records[0]));
+    for (int i=0; i < count; i++) {
+        src.records[i].id = i;
+        src.records[i].weight = i * 0.5;
+        src.records[i].color.r = i & 0xff;
+    }
+
+    size_t serial_size, parallel_size;
+    void * serial = intro_create_city(&src, ITYPE(Records), &serial_size);
+    void * parallel = intro_create_city_parallel(&src, ITYPE(Records), &parallel_size, 4);
+    assert(serial != NULL && parallel != NULL);
+    assert(parallel_size == serial_size);
+    assert(0==memcmp(parallel, serial, serial_size));
+
+    Records loaded;
+    IntroLoadOptions opt = {0};
+    opt.count_threads = 4;
+    int ret = intro_load_city_opt(&loaded, ITYPE(Records), serial, serial_size, &opt);
+    assert(ret == 0);
+    assert(loaded.count_records == count);
+    for (int i=0; i < count; i++) {
+        assert(loaded.records[i].id == i);
+        assert(loaded.records[i].weight == i * 0.5);
+        assert(loaded.records[i].color.r == (i & 0xff));
+    }
+    free(loaded.records);
+    free(parallel);
+    free(serial);
+    free(src.records);
+
+    // elements with pointers, a different layout and fallbacks are loaded by the workers too
+    int count_blobs = 10000;
+    Blobs blobs;
+    blobs.count_blobs = count_blobs;
+    blobs.blobs = calloc(count_blobs, sizeof(blobs.blobs[0]));
+    uint8_t bytes [16];
+    for (int i=0; i < (int)sizeof(bytes); i++) bytes[i] = i * 3;
+    for (int i=0; i < count_blobs; i++) {
+        blobs.blobs[i].bytes = bytes;
+        blobs.blobs[i].count_bytes = 1 + i % sizeof(bytes);
+    }
+    size_t blobs_size;
+    void * blobs_city = intro_create_city(&blobs, ITYPE(Blobs), &blobs_size);
+    assert(blobs_city != NULL);
+
+    for (int mode=0; mode < 3; mode++) {
+        BlobsNext loaded_blobs;
+        memset(&opt, 0, sizeof(opt));
+        opt.count_threads = (mode == 0)? 1 : 4;
+        if (mode == 2) opt.arena = intro_create_arena();
+        opt.validate = true;
+        ret = intro_load_city_opt(&loaded_blobs, ITYPE(BlobsNext), blobs_city, blobs_size, &opt);
+        assert(ret == 0);
+        assert(loaded_blobs.count_blobs == count_blobs);
+        for (int i=0; i < count_blobs; i++) {
+            BlobNext * blob = &loaded_blobs.blobs[i];
+            assert(blob->version == 3);
+            assert(blob->count_bytes == 1 + i % sizeof(bytes));
+            assert(0==memcmp(blob->bytes, bytes, blob->count_bytes));
+            if (!opt.arena) free(blob->bytes);
+        }
+        if (opt.arena) {
+            intro_free_arena(opt.arena);
+        } else {
+            free(loaded_blobs.blobs);
+        }
+    }
+
+    // an error found by a worker goes to the error proc of the thread that started the load
+    {
+        uint8_t * corrupt = malloc(blobs_size);
+        memcpy(corrupt, blobs_city, blobs_size);
+        uint32_t data_ptr;
+        memcpy(&data_ptr, corrupt + 12, 4);
+        int ptr_size = 1 + (corrupt[8] & 0x0f);
+        uint64_t array_offset = 0;
+        memcpy(&array_offset, corrupt + data_ptr, ptr_size);
+        uint8_t * last_blob = corrupt + data_ptr + array_offset + (count_blobs - 1) * (ptr_size + 4);
+        memset(last_blob, 0x7f, ptr_size);
+
+        BlobsNext loaded_blobs;
+        memset(&opt, 0, sizeof(opt));
+        opt.count_threads = 4;
+        opt.validate = true;
+        opt.arena = intro_create_arena();
+        int count_errors = 0;
+        intro_city_set_error_proc(count_error, &count_errors);
+        ret = intro_load_city_opt(&loaded_blobs, ITYPE(BlobsNext), corrupt, blobs_size, &opt);
+        intro_city_set_error_proc(NULL, NULL);
+        assert(ret != 0 && count_errors > 0);
+        intro_free_arena(opt.arena);
+        free(corrupt);
+    }
+    free(blobs_city);
+    free(blobs.blobs);
+}
+
+static void
+test_compressed() {
+    // compressed data must load the same as uncompressed data
+    int count = 10000;
+    Records src;
+    src.count_records = count;
+    src.records = calloc(count, sizeof(src.records[0]));
+    for (int i=0; i < count; i++) {
+        src.records[i].id = i;
+        src.records[i].flags = (i % 3 == 0);
+        src.records[i].color.a = 255;
+    }
+
+    size_t raw_size, size;
+    void * raw = intro_create_city(&src, ITYPE(Records), &raw_size);
+    uint8_t * city = intro_create_city_compressed(&src, ITYPE(Records), &size);
+    assert(city != NULL);
+    assert(size < raw_size / 4);
+
+    Records loaded;
+    int ret = intro_load_city(&loaded, ITYPE(Records), city, size);
+    assert(ret == 0);
+    assert(loaded.count_records == count);
+    for (int i=0; i < count; i++) {
+        assert(loaded.records[i].id == i);
+        assert(loaded.records[i].flags == src.records[i].flags);
+        assert(loaded.records[i].color.a == 255);
+    }
+    free(loaded.records);
+
+    Record record;
+    ret = intro_city_load_path(city, size, "records[777]", &record, ITYPE(Record));
+    assert(ret == 0 && record.id == 777 && record.color.a == 255);
+
+    // a truncated block must be rejected
+    ret = intro_load_city(&loaded, ITYPE(Records), city, size - 10);
+    assert(ret != 0);
+
+    // so must a corrupt section header or block table
+    uint32_t data_ptr;
+    memcpy(&data_ptr, city + 12, 4);
+    uint8_t * corrupt = malloc(size);
+    IntroLoadOptions opt = {0};
+    opt.validate = true;
+    uint64_t huge_size = (uint64_t)size * 200;
+    uint32_t zero = 0, huge_block = 0x7fffffff;
+    struct {
+        size_t offset;
+        const void * value;
+        size_t size;
+    } edits [] = {
+        {0, &zero, 4},          // data size
+        {8, &zero, 4},          // block size
+        {0, &huge_size, 8},
+        {12, &huge_block, 4},   // first stored size
+    };
+    for (int i=0; i < LENGTH(edits); i++) {
+        memcpy(corrupt, city, size);
+        memcpy(corrupt + data_ptr + edits[i].offset, edits[i].value, edits[i].size);
+        int count_errors = 0;
+        intro_city_set_error_proc(count_error, &count_errors);
+        ret = intro_load_city_opt(&loaded, ITYPE(Records), corrupt, size, &opt);
+        intro_city_set_error_proc(NULL, NULL);
+        assert(ret != 0 && count_errors > 0);
+    }
+    free(corrupt);
+
+    free(city);
+    free(raw);
+    free(src.records);
+}
+
+static void
+test_delta() {
+    // a delta of a few changed records stays small
+    int count = 10000;
+    Records base, next;
+    base.count_records = next.count_records = count;
+    base.records = calloc(count, sizeof(base.records[0]));
+    next.records = calloc(count, sizeof(next.records[0]));
+    for (int i=0; i < count; i++) base.records[i].id = i;
+    memcpy(next.records, base.records, count * sizeof(base.records[0]));
+    for (int i=0; i < count; i += 100) next.records[i].weight = 1.5;
+
+    size_t delta_size;
+    void * delta = intro_city_diff(&base, &next, ITYPE(Records), &delta_size);
+    assert(delta_size < 100 * 16);
+
+    Records applied;
+    int ret = intro_city_apply_delta(&applied, &base, ITYPE(Records), delta, delta_size);
+    assert(ret == 0);
+    assert(applied.count_records == count);
+    for (int i=0; i < count; i++) {
+        assert(applied.records[i].id == i);
+        assert(applied.records[i].weight == next.records[i].weight);
+    }
+
+    free(applied.records);
+    free(delta);
+    free(next.records);
+    free(base.records);
+}
+
+static void
+test_validate() {
+    // validation must reject or safely load every corrupted file
+    int count = 1000;
+    Records src;
+    src.count_records = count;
+    src.records = calloc(count, sizeof(src.records[0]));
+    for (int i=0; i < count; i++) src.records[i].id = i;
+    NodeList list = {.first = create_nodes(50), .count_nodes = 50};
+
+    size_t sizes [2];
+    uint8_t * files [2];
+    files[0] = intro_create_city(&src, ITYPE(Records), &sizes[0]);
+    files[1] = intro_create_city(&list, ITYPE(NodeList), &sizes[1]);
+    const IntroType * types [2] = {ITYPE(Records), ITYPE(NodeList)};
+
+    IntroLoadOptions opt = {0};
+    opt.validate = true;
+    for (int file_i=0; file_i < 2; file_i++) {
+        assert(intro_city_set_checksum(files[file_i], sizes[file_i]));
+        uint8_t dest [64];
+        opt.arena = intro_create_arena();
+        assert(0 == intro_load_city_opt(dest, types[file_i], files[file_i], sizes[file_i], &opt));
+        intro_free_arena(opt.arena);
+
+        // a flipped bit is caught by the checksum
+        int count_errors = 0;
+        intro_city_set_error_proc(count_error, &count_errors);
+        files[file_i][sizes[file_i] - 1] ^= 0x10;
+        assert(0 != intro_load_city_opt(dest, types[file_i], files[file_i], sizes[file_i], &opt));
+        files[file_i][sizes[file_i] - 1] ^= 0x10;
+        intro_city_set_error_proc(NULL, NULL);
+        assert(count_errors == 1);
+
+        // without a checksum, corrupted data must still never be read out of bounds
+        files[file_i][9] &= ~0x04;
+    }
+
+    srand(1234);
+    int count_corpus = 4000, count_rejected = 0, count_errors = 0;
+    uint8_t * corrupted = malloc(sizes[0]);
+    intro_city_set_error_proc(count_error, &count_errors);
+    for (int corpus_i=0; corpus_i < count_corpus; corpus_i++) {
+        int file_i = corpus_i & 1;
+        size_t size = sizes[file_i];
+        memcpy(corrupted, files[file_i], size);
+        int count_flips = 1 + rand() % 4;
+        for (int flip_i=0; flip_i < count_flips; flip_i++) {
+            corrupted[rand() % size] ^= 1 << (rand() % 8);
+        }
+        if (rand() % 8 == 0) size = rand() % size;
+
+        uint8_t dest [64];
+        opt.arena = intro_create_arena();
+        int errors_before = count_errors;
+        if (0 != intro_load_city_opt(dest, types[file_i], corrupted, size, &opt)) {
+            // every rejected file says why
+            assert(count_errors > errors_before);
+            count_rejected++;
+        }
+        intro_free_arena(opt.arena);
+    }
+    intro_city_set_error_proc(NULL, NULL);
+    assert(count_rejected > count_corpus / 4);
+    assert(count_errors >= count_rejected);
+
+    free(corrupted);
+    free(files[0]);
+    free(files[1]);
+    free(list.first);
+    free(src.records);
+
+    // deep lists are refused instead of overflowing the stack
+    list.first = create_nodes(2000);
+    list.count_nodes = 2000;
+    size_t size;
+    void * city = intro_create_city(&list, ITYPE(NodeList), &size);
+    opt.arena = intro_create_arena();
+    NodeList loaded;
+    assert(0 != intro_load_city_opt(&loaded, ITYPE(NodeList), city, size, &opt));
+    intro_free_arena(opt.arena);
+    free(city);
+    free(list.first);
+}
+
+static void
+test_log() {
+    // a log writes each record in one call and reads them back
+    int count = 10000;
+    StreamBuffer buf = {0};
+    uint8_t bytes [8];
+    Blob blob = {.bytes = bytes, .count_bytes = sizeof(bytes)};
+
+    IntroCityLog * log = intro_city_log_create(ITYPE(Blob), stream_write, &buf);
+    assert(log != NULL);
+    for (int i=0; i < count; i++) {
+        memset(bytes, i & 0xff, sizeof(bytes));
+        blob.count_bytes = 1 + i % sizeof(bytes);
+        bool ok = intro_city_log_append(log, &blob);
+        assert(ok);
+    }
+    size_t unclosed_size = buf.size;
+    bool closed = intro_city_log_close(log);
+    assert(closed);
+    assert(buf.count_writes == 2 + count);
+
+    for (int validate=0; validate < 2; validate++) {
+        IntroLoadOptions opt = {0};
+        opt.arena = intro_create_arena();
+        opt.validate = validate;
+        IntroCity * city = intro_city_open(buf.data, buf.size, &opt);
+        assert(city != NULL);
+        Blob loaded;
+        assert(intro_city_load(city, &loaded, ITYPE(Blob)) < 0);
+        int count_loaded = 0;
+        int ret;
+        while ((ret = intro_city_log_next(city, &loaded, ITYPE(Blob))) == 1) {
+            assert(loaded.count_bytes == 1 + count_loaded % sizeof(bytes));
+            assert(loaded.bytes[loaded.count_bytes - 1] == (count_loaded & 0xff));
+            count_loaded++;
+        }
+        assert(ret == 0);
+        assert(count_loaded == count);
+        intro_city_close(city);
+        intro_free_arena(opt.arena);
+    }
+
+    // records are found through the index, or by scanning a log that was never closed
+    for (int closed=0; closed < 2; closed++) {
+        IntroLoadOptions opt = {0};
+        opt.arena = intro_create_arena();
+        IntroCity * city = intro_city_open(buf.data, (closed)? buf.size : unclosed_size, &opt);
+        assert(city != NULL);
+        assert(intro_city_count(city) == count);
+        uint32_t state = 1;
+        for (int i=0; i < 1000; i++) {
+            state = state * 1664525 + 1013904223;
+            int index = (i == 0)? count - 1 : state % count;
+            Blob loaded;
+            int ret = intro_city_load_index(city, index, &loaded, ITYPE(Blob));
+            assert(ret == 0);
+            assert(loaded.count_bytes == 1 + index % sizeof(bytes));
+            assert(loaded.bytes[0] == (index & 0xff));
+        }
+        Blob loaded;
+        assert(intro_city_load_index(city, count, &loaded, ITYPE(Blob)) < 0);
+        intro_city_close(city);
+        intro_free_arena(opt.arena);
+    }
+
+    // a record cut short by a failed append is an error, not the end of the log
+    IntroCity * city = intro_city_open(buf.data, unclosed_size - 1, NULL);
+    assert(city != NULL);
+    Blob loaded;
+    int ret;
+    int count_loaded = 0;
+    while ((ret = intro_city_log_next(city, &loaded, ITYPE(Blob))) == 1) {
+        free(loaded.bytes);
+        count_loaded++;
+    }
+    assert(ret < 0 && count_loaded == count - 1);
+    intro_city_close(city);
+    free(buf.data);
+
+    // elements of a root array member are at fixed offsets
+    Records src;
+    src.count_records = count;
+    src.records = calloc(count, sizeof(src.records[0]));
+    for (int i=0; i < count; i++) src.records[i].id = i;
+    size_t size;
+    void * data = intro_create_city(&src, ITYPE(Records), &size);
+    city = intro_city_open(data, size, NULL);
+    assert(intro_city_count(city) == count);
+    Record record;
+    assert(intro_city_load_index(city, 4321, &record, ITYPE(Record)) == 0);
+    assert(record.id == 4321);
+    assert(intro_city_load_index(city, count, &record, ITYPE(Record)) < 0);
+    intro_city_close(city);
+    free(data);
+    free(src.records);
+}
+
+static void
+test_schemas() {
+    // small files can share one schema
+    {
+        Record record = {.id = 7, .weight = 1.5};
+        size_t full_size, shared_size, schema_size;
+        void * full = intro_create_city(&record, ITYPE(Record), &full_size);
+        void * shared = intro_create_city_shared(&record, ITYPE(Record), &shared_size);
+        void * schema = intro_create_city_schema(ITYPE(Record), &schema_size);
+        assert(full && shared && schema);
+        assert(shared_size < full_size);
+
+        // the same type doesn't need the schema
+        Record loaded_record;
+        assert(0 == intro_load_city(&loaded_record, ITYPE(Record), shared, shared_size));
+        assert(loaded_record.id == 7);
+
+        intro_city_clear_schema_cache();
+        RecordPart part;
+        assert(0 > intro_load_city(&part, ITYPE(RecordPart), shared, shared_size));
+        assert(0 > intro_load_city(&part, ITYPE(RecordPart), schema, schema_size));
+        assert(intro_city_register_schema(schema, schema_size));
+        memset(&part, 0, sizeof(part));
+        assert(0 == intro_load_city(&part, ITYPE(RecordPart), shared, shared_size));
+        assert(part.id == 7 && part.weight == 1.5);
+        memset(&part, 0, sizeof(part));
+        assert(0 == intro_load_city(&part, ITYPE(RecordPart), full, full_size));
+        assert(part.id == 7 && part.weight == 1.5);
+
+        intro_city_clear_schema_cache();
+        free(full);
+        free(shared);
+        free(schema);
+    }
+
+    // registered types are only used for files with the same pointer width
+    {
+        int counts [2] = {3, 20000};
+        void * full [2];
+        void * shared [2];
+        size_t full_size [2], shared_size [2], schema_size;
+        void * schema = intro_create_city_schema(ITYPE(Records), &schema_size);
+
+        // a schema has no records to count
+        IntroCity * schema_city = intro_city_open(schema, schema_size, NULL);
+        assert(schema_city != NULL);
+        assert(intro_city_count(schema_city) < 0);
+        Record schema_record;
+        assert(0 > intro_city_load_index(schema_city, 0, &schema_record, ITYPE(Record)));
+        intro_city_close(schema_city);
+        for (int f=0; f < 2; f++) {
+            Records src;
+            src.count_records = counts[f];
+            src.records = calloc(counts[f], sizeof(src.records[0]));
+            for (int i=0; i < counts[f]; i++) src.records[i].id = i;
+            full[f] = intro_create_city(&src, ITYPE(Records), &full_size[f]);
+            shared[f] = intro_create_city_shared(&src, ITYPE(Records), &shared_size[f]);
+            assert(full[f] && shared[f]);
+            free(src.records);
+        }
+
+        intro_city_clear_schema_cache();
+        for (int f=0; f < 2; f++) {
+            RecordsSwapped loaded;
+            assert(0 == intro_load_city(&loaded, ITYPE(RecordsSwapped), full[f], full_size[f]));
+            assert(loaded.count_records == counts[f]);
+            assert(loaded.records[counts[f] - 1].id == counts[f] - 1);
+            free(loaded.records);
+
+            IntroCity * city = intro_city_open(full[f], full_size[f], NULL);
+            assert(intro_city_count(city) == counts[f]);
+            Record record;
+            assert(0 == intro_city_load_index(city, counts[f] - 1, &record, ITYPE(Record)));
+            assert(record.id == counts[f] - 1);
+            intro_city_close(city);
+        }
+
+        // the schema is read again for each pointer width of the shared files
+        intro_city_clear_schema_cache();
+        assert(intro_city_register_schema(schema, schema_size));
+        for (int f=0; f < 2; f++) {
+            RecordsSwapped loaded;
+            assert(0 == intro_load_city(&loaded, ITYPE(RecordsSwapped), shared[f], shared_size[f]));
+            assert(loaded.count_records == counts[f]);
+            assert(loaded.records[counts[f] - 1].id == counts[f] - 1);
+            free(loaded.records);
+        }
+
+        intro_city_clear_schema_cache();
+        for (int f=0; f < 2; f++) {
+            free(full[f]);
+            free(shared[f]);
+        }
+        free(schema);
+    }
+}
+
+static void
+test_lazy() {
+    // a lazy load only reads the root until a pointer is resolved
+    int count = 1000;
+    Records src;
+    src.count_records = count;
+    src.records = calloc(count, sizeof(src.records[0]));
+    for (int i=0; i < count; i++) src.records[i].id = i;
+    bool ok = intro_create_city_file("lazy.cty", &src, ITYPE(Records));
+    assert(ok);
+
+    IntroLoadOptions opt = {0};
+    opt.lazy = true;
+    Records loaded;
+    IntroCity * city = intro_city_open_file("lazy.cty", &opt);
+    assert(city != NULL);
+    int ret = intro_city_load(city, &loaded, ITYPE(Records));
+    assert(ret == 0);
+    assert(loaded.count_records == count);
+
+    Record * records = intro_city_resolve(city, &loaded.records);
+    assert(records != NULL && records == loaded.records);
+    assert(intro_city_resolve(city, &loaded.records) == records);
+    assert(records[count - 1].id == count - 1);
+    intro_city_close(city);
+
+    free(records);
+    free(src.records);
+}
+
 int
 main() {
     Basic obj_save;
@@ -247,6 +1029,7 @@ main() {
     const IntroMember * m = intro_member_by_name(ITYPE(BasicPlus), name);
     assert(m != NULL);
     assert(intro_has_attribute(m, cstring));
+    assert(m->name_hash == intro_name_hash("name"));
 
     CHECK_EQUAL(a);
     assert(obj_save.b == obj_load.b2);
@@ -299,5 +1082,271 @@ main() {
         assert(ABS(obj_load.stuffs[i].speed - 5.6) < 0.00001);
     }
 
+    // load single parts of the file by path
+    {
+        size_t city_size;
+        void * city_data = intro_read_file("obj.cty", &city_size);
+        assert(city_data != NULL);
+
+        StuffLoad stuff;
+        int ret = intro_city_load_path(city_data, city_size, "stuffs[1]", &stuff, ITYPE(StuffLoad));
+        assert(ret == 0);
+        assert(stuff.id == obj_save.stuffs[1].id);
+        assert(0==strcmp(stuff.name, obj_save.stuffs[1].name));
+        assert(stuff.hex == 0xFF56A420);
+
+        int32_t value;
+        char elem_char;
+        ret = intro_city_load_path(city_data, city_size, "#11.next.next.value", &value, ITYPE(int32_t));
+        assert(ret == 0 && value == 0);
+
+        ret = intro_city_load_path(city_data, city_size, "text.#1[4]", &elem_char, ITYPE(char));
+        assert(ret == 0 && elem_char == obj_save.text.buffer[4]);
+
+        uint8_t elem;
+        ret = intro_city_load_path(city_data, city_size, "array[3]", &elem, ITYPE(uint8_t));
+        assert(ret == 0 && elem == 9);
+
+        assert(0 > intro_city_load_path(city_data, city_size, "stuffs[5]", &stuff, ITYPE(StuffLoad)));
+        assert(0 > intro_city_load_path(city_data, city_size, "nothing", &value, ITYPE(int32_t)));
+        free(city_data);
+    }
+
+    // a delta only holds what changed and rebuilds the new data from the base
+    {
+        size_t delta_size;
+        void * delta = intro_city_diff(&obj_save, &obj_save, ITYPE(Basic), &delta_size);
+        assert(delta_size == 12);
+        free(delta);
+
+        Basic obj_new = obj_save;
+        obj_new.a = 26;
+        obj_new.count_numbers = 20;
+        obj_new.numbers = calloc(obj_new.count_numbers, sizeof(*obj_new.numbers));
+        memcpy(obj_new.numbers, obj_save.numbers, obj_save.count_numbers * sizeof(*obj_new.numbers));
+        obj_new.numbers[19] = 77;
+        obj_new.count_stuffs = 3;
+        obj_new.linked = obj_save.linked->next;
+        obj_new.selections[0] = (Selection){.which = SEL_STR, .str = "changed"};
+
+        delta = intro_city_diff(&obj_save, &obj_new, ITYPE(Basic), &delta_size);
+        size_t new_size;
+        void * new_city = intro_create_city(&obj_new, ITYPE(Basic), &new_size);
+        assert(delta != NULL && delta_size < new_size / 4);
+        free(new_city);
+
+        Basic obj_applied;
+        int ret = intro_city_apply_delta(&obj_applied, &obj_save, ITYPE(Basic), delta, delta_size);
+        assert(ret == 0);
+        assert(obj_applied.a == 26 && obj_applied.b == obj_save.b);
+        assert(0==strcmp(obj_applied.name, obj_save.name));
+        assert(obj_applied.count_numbers == 20);
+        assert(0==memcmp(obj_applied.numbers, obj_new.numbers, 20 * sizeof(*obj_new.numbers)));
+        assert(obj_applied.count_stuffs == 3);
+        assert(0==strcmp(obj_applied.stuffs[2].name, obj_save.stuffs[2].name));
+        assert(obj_applied.linked->value == 2 && obj_applied.linked->next->next->value == 1);
+        assert(obj_applied.linked->next->next->next == NULL);
+        assert(obj_applied.selections[0].which == SEL_STR && 0==strcmp(obj_applied.selections[0].str, "changed"));
+        assert(obj_applied.selections[3].float_value == obj_save.selections[3].float_value);
+        assert(obj_applied._internal == NULL);
+
+        // a delta that can't be applied leaves 'dest' as it was
+        Basic obj_before;
+        memset(&obj_applied, 0xab, sizeof(obj_applied));
+        memcpy(&obj_before, &obj_applied, sizeof(obj_applied));
+        assert(0 > intro_city_apply_delta(&obj_applied, &obj_save, ITYPE(Basic), delta, delta_size - 1));
+        uint8_t * bad_delta = malloc(delta_size + 16);
+        memcpy(bad_delta, delta, 12);
+        // a record that writes over the magic number of the City data
+        uint8_t records [] = {0, 0, 4, 'X', 'X', 'X', 'X'};
+        memcpy(bad_delta + 12, records, sizeof(records));
+        assert(0 > intro_city_apply_delta(&obj_applied, &obj_save, ITYPE(Basic), bad_delta, 12 + sizeof(records)));
+        assert(0==memcmp(&obj_applied, &obj_before, sizeof(obj_applied)));
+        free(bad_delta);
+        free(delta);
+        free(obj_new.numbers);
+    }
+
+    // a file claiming the schema hash of other types doesn't change how files with those types are read
+    {
+        StuffSave stuff = {.id = 5, .name = "five"};
+        DynArrayHeader other = {.count = 6, .cap = 7};
+        size_t stuff_size, other_size;
+        uint8_t * stuff_city = intro_create_city(&stuff, ITYPE(StuffSave), &stuff_size);
+        uint8_t * other_city = intro_create_city(&other, ITYPE(DynArrayHeader), &other_size);
+        assert(stuff_city && other_city);
+        // the schema hash is at offset 20 of the header
+        memcpy(other_city + 20, stuff_city + 20, 8);
+
+        DynArrayHeader other_load;
+        assert(0 == intro_load_city(&other_load, ITYPE(DynArrayHeader), other_city, other_size));
+        assert(other_load.count == 6 && other_load.cap == 7);
+        StuffLoad stuff_load;
+        assert(0 == intro_load_city(&stuff_load, ITYPE(StuffLoad), stuff_city, stuff_size));
+        assert(stuff_load.id == 5 && 0==strcmp(stuff_load.name, "five"));
+        free(stuff_city);
+        free(other_city);
+    }
+
+    // lengths behind a header are not read through NULL pointers
+    {
+        DynItem items [3] = {0};
+        DynArrayHeader * header = malloc(sizeof(*header) + 4 * sizeof(int));
+        header->count = 3;
+        header->cap = 4;
+        int * values = (int *)(header + 1);
+        values[0] = 7; values[1] = 8; values[2] = 9;
+        for (int i=0; i < 3; i++) items[i].id = i;
+        items[1].values = values;
+        DynRoot root = {.items = items, .count_items = 3};
+
+        size_t size;
+        void * data = intro_create_city(&root, ITYPE(DynRoot), &size);
+        assert(data != NULL);
+        DynRoot root_load;
+        assert(0 == intro_load_city(&root_load, ITYPE(DynRoot), data, size));
+        assert(root_load.count_items == 3);
+        assert(root_load.items[0].values == NULL && root_load.items[2].values == NULL);
+        assert(0==memcmp(root_load.items[1].values, values, 3 * sizeof(int)));
+        free(data);
+
+        char * json = malloc(1 << 12);
+        intro_sprint_json_x(INTRO_CTX, json, &root, ITYPE(DynRoot), NULL);
+        assert(strstr(json, "null") != NULL);
+        assert(strstr(json, "7, 8, 9") != NULL);
+        free(json);
+        free(header);
+    }
+
+    // a file written by version 0.5, which has no name hashes, is still read
+    {
+        size_t old_size;
+        void * old_city = intro_read_file("data/obj_v0_5.cty", &old_size);
+        assert(old_city != NULL);
+        uint16_t version_minor;
+        memcpy(&version_minor, (uint8_t *)old_city + 6, 2);
+        assert(version_minor == 5);
+
+        BasicPlus old_load;
+        IntroLoadOptions opt = {0};
+        opt.validate = true;
+        opt.arena = intro_create_arena();
+        assert(0 == intro_load_city_opt(&old_load, ITYPE(BasicPlus), old_city, old_size, &opt));
+        assert(old_load.a == obj_save.a && old_load.b2 == obj_save.b);
+        assert(0==strcmp(old_load.name, obj_save.name));
+        assert(old_load.count_numbers == obj_save.count_numbers);
+        assert(0==memcmp(old_load.numbers, obj_save.numbers, obj_save.count_numbers * sizeof(obj_save.numbers[0])));
+        assert(0==strcmp(old_load.long_member_name_that_would_take_up_a_great_deal_of_space_in_a_city_file,
+                         obj_save.long_member_name_that_would_take_up_a_great_deal_of_space_in_a_city_file));
+        assert(0==strcmp(old_load.selections[2].str, obj_save.selections[2].str));
+        assert(old_load.linked->next->value == obj_save.linked->next->value);
+        intro_free_arena(opt.arena);
+        free(old_city);
+    }
+
+    // a name hash that doesn't match its name is rejected when validating
+    {
+        size_t new_size;
+        uint8_t * new_city = (uint8_t *)intro_read_file("obj.cty", &new_size);
+        assert(new_city != NULL);
+        uint32_t data_ptr, hash = intro_name_hash("count_numbers");
+        memcpy(&data_ptr, new_city + 12, 4);
+        uint8_t * found = NULL;
+        for (uint32_t i=0; i + 4 <= data_ptr && !found; i++) {
+            if (0==memcmp(new_city + i, &hash, 4)) found = new_city + i;
+        }
+        assert(found != NULL);
+        found[0] ^= 1;
+
+        BasicPlus bad_load;
+        IntroLoadOptions opt = {0};
+        opt.validate = true;
+        opt.arena = intro_create_arena();
+        int count_errors = 0;
+        intro_city_set_error_proc(count_error, &count_errors);
+        assert(0 != intro_load_city_opt(&bad_load, ITYPE(BasicPlus), new_city, new_size, &opt));
+        intro_city_set_error_proc(NULL, NULL);
+        assert(count_errors > 0);
+        intro_free_arena(opt.arena);
+        free(new_city);
+    }
+
+    // native files are used where they are mapped
+    create_success = intro_create_city_native_file("obj_native.cty", &obj_save, ITYPE(Basic));
+    assert(create_success);
+
+    IntroCityMap map;
+    assert(NULL == intro_map_city_file("obj_native.cty", ITYPE(BasicPlus), &map));
+
+    Basic * obj_mapped = intro_map_city_file("obj_native.cty", ITYPE(Basic), &map);
+    assert(obj_mapped != NULL);
+    assert(0==strcmp(obj_mapped->name, obj_save.name));
+    assert(obj_mapped->b == obj_save.b);
+    assert(0==memcmp(obj_mapped->array, obj_save.array, sizeof(obj_save.array)));
+    assert(0==memcmp(obj_mapped->numbers, obj_save.numbers, obj_save.count_numbers * sizeof(obj_save.numbers[0])));
+    assert(0==strcmp(obj_mapped->text.buffer, obj_save.text.buffer));
+    assert(obj_mapped->_internal == NULL);
+    assert(obj_mapped->stuffs[4].name == NULL);
+    assert(0==strcmp(obj_mapped->stuffs[1].name, obj_save.stuffs[1].name));
+    assert(obj_mapped->linked->next->next->value == 0);
+    assert(0==strcmp(obj_mapped->selections[2].str, obj_save.selections[2].str));
+    assert(obj_mapped->selections[3].float_value == obj_save.selections[3].float_value);
+    intro_unmap_city_file(&map);
+
+    // a relocation table that doesn't list exactly the pointers is rejected
+    {
+        size_t native_size;
+        void * native = intro_read_file("obj_native.cty", &native_size);
+        assert(native != NULL);
+        uint32_t data_ptr;
+        memcpy(&data_ptr, (uint8_t *)native + 12, 4);
+        uint8_t * copy = aligned_alloc(16, (native_size + 15) & ~(size_t)15);
+        uint64_t count_relocs, location;
+        memcpy(&count_relocs, (uint8_t *)native + native_size - 8, 8);
+        size_t table_pos = native_size - 8 - count_relocs * 8;
+        assert(count_relocs > 1);
+
+        memcpy(copy, native, native_size);
+        assert(NULL != intro_load_city_in_place(copy, native_size, ITYPE(Basic)));
+
+        // a relocated location that isn't a pointer
+        memcpy(copy, native, native_size);
+        location = offsetof(Basic, b);
+        memcpy(copy + table_pos, &location, 8);
+        assert(NULL == intro_load_city_in_place(copy, native_size, ITYPE(Basic)));
+
+        // the same pointer twice, so another one is left as an offset
+        memcpy(copy, native, native_size);
+        memcpy(copy + table_pos, copy + table_pos + 8, 8);
+        assert(NULL == intro_load_city_in_place(copy, native_size, ITYPE(Basic)));
+
+        // a pointer left out, the table then starts one entry later
+        memcpy(copy, native, native_size);
+        uint64_t fewer_relocs = count_relocs - 1;
+        memcpy(copy + native_size - 8, &fewer_relocs, 8);
+        assert(NULL == intro_load_city_in_place(copy, native_size, ITYPE(Basic)));
+
+        // a pointer to a buffer whose length reaches into the table
+        memcpy(copy, native, native_size);
+        uint64_t numbers_offset;
+        memcpy(&numbers_offset, copy + data_ptr + offsetof(Basic, numbers), 8);
+        uint32_t long_length = 1000;
+        memcpy(copy + data_ptr + numbers_offset - 4, &long_length, 4);
+        assert(NULL == intro_load_city_in_place(copy, native_size, ITYPE(Basic)));
+
+        free(copy);
+        free(native);
+    }
+
+    test_lists();
+    test_large_blob();
+    test_parallel();
+    test_compressed();
+    test_delta();
+    test_validate();
+    test_log();
+    test_schemas();
+    test_lazy();
+
     return 0;
 }
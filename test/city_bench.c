@@ -0,0 +1,457 @@
+#ifndef __INTRO__
+#include "basic.h"
+#include <time.h>
+#endif
+
+#include "../lib/intro.h"
+
+typedef struct BenchNode BenchNode;
+
+struct BenchNode {
+    BenchNode * next;
+    int value;
+};
+
+typedef struct {
+    BenchNode * first;
+    int32_t count_nodes;
+} BenchList;
+
+typedef struct {
+    uint8_t * bytes I(length count_bytes);
+    uint32_t count_bytes;
+} BenchBlob;
+
+typedef struct {
+    int32_t id;
+    float position [3];
+    uint16_t flags;
+    double weight;
+    struct {
+        uint8_t r, g, b, a;
+    } color;
+} BenchRecord;
+
+// BenchRecord with fewer members in a different order, so its schema hash is different
+typedef struct {
+    double weight;
+    int32_t id;
+} BenchRecordPart;
+
+typedef struct {
+    BenchRecord * records I(length count_records);
+    int32_t count_records;
+} BenchRecords;
+
+typedef struct {
+    BenchBlob * blobs I(length count_blobs);
+    int32_t count_blobs;
+} BenchBlobs;
+
+// BenchBlob reordered with a member the file doesn't have
+typedef struct {
+    uint32_t count_bytes;
+    int32_t version I(fallback 3);
+    uint8_t * bytes I(length count_bytes);
+} BenchBlobNext;
+
+typedef struct {
+    int32_t count_blobs;
+    BenchBlobNext * blobs I(length count_blobs);
+} BenchBlobsNext;
+
+#include "city_bench.c.intro"
+
+static double
+time_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static BenchNode *
+create_nodes(int count) {
+    BenchNode * nodes = calloc(count, sizeof(*nodes));
+    for (int i=0; i < count; i++) {
+        nodes[i].value = i;
+        nodes[i].next = (i + 1 < count)? &nodes[i + 1] : NULL;
+    }
+    return nodes;
+}
+
+typedef struct {
+    uint8_t * data;
+    size_t size;
+    size_t capacity;
+    int count_writes;
+} StreamBuffer;
+
+static bool
+stream_write(void * user, const void * data, size_t size) {
+    StreamBuffer * buf = user;
+    if (buf->size + size > buf->capacity) {
+        buf->capacity = (buf->size + size) * 2;
+        buf->data = realloc(buf->data, buf->capacity);
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+    buf->count_writes += 1;
+    return true;
+}
+
+static double
+bench_list(int count) {
+    BenchNode * nodes = create_nodes(count);
+    BenchList list = {.first = nodes, .count_nodes = count};
+
+    double start = time_seconds();
+    size_t size;
+    void * city = intro_create_city(&list, ITYPE(BenchList), &size);
+    double elapsed = time_seconds() - start;
+
+    // every node must be serialized exactly once: ptr (3) + int (4) + length header (4)
+    assert(city != NULL);
+    assert(size > (size_t)count * 11);
+    assert(size < (size_t)count * 11 + 256);
+
+    free(city);
+    free(nodes);
+    return elapsed;
+}
+
+static double
+bench_load_records(int count) {
+    BenchRecords src;
+    src.count_records = count;
+    src.records = calloc(count, sizeof(src.records[0]));
+    for (int i=0; i < count; i++) {
+        BenchRecord * r = &src.records[i];
+        r->id = i;
+        r->position[0] = i * 0.5f;
+        r->position[2] = -i;
+        r->flags = i & 0xffff;
+        r->weight = i * 0.25;
+        r->color.g = i & 0xff;
+    }
+
+    size_t size;
+    void * city = intro_create_city(&src, ITYPE(BenchRecords), &size);
+
+    BenchRecords loaded;
+    double start = time_seconds();
+    int ret = intro_load_city(&loaded, ITYPE(BenchRecords), city, size);
+    double elapsed = time_seconds() - start;
+
+    assert(ret == 0);
+    assert(loaded.count_records == count);
+    for (int i=0; i < count; i += 997) {
+        assert(loaded.records[i].id == i);
+        assert(loaded.records[i].position[2] == -i);
+        assert(loaded.records[i].weight == i * 0.25);
+        assert(loaded.records[i].color.g == (i & 0xff));
+    }
+
+    free(loaded.records);
+    free(city);
+    free(src.records);
+    return elapsed;
+}
+
+int
+main() {
+    double last = 0;
+    for (int count = 12500; count <= 100000; count *= 2) {
+        double elapsed = bench_list(count);
+        printf("serialize %6i nodes: %8.3f ms", count, elapsed * 1000.0);
+        if (last > 0) {
+            printf("  (x%.2f)", elapsed / last);
+        }
+        printf("\n");
+        last = elapsed;
+    }
+
+    double elapsed = bench_load_records(100000);
+    printf("load 100000 records: %8.3f ms\n", elapsed * 1000.0);
+
+    // serial and parallel writes and loads
+    {
+        int count = 1000000;
+        BenchRecords src;
+        src.count_records = count;
+        src.records = calloc(count, sizeof(src.records[0]));
+        for (int i=0; i < count; i++) {
+            src.records[i].id = i;
+            src.records[i].weight = i * 0.5;
+            src.records[i].color.r = i & 0xff;
+        }
+
+        size_t serial_size, parallel_size;
+        double start = time_seconds();
+        void * serial = intro_create_city(&src, ITYPE(BenchRecords), &serial_size);
+        double serial_elapsed = time_seconds() - start;
+        start = time_seconds();
+        void * parallel = intro_create_city_parallel(&src, ITYPE(BenchRecords), &parallel_size, 4);
+        double parallel_elapsed = time_seconds() - start;
+        assert(serial != NULL && parallel != NULL);
+        printf("serialize 1000000 records: %8.3f ms, parallel: %8.3f ms\n", serial_elapsed * 1000.0, parallel_elapsed * 1000.0);
+
+        BenchRecords loaded;
+        start = time_seconds();
+        int ret = intro_load_city(&loaded, ITYPE(BenchRecords), serial, serial_size);
+        serial_elapsed = time_seconds() - start;
+        assert(ret == 0);
+        free(loaded.records);
+
+        IntroLoadOptions opt = {0};
+        opt.count_threads = 4;
+        start = time_seconds();
+        ret = intro_load_city_opt(&loaded, ITYPE(BenchRecords), serial, serial_size, &opt);
+        parallel_elapsed = time_seconds() - start;
+        assert(ret == 0);
+        printf("load 1000000 records: %8.3f ms, parallel: %8.3f ms\n", serial_elapsed * 1000.0, parallel_elapsed * 1000.0);
+        free(loaded.records);
+
+        // elements with pointers, a different layout and fallbacks
+        int count_blobs = 200000;
+        BenchBlobs blobs;
+        blobs.count_blobs = count_blobs;
+        blobs.blobs = calloc(count_blobs, sizeof(blobs.blobs[0]));
+        uint8_t bytes [16];
+        for (int i=0; i < (int)sizeof(bytes); i++) bytes[i] = i * 3;
+        for (int i=0; i < count_blobs; i++) {
+            blobs.blobs[i].bytes = bytes;
+            blobs.blobs[i].count_bytes = 1 + i % sizeof(bytes);
+        }
+        size_t blobs_size;
+        void * blobs_city = intro_create_city(&blobs, ITYPE(BenchBlobs), &blobs_size);
+        assert(blobs_city != NULL);
+
+        for (int mode=0; mode < 3; mode++) {
+            BenchBlobsNext loaded_blobs;
+            memset(&opt, 0, sizeof(opt));
+            opt.count_threads = (mode == 0)? 1 : 4;
+            if (mode == 2) opt.arena = intro_create_arena();
+            opt.validate = true;
+            start = time_seconds();
+            ret = intro_load_city_opt(&loaded_blobs, ITYPE(BenchBlobsNext), blobs_city, blobs_size, &opt);
+            double elapsed = time_seconds() - start;
+            assert(ret == 0);
+            if (opt.arena) {
+                intro_free_arena(opt.arena);
+            } else {
+                for (int i=0; i < count_blobs; i++) free(loaded_blobs.blobs[i].bytes);
+                free(loaded_blobs.blobs);
+            }
+            const char * mode_names [] = {"serial", "parallel", "parallel, arena"};
+            printf("load %i converted blobs (%s): %8.3f ms\n", count_blobs, mode_names[mode], elapsed * 1000.0);
+        }
+        free(blobs_city);
+        free(blobs.blobs);
+
+        free(parallel);
+        free(serial);
+        free(src.records);
+    }
+
+    // compression
+    {
+        int count = 100000;
+        BenchRecords src;
+        src.count_records = count;
+        src.records = calloc(count, sizeof(src.records[0]));
+        for (int i=0; i < count; i++) {
+            src.records[i].id = i;
+            src.records[i].flags = (i % 3 == 0);
+            src.records[i].color.a = 255;
+        }
+
+        size_t raw_size, size;
+        void * raw = intro_create_city(&src, ITYPE(BenchRecords), &raw_size);
+        double start = time_seconds();
+        uint8_t * city = intro_create_city_compressed(&src, ITYPE(BenchRecords), &size);
+        double compress_elapsed = time_seconds() - start;
+        assert(city != NULL);
+
+        BenchRecords loaded;
+        start = time_seconds();
+        int ret = intro_load_city(&loaded, ITYPE(BenchRecords), city, size);
+        double load_elapsed = time_seconds() - start;
+        assert(ret == 0);
+        free(loaded.records);
+
+        printf("compress %zu -> %zu bytes: %8.3f ms, load: %8.3f ms\n", raw_size, size, compress_elapsed * 1000.0, load_elapsed * 1000.0);
+        free(city);
+        free(raw);
+        free(src.records);
+    }
+
+    // a delta of a few changed records
+    {
+        int count = 100000;
+        BenchRecords base, next;
+        base.count_records = next.count_records = count;
+        base.records = calloc(count, sizeof(base.records[0]));
+        next.records = calloc(count, sizeof(next.records[0]));
+        for (int i=0; i < count; i++) base.records[i].id = i;
+        memcpy(next.records, base.records, count * sizeof(base.records[0]));
+        for (int i=0; i < count; i += 1000) next.records[i].weight = 1.5;
+
+        size_t delta_size;
+        double start = time_seconds();
+        void * delta = intro_city_diff(&base, &next, ITYPE(BenchRecords), &delta_size);
+        double diff_elapsed = time_seconds() - start;
+        assert(delta != NULL);
+
+        BenchRecords applied;
+        start = time_seconds();
+        int ret = intro_city_apply_delta(&applied, &base, ITYPE(BenchRecords), delta, delta_size);
+        double apply_elapsed = time_seconds() - start;
+        assert(ret == 0);
+        printf("delta of 100 changes: %zu bytes, diff: %8.3f ms, apply: %8.3f ms\n", delta_size, diff_elapsed * 1000.0, apply_elapsed * 1000.0);
+
+        free(applied.records);
+        free(delta);
+        free(next.records);
+        free(base.records);
+    }
+
+    // the cost of validating a large valid file
+    {
+        int count = 100000;
+        BenchRecords records;
+        records.count_records = count;
+        records.records = calloc(count, sizeof(records.records[0]));
+        size_t size;
+        void * city = intro_create_city(&records, ITYPE(BenchRecords), &size);
+        assert(intro_city_set_checksum(city, size));
+
+        double elapsed [2];
+        for (int validate=0; validate < 2; validate++) {
+            IntroLoadOptions opt = {0};
+            opt.arena = intro_create_arena();
+            opt.validate = validate;
+            BenchRecords loaded;
+            double start = time_seconds();
+            int ret = intro_load_city_opt(&loaded, ITYPE(BenchRecords), city, size, &opt);
+            elapsed[validate] = time_seconds() - start;
+            assert(ret == 0);
+            intro_free_arena(opt.arena);
+        }
+        printf("load 100000 records: %8.3f ms, validated: %8.3f ms\n", elapsed[0] * 1000.0, elapsed[1] * 1000.0);
+
+        free(city);
+        free(records.records);
+    }
+
+    // appending to a log, reading it in order and by index
+    {
+        int count = 100000;
+        StreamBuffer buf = {0};
+        uint8_t bytes [8];
+        BenchBlob blob = {.bytes = bytes, .count_bytes = sizeof(bytes)};
+
+        double start = time_seconds();
+        IntroCityLog * log = intro_city_log_create(ITYPE(BenchBlob), stream_write, &buf);
+        assert(log != NULL);
+        for (int i=0; i < count; i++) {
+            memset(bytes, i & 0xff, sizeof(bytes));
+            blob.count_bytes = 1 + i % sizeof(bytes);
+            bool ok = intro_city_log_append(log, &blob);
+            assert(ok);
+        }
+        size_t unclosed_size = buf.size;
+        bool closed = intro_city_log_close(log);
+        assert(closed);
+        double append_elapsed = time_seconds() - start;
+
+        IntroLoadOptions opt = {0};
+        opt.arena = intro_create_arena();
+        start = time_seconds();
+        IntroCity * city = intro_city_open(buf.data, buf.size, &opt);
+        assert(city != NULL);
+        BenchBlob loaded;
+        int count_loaded = 0;
+        while (intro_city_log_next(city, &loaded, ITYPE(BenchBlob)) == 1) count_loaded++;
+        double read_elapsed = time_seconds() - start;
+        assert(count_loaded == count);
+        intro_city_close(city);
+        intro_free_arena(opt.arena);
+        printf("log of %i records: append: %8.3f ms, read: %8.3f ms\n", count, append_elapsed * 1000.0, read_elapsed * 1000.0);
+
+        for (int closed=0; closed < 2; closed++) {
+            opt.arena = intro_create_arena();
+            city = intro_city_open(buf.data, (closed)? buf.size : unclosed_size, &opt);
+            assert(city != NULL);
+            start = time_seconds();
+            assert(intro_city_count(city) == count);
+            uint32_t state = 1;
+            for (int i=0; i < 1000; i++) {
+                state = state * 1664525 + 1013904223;
+                int ret = intro_city_load_index(city, state % count, &loaded, ITYPE(BenchBlob));
+                assert(ret == 0);
+            }
+            double index_elapsed = time_seconds() - start;
+            intro_city_close(city);
+            intro_free_arena(opt.arena);
+            printf("log load 1000 records by index (%s): %8.3f ms\n", (closed)? "index" : "scan", index_elapsed * 1000.0);
+        }
+        free(buf.data);
+    }
+
+    // loading many small files with and without a registered schema
+    {
+        int count = 10000;
+        BenchRecord record = {.id = 7, .weight = 1.5};
+        size_t full_size, shared_size, schema_size;
+        void * full = intro_create_city(&record, ITYPE(BenchRecord), &full_size);
+        void * shared = intro_create_city_shared(&record, ITYPE(BenchRecord), &shared_size);
+        void * schema = intro_create_city_schema(ITYPE(BenchRecord), &schema_size);
+        assert(full && shared && schema);
+
+        BenchRecordPart part;
+        double elapsed [2];
+        for (int cached=0; cached < 2; cached++) {
+            intro_city_clear_schema_cache();
+            if (cached) assert(intro_city_register_schema(schema, schema_size));
+            double start = time_seconds();
+            for (int i=0; i < count; i++) {
+                int ret = intro_load_city(&part, ITYPE(BenchRecordPart), full, full_size);
+                assert(ret == 0);
+            }
+            elapsed[cached] = time_seconds() - start;
+        }
+        printf("file size: %zu, shared: %zu (schema: %zu)\n", full_size, shared_size, schema_size);
+        printf("load %i converted files: %8.3f ms, cached types: %8.3f ms\n", count, elapsed[0] * 1000.0, elapsed[1] * 1000.0);
+
+        intro_city_clear_schema_cache();
+        free(full);
+        free(shared);
+        free(schema);
+    }
+
+    // a lazy load only reads the root until a pointer is resolved
+    {
+        int count = 100000;
+        BenchRecords src;
+        src.count_records = count;
+        src.records = calloc(count, sizeof(src.records[0]));
+        bool ok = intro_create_city_file("bench_lazy.cty", &src, ITYPE(BenchRecords));
+        assert(ok);
+
+        IntroLoadOptions opt = {0};
+        opt.lazy = true;
+        BenchRecords loaded;
+        double start = time_seconds();
+        IntroCity * city = intro_city_open_file("bench_lazy.cty", &opt);
+        assert(city != NULL);
+        int ret = intro_city_load(city, &loaded, ITYPE(BenchRecords));
+        double open_elapsed = time_seconds() - start;
+        assert(ret == 0);
+        intro_city_close(city);
+        printf("lazy open and load root: %8.3f ms\n", open_elapsed * 1000.0);
+
+        free(src.records);
+    }
+
+    return 0;
+}
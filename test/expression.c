@@ -35,8 +35,28 @@ typedef struct {
     bool ready I(when stat.hp >= 0); // 4
 
     bool test0 I(when .stat.hp * 15 - 3); // 5
+    bool test1 I(when .stat.hp * 16 + (3 << 2) - 12); // 6
+    uint8_t * fixed I(length 2 * 4 - (1 ? 3 : 5)); // 7
+
+    // integer divisions that trap must not be folded by the parser
+    uint8_t * overflow I(length (-9223372036854775807 - 1) / -1); // 8
+    uint8_t * overflow_mod I(length (-9223372036854775807 - 1) % -1); // 9
+    uint8_t * mod_zero I(length 7 % (1 - 1)); // 10
+    bool halved I(when (-9223372036854775807 - 1) / 2 == -4611686018427387904); // 11
 } AttrTest;
 
+typedef struct {
+    int kind;
+    int64_t delta;
+    union {
+        int   as_int   I(when <-kind == 1);
+        float as_float I(when <-kind == 2);
+        char  as_char  I(when <-kind != 1 && <-kind != 2);
+    };
+    bool behind I(when delta < -1);
+    bool level  I(when delta >= -1 && delta <= 1);
+} Variant;
+
 #include "expression.c.intro"
 
 int
@@ -66,6 +86,71 @@ main() {
     assert(intro_attribute_expr_x(INTRO_CTX, intro_push(&cntr, 4),      IATTR_when, &value) && value == 1);
     assert(intro_attribute_expr_x(INTRO_CTX, intro_push(&stat_cntr, 0), IATTR_when, &value) && value == 0);
     assert(intro_attribute_expr_x(INTRO_CTX, intro_push(&cntr, 5),      IATTR_when, &value) && value == (test.stat.hp * 15 - 3));
+    assert(intro_attribute_expr_x(INTRO_CTX, intro_push(&cntr, 6),      IATTR_when, &value) && value == test.stat.hp * 16);
+    assert(intro_attribute_length(intro_push(&cntr, 7), &value) && value == 5);
+    for (int mi=8; mi <= 10; mi++) {
+        assert(intro_has_attribute_x(INTRO_CTX, ITYPE(AttrTest)->members[mi].attr, IATTR_length));
+    }
+    assert(intro_attribute_expr_x(INTRO_CTX, intro_push(&cntr, 11), IATTR_when, &value) && value == 1);
+
+    Variant v = {0};
+    IntroContainer v_cntr = intro_cntr(&v, ITYPE(Variant));
+    IntroContainer u_cntr = intro_push(&v_cntr, 2);
+    v.kind = 2;
+    v.delta = -5;
+    assert(intro_attribute_expr_x(INTRO_CTX, intro_push(&u_cntr, 0), IATTR_when, &value) && value == 0);
+    assert(intro_attribute_expr_x(INTRO_CTX, intro_push(&u_cntr, 1), IATTR_when, &value) && value == 1);
+    assert(intro_attribute_expr_x(INTRO_CTX, intro_push(&u_cntr, 2), IATTR_when, &value) && value == 0);
+    assert(intro_attribute_expr_x(INTRO_CTX, intro_push(&v_cntr, 3), IATTR_when, &value) && value == 1);
+    assert(intro_attribute_expr_x(INTRO_CTX, intro_push(&v_cntr, 4), IATTR_when, &value) && value == 0);
+    v.kind = 7;
+    v.delta = -1;
+    assert(intro_attribute_expr_x(INTRO_CTX, intro_push(&u_cntr, 2), IATTR_when, &value) && value == 1);
+    assert(intro_attribute_expr_x(INTRO_CTX, intro_push(&v_cntr, 3), IATTR_when, &value) && value == 0);
+    assert(intro_attribute_expr_x(INTRO_CTX, intro_push(&v_cntr, 4), IATTR_when, &value) && value == 1);
+
+    // 'when' of every union member selects exactly one, with the generated functions and with the bytecode
+    assert(INTRO_CTX->expr_funcs != NULL);
+    IntroContext vm_ctx = *INTRO_CTX;
+    vm_ctx.expr_funcs = NULL;
+    IntroContext * contexts [] = {INTRO_CTX, &vm_ctx};
+
+    const int count_variants = 1000;
+    Variant * variants = malloc(count_variants * sizeof(*variants));
+    for (int i=0; i < count_variants; i++) {
+        variants[i].kind = i % 3;
+        variants[i].delta = 0;
+    }
+    for (int ctx_i=0; ctx_i < LENGTH(contexts); ctx_i++) {
+        int64_t selected = 0;
+        for (int i=0; i < count_variants; i++) {
+            IntroContainer elem = intro_cntr(&variants[i], ITYPE(Variant));
+            IntroContainer u = intro_push(&elem, 2);
+            for (int mi=0; mi < 3; mi++) {
+                intro_attribute_expr_x(contexts[ctx_i], intro_push(&u, mi), IATTR_when, &value);
+                selected += value;
+            }
+        }
+        assert(selected == count_variants);
+    }
+
+    // the same with one batch per union member
+    int64_t * results = malloc(count_variants * sizeof(*results));
+    for (int ctx_i=0; ctx_i < LENGTH(contexts); ctx_i++) {
+        int64_t selected = 0;
+        IntroContainer elem = intro_cntr(&variants[0], ITYPE(Variant));
+        IntroContainer u = intro_push(&elem, 2);
+        for (int mi=0; mi < 3; mi++) {
+            assert(intro_attribute_expr_batch_x(contexts[ctx_i], intro_push(&u, mi), sizeof(Variant), count_variants, IATTR_when, results));
+            for (int i=0; i < count_variants; i++) {
+                selected += results[i];
+            }
+            assert(results[0] == (mi == 2) && results[1] == (mi == 0) && results[2] == (mi == 1));
+        }
+        assert(selected == count_variants);
+    }
+    free(results);
+    free(variants);
 
     return 0;
 }
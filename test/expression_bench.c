@@ -0,0 +1,77 @@
+#include <intro.h>
+#include "basic.h"
+#include <time.h>
+
+typedef struct {
+    int kind;
+    int64_t delta;
+    union {
+        int   as_int   I(when <-kind == 1);
+        float as_float I(when <-kind == 2);
+        char  as_char  I(when <-kind != 1 && <-kind != 2);
+    };
+} Variant;
+
+#include "expression_bench.c.intro"
+
+static double
+time_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main() {
+    // evaluate 'when' for every union member of a million elements
+    // once with the generated functions and once with the bytecode
+    assert(INTRO_CTX->expr_funcs != NULL);
+    IntroContext vm_ctx = *INTRO_CTX;
+    vm_ctx.expr_funcs = NULL;
+    IntroContext * contexts [] = {INTRO_CTX, &vm_ctx};
+    const char * context_names [] = {"native", "bytecode"};
+
+    const int count_variants = 1000000;
+    Variant * variants = malloc(count_variants * sizeof(*variants));
+    for (int i=0; i < count_variants; i++) {
+        variants[i].kind = i % 3;
+        variants[i].delta = 0;
+    }
+    for (int ctx_i=0; ctx_i < LENGTH(contexts); ctx_i++) {
+        int64_t selected = 0, value;
+        double start = time_seconds();
+        for (int i=0; i < count_variants; i++) {
+            IntroContainer elem = intro_cntr(&variants[i], ITYPE(Variant));
+            IntroContainer u = intro_push(&elem, 2);
+            for (int mi=0; mi < 3; mi++) {
+                intro_attribute_expr_x(contexts[ctx_i], intro_push(&u, mi), IATTR_when, &value);
+                selected += value;
+            }
+        }
+        double elapsed = time_seconds() - start;
+        assert(selected == count_variants);
+        printf("when over %i union elements (%s): %8.3f ms\n", count_variants, context_names[ctx_i], elapsed * 1000.0);
+    }
+
+    // the same with one batch per union member
+    int64_t * results = malloc(count_variants * sizeof(*results));
+    for (int ctx_i=0; ctx_i < LENGTH(contexts); ctx_i++) {
+        int64_t selected = 0;
+        double start = time_seconds();
+        IntroContainer elem = intro_cntr(&variants[0], ITYPE(Variant));
+        IntroContainer u = intro_push(&elem, 2);
+        for (int mi=0; mi < 3; mi++) {
+            assert(intro_attribute_expr_batch_x(contexts[ctx_i], intro_push(&u, mi), sizeof(Variant), count_variants, IATTR_when, results));
+            for (int i=0; i < count_variants; i++) {
+                selected += results[i];
+            }
+        }
+        double elapsed = time_seconds() - start;
+        assert(selected == count_variants);
+        printf("when over %i union elements (%s, batch): %8.3f ms\n", count_variants, context_names[ctx_i], elapsed * 1000.0);
+    }
+    free(results);
+    free(variants);
+
+    return 0;
+}